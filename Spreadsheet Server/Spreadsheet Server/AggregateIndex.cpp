@@ -0,0 +1,161 @@
+#include "AggregateIndex.h"
+#include <limits>
+#include <algorithm>
+
+// See AggregateIndex.h for documentation
+
+AggregateIndex::AggregateIndex() : columns() {
+}
+
+AggregateIndex::Node AggregateIndex::Empty() {
+	return { 0, numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), 0, 0, 0, 0 };
+}
+
+AggregateIndex::Node AggregateIndex::Leaf(const CellValue& value) {
+	Node leaf = Empty();
+	if (value.GetKind() == CellValue::Kind::Number) {
+		leaf.sum = leaf.min = leaf.max = value.GetNumber();
+		leaf.count = 1;
+	}
+	else if (value.GetKind() == CellValue::Kind::Error) {
+		leaf.errors = 1;
+	}
+	return leaf;
+}
+
+void AggregateIndex::Combine(Node& into, const Node& from) {
+	into.sum += from.sum;
+	into.min = min(into.min, from.min);
+	into.max = max(into.max, from.max);
+	into.count += from.count;
+	into.errors += from.errors;
+}
+
+/// <summary>
+/// Rows spanned by a new column tree
+/// </summary>
+static const int InitialRows = 64;
+
+void AggregateIndex::Update(const CellId cell, const CellValue& value) {
+	Node leaf = Leaf(value);
+	const bool clearing = leaf.count == 0 && leaf.errors == 0;
+	auto found = columns.find(cell.Column());
+	if (found == columns.end()) {
+		// Nothing to remove from a column that never held a value
+		if (clearing)
+			return;
+		found = columns.emplace(cell.Column(), Column{ vector<Node>(1, Empty()), InitialRows }).first;
+	}
+
+	Column& column = found->second;
+	if (cell.Row() >= column.rows) {
+		// Nothing to remove below the span either
+		if (clearing)
+			return;
+		// Double the span until it covers the row: the old root becomes
+		// the left child of a new root with the same aggregate
+		while (cell.Row() >= column.rows) {
+			column.tree.push_back(column.tree[0]);
+			column.tree[0].left = (uint32_t)(column.tree.size() - 1);
+			column.tree[0].right = 0;
+			column.rows *= 2;
+		}
+	}
+	Update(column.tree, 0, 0, column.rows - 1, cell.Row(), leaf);
+}
+
+void AggregateIndex::Update(vector<Node>& tree, const uint32_t node, const int low, const int high, const int row, const Node& leaf) {
+	if (low == high) {
+		uint32_t left = tree[node].left, right = tree[node].right;
+		tree[node] = leaf;
+		tree[node].left = left;
+		tree[node].right = right;
+		return;
+	}
+
+	int middle = low + (high - low) / 2;
+	bool goLeft = row <= middle;
+	uint32_t child = goLeft ? tree[node].left : tree[node].right;
+	if (child == 0) {
+		// Clearing a row that never held a value changes nothing
+		if (leaf.count == 0 && leaf.errors == 0)
+			return;
+		// Pushing may reallocate, so index rather than hold references across it
+		child = (uint32_t)tree.size();
+		tree.push_back(Empty());
+		if (goLeft)
+			tree[node].left = child;
+		else
+			tree[node].right = child;
+	}
+	if (goLeft)
+		Update(tree, child, low, middle, row, leaf);
+	else
+		Update(tree, child, middle + 1, high, row, leaf);
+
+	Node combined = Empty();
+	if (tree[node].left != 0)
+		Combine(combined, tree[tree[node].left]);
+	if (tree[node].right != 0)
+		Combine(combined, tree[tree[node].right]);
+	combined.left = tree[node].left;
+	combined.right = tree[node].right;
+	tree[node] = combined;
+}
+
+void AggregateIndex::Query(const vector<Node>& tree, const uint32_t node, const int low, const int high,
+	const int queryLow, const int queryHigh, Node& result) {
+	if (queryHigh < low || queryLow > high)
+		return;
+	if (queryLow <= low && high <= queryHigh) {
+		Combine(result, tree[node]);
+		return;
+	}
+	int middle = low + (high - low) / 2;
+	if (tree[node].left != 0)
+		Query(tree, tree[node].left, low, middle, queryLow, queryHigh, result);
+	if (tree[node].right != 0)
+		Query(tree, tree[node].right, middle + 1, high, queryLow, queryHigh, result);
+}
+
+double AggregateIndex::Aggregate(const OpCode function, const CellRange& range) const {
+	Node result = Empty();
+	const int firstColumn = range.TopLeft().Column(), lastColumn = range.BottomRight().Column();
+	const int firstRow = range.TopLeft().Row(), lastRow = range.BottomRight().Row();
+
+	auto queryColumn = [&](const Column& column) {
+		Query(column.tree, 0, 0, column.rows - 1, firstRow, lastRow, result);
+	};
+	if ((size_t)(lastColumn - firstColumn + 1) > columns.size()) {
+		// Wide range over a sparse sheet: only visit columns that exist
+		for (const pair<const int, Column>& column : columns)
+			if (column.first >= firstColumn && column.first <= lastColumn)
+				queryColumn(column.second);
+	}
+	else {
+		for (int column = firstColumn; column <= lastColumn; column++) {
+			auto tree = columns.find(column);
+			if (tree != columns.end())
+				queryColumn(tree->second);
+		}
+	}
+
+	if (result.errors != 0)
+		throw exception();
+	switch (function) {
+	case OpCode::Sum:
+		return result.sum;
+	case OpCode::Average:
+		if (result.count == 0)
+			throw exception();
+		return result.sum / result.count;
+	case OpCode::Min:
+		return result.count == 0 ? 0 : result.min;
+	case OpCode::Max:
+		return result.count == 0 ? 0 : result.max;
+	case OpCode::Count:
+		return result.count;
+	default:
+		throw exception();
+	}
+}
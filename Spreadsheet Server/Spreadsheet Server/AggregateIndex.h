@@ -0,0 +1,92 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "CellId.h"
+#include "CellRange.h"
+#include "CellValue.h"
+#include "Formula.h"
+
+#ifndef AggregateIndex_H
+#define AggregateIndex_H
+
+using namespace std;
+
+/// <summary>
+/// Keeps the sum, count, minimum, maximum and number of errors of every
+/// column in a segment tree over its rows, so that SUM, AVERAGE, MIN, MAX
+/// and COUNT of a range take O(columns * log rows) instead of visiting
+/// every cell, and changing one cell's value takes O(log rows).
+/// Trees are only allocated for columns and rows that have ever held a value.
+/// Queries are safe to run concurrently with each other, but not with Update
+/// </summary>
+class AggregateIndex : public RangeLookup
+{
+private:
+	/// <summary>
+	/// Aggregate of one block of rows in a column
+	/// </summary>
+	struct Node
+	{
+		double sum;
+		double min;
+		double max;
+		uint32_t count;
+		uint32_t errors;
+		/// <summary>
+		/// Indices of the child nodes in the column's node vector, 0 if absent
+		/// (the root is always index 0, so it can never be a child)
+		/// </summary>
+		uint32_t left;
+		uint32_t right;
+	};
+
+	/// <summary>
+	/// Segment tree of one column, root first, over rows 0 through rows - 1.
+	/// Sheets are tall but mostly used near the top, so trees start small and
+	/// double their span whenever a value lands below it, keeping their height
+	/// proportional to the log of the rows actually used
+	/// </summary>
+	struct Column
+	{
+		vector<Node> tree;
+		int rows;
+	};
+
+	/// <summary>
+	/// Tree of each column that has ever held a value
+	/// </summary>
+	unordered_map<int, Column> columns;
+
+	static Node Empty();
+	static Node Leaf(const CellValue& value);
+	static void Combine(Node& into, const Node& from);
+	static void Update(vector<Node>& tree, const uint32_t node, const int low, const int high, const int row, const Node& leaf);
+	static void Query(const vector<Node>& tree, const uint32_t node, const int low, const int high,
+		const int queryLow, const int queryHigh, Node& result);
+
+public:
+	/// <summary>
+	/// Creates an index in which every cell is empty
+	/// </summary>
+	AggregateIndex();
+
+	/// <summary>
+	/// Records a cell's new value. Numbers are aggregated, errors are counted
+	/// and text or empty values are ignored
+	/// </summary>
+	/// <param name="cell">Cell whose value changed</param>
+	/// <param name="value">The cell's new value</param>
+	void Update(const CellId cell, const CellValue& value);
+
+	/// <summary>
+	/// Computes an aggregate function over a range of cells.
+	/// Throws if the range contains an error, or if it has no numbers to average
+	/// </summary>
+	/// <param name="function">One of OpCode::Sum, Average, Min, Max or Count</param>
+	/// <param name="range">Cells to aggregate</param>
+	/// <returns>The aggregate value; MIN and MAX of a range without numbers are 0</returns>
+	double Aggregate(const OpCode function, const CellRange& range) const override;
+};
+
+#endif
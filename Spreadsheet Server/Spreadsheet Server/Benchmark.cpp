@@ -0,0 +1,161 @@
+// Recalculation benchmarks. Only compiled when SPREADSHEET_BENCHMARK is defined,
+// which also removes the server's main. Build & run from this folder with:
+//   g++ -O2 -DSPREADSHEET_BENCHMARK -std=c++17 -I.. -o benchmark.out *.cpp -lstdc++fs -lpthread
+//   ./benchmark.out
+
+#ifdef SPREADSHEET_BENCHMARK
+
+#include <iostream>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include "SpreadsheetState.h"
+
+using namespace std;
+
+/// <summary>
+/// Client ID used for every edit made by the benchmarks
+/// </summary>
+const int BenchmarkClient = 1;
+
+/// <summary>
+/// Selects and edits a cell as the benchmark client
+/// </summary>
+/// <param name="ss">Spreadsheet to edit</param>
+/// <param name="cell">Cell to edit</param>
+/// <param name="contents">New contents</param>
+void Edit(SpreadsheetState& ss, const CellId cell, const string contents) {
+	ss.SelectCell(cell, BenchmarkClient);
+	if (!ss.EditCell(cell, contents, BenchmarkClient))
+		cout << "Edit of " << cell.ToString() << " rejected" << endl;
+}
+
+/// <summary>
+/// Builds a sheet where every cell outside column A references A1,
+/// so editing A1 dirties one very wide level
+/// </summary>
+/// <param name="ss">Empty spreadsheet to fill</param>
+void BuildWideFanOut(SpreadsheetState& ss) {
+	Edit(ss, CellId(0, 1), "1");
+	for (int column = 1; column < 26; column++)
+		for (int row = 1; row <= 99; row++)
+			Edit(ss, CellId(column, row), "=A1*2+" + to_string(row));
+}
+
+/// <summary>
+/// Builds a sheet where every cell references the one before it,
+/// so editing A1 dirties one level per cell
+/// </summary>
+/// <param name="ss">Empty spreadsheet to fill</param>
+void BuildDeepChain(SpreadsheetState& ss) {
+	Edit(ss, CellId(0, 1), "1");
+	CellId previous(0, 1);
+	for (int column = 0; column < 26; column++)
+		for (int row = 1; row <= 99; row++) {
+			if (column == 0 && row == 1)
+				continue;
+			Edit(ss, CellId(column, row), "=" + previous.ToString() + "+1");
+			previous = CellId(column, row);
+		}
+}
+
+/// <summary>
+/// Builds a sheet of fill-down columns: column B scales A1 by the row number, and
+/// every later column repeats one formula down all its rows (=B1*A1+..., =B2*A2+..., ...),
+/// so editing A1 dirties one wide level of same-shaped formulas
+/// </summary>
+/// <param name="ss">Empty spreadsheet to fill</param>
+void BuildFillDown(SpreadsheetState& ss) {
+	Edit(ss, CellId(0, 1), "1");
+	for (int row = 2; row <= 99; row++)
+		Edit(ss, CellId(0, row), to_string(row));
+	for (int row = 1; row <= 99; row++)
+		Edit(ss, CellId(1, row), "=A1*" + to_string(row));
+	for (int column = 2; column < 26; column++)
+		for (int row = 1; row <= 99; row++) {
+			string r = to_string(row);
+			Edit(ss, CellId(column, row), "=B" + r + "*A" + r + "+B" + r + "/(A" + r + "+1)-" + to_string(column));
+		}
+}
+
+/// <summary>
+/// Times repeated edits of A1 on a freshly built sheet
+/// </summary>
+/// <param name="name">Name of the sheet shape</param>
+/// <param name="build">Fills an empty sheet with the shape</param>
+/// <param name="threshold">Parallel threshold to run with</param>
+/// <param name="iterations">Number of edits to time</param>
+/// <param name="batch">Batch threshold to run with</param>
+void Run(const string name, const function<void(SpreadsheetState&)>& build, const size_t threshold, const int iterations,
+	const size_t batch = SIZE_MAX) {
+	SpreadsheetState::SetParallelThreshold(threshold);
+	SpreadsheetState::SetBatchThreshold(batch);
+	SpreadsheetState ss;
+	build(ss);
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+		Edit(ss, CellId(0, 1), to_string(i + 2));
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+	cout << name << (threshold == SIZE_MAX ? " (serial" : " (parallel") << (batch == SIZE_MAX ? "): " : ", batched): ")
+		<< elapsed.count() / iterations << " us per edit, "
+		<< ss.GetRecalculatedValues().size() << " cells recomputed" << endl;
+}
+
+/// <summary>
+/// Times evaluating one fill-down column's formula for many rows, once a row at a time
+/// and once as a batch, leaving out everything else a recalculation does
+/// </summary>
+/// <param name="rows">Number of rows to evaluate</param>
+/// <param name="iterations">Number of times to evaluate every row</param>
+void RunKernel(const size_t rows, const int iterations) {
+	Formula formula("=B1*A1+B1/(A1+1)-3");
+	const size_t variables = formula.VariableCount();
+	vector<double> columns(variables * rows);
+	for (size_t i = 0; i < columns.size(); i++)
+		columns[i] = (double)(i % 97) + 0.5;
+
+	double checksum = 0;
+	vector<double> lane(variables);
+	auto start = chrono::steady_clock::now();
+	for (int iteration = 0; iteration < iterations; iteration++)
+		for (size_t row = 0; row < rows; row++) {
+			for (size_t variable = 0; variable < variables; variable++)
+				lane[variable] = columns[variable * rows + row];
+			checksum += formula.Evaluate(lane);
+		}
+	double scalar = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ((double)rows * iterations);
+
+	vector<double> results(rows);
+	vector<uint8_t> failed(rows);
+	start = chrono::steady_clock::now();
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		formula.EvaluateBatch(columns.data(), rows, results.data(), failed.data());
+		checksum -= results[iteration % rows];
+	}
+	double batched = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ((double)rows * iterations);
+
+	// Keep the optimizer from dropping the evaluations
+	volatile double sink = checksum;
+	(void)sink;
+
+	cout << "Fill-down kernel: " << scalar << " ns per row scalar, " << batched << " ns per row batched" << endl;
+}
+
+int main(int, char**) {
+	cout << "Recalculation threads: " << ThreadPool::Shared().Concurrency() << endl;
+
+	Run("Wide fan-out", BuildWideFanOut, SIZE_MAX, 50);
+	Run("Wide fan-out", BuildWideFanOut, 64, 50);
+	Run("Deep chain", BuildDeepChain, SIZE_MAX, 50);
+	Run("Deep chain", BuildDeepChain, 64, 50);
+	Run("Fill-down", BuildFillDown, SIZE_MAX, 200);
+	Run("Fill-down", BuildFillDown, SIZE_MAX, 200, 8);
+	Run("Fill-down", BuildFillDown, 64, 200, 8);
+	RunKernel(4096, 500);
+
+	return 0;
+}
+
+#endif
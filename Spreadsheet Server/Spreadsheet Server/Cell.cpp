@@ -1,56 +1,90 @@
 #include "Cell.h"
-#include <list>
 
 // See Cell.h for function documentation
 
-Cell::Cell() : name(), contents(""), previousContents() {
+Cell::Cell() : id(), contents(""), version(VersionLog::NoVersion), formula() {
 }
 
-Cell::Cell(const string name, const string contents) : name(name), contents(contents), previousContents() {
+Cell::Cell(const CellId id, const string contents) : id(id), contents(), version(VersionLog::NoVersion), formula(Compile(contents, id)) {
+	if (!formula)
+		this->contents = contents;
 }
 
-Cell::Cell(const string name, const string contents, const list<string> priorContents) : name(name), contents(contents), previousContents(priorContents) {
+Cell::Cell(const CellId id, const string contents, const uint32_t version) : id(id), contents(), version(version), formula(Compile(contents, id)) {
+	if (!formula)
+		this->contents = contents;
+}
+
+Cell Cell::Uncompiled(const CellId id, const string& contents, const uint32_t version) {
+	Cell cell;
+	cell.id = id;
+	cell.contents = contents;
+	cell.version = version;
+	return cell;
+}
+
+const CellId Cell::GetId() const {
+	return id;
 }
 
 const string Cell::GetName() const {
-	return name;
+	return id.ToString();
 }
 
 const string Cell::GetContents() const {
+	if (formula)
+		return formula->ToString(id);
 	return contents;
 }
 
-void Cell::SetContents(const string newContents) {
-	previousContents.push_front(contents);
-	contents = newContents;
+const CellValue Cell::GetValue() const {
+	return value;
+}
+
+void Cell::SetValue(const CellValue newValue) {
+	value = newValue;
+}
+
+uint32_t Cell::GetVersion() const {
+	return version;
+}
+
+void Cell::SetContents(const string newContents, const uint32_t newVersion, const shared_ptr<const Formula> compiled) {
+	version = newVersion;
+	formula = compiled ? compiled : Compile(newContents, id);
+	contents = formula ? "" : newContents;
 }
 
-const vector<string> Cell::GetVariables() const {
-	if (contents.size() > 0 && contents[0] == '=')
-		return Formula(contents).GetVariables();
-	return vector<string>();
+void Cell::ShareFormula(const shared_ptr<const Formula> shared) {
+	if (shared) {
+		formula = shared;
+		contents = "";
+	}
 }
 
-bool Cell::Revert() {
-	if (!CanRevert())
-		return false;
-	contents = previousContents.front();
-	previousContents.pop_front();
-	return true;
+shared_ptr<const Formula> Cell::Compile(const string& contents, const CellId anchor) {
+	if (contents.size() == 0 || contents[0] != '=')
+		return nullptr;
+	FormulaParseResult result;
+	return Formula::Parse(contents, anchor, result);
 }
 
-const bool Cell::CanRevert() const {
-	return previousContents.size() != 0;
+const shared_ptr<const Formula>& Cell::GetFormula() const {
+	return formula;
 }
 
-const string Cell::GetPreviousState() const {
-	return previousContents.front();
+vector<CellId> Cell::GetVariables() const {
+	if (formula)
+		return formula->GetVariables(id);
+	return vector<CellId>();
 }
 
-const list<string> Cell::GetPreviousStates() const {
-	return previousContents;
+vector<CellRange> Cell::GetRanges() const {
+	if (formula)
+		return formula->GetRanges(id);
+	return vector<CellRange>();
 }
 
 bool Cell::operator< (const Cell& other) const {
-	return this->name < other.name;
+	return this->id < other.id;
 }
\ No newline at end of file
@@ -1,7 +1,11 @@
 #pragma once
 #include <string>
-#include <list>
+#include <memory>
 #include "Formula.h"
+#include "CellId.h"
+#include "CellValue.h"
+#include "CellRange.h"
+#include "VersionLog.h"
 
 #ifndef Cell_H
 #define Cell_H
@@ -15,18 +19,32 @@ class Cell
 {
 private:
 	/// <summary>
-	/// Name of this cell
+	/// Coordinates of this cell
 	/// </summary>
-	string name;
+	CellId id;
 	/// <summary>
-	/// Contents of this cell
+	/// Contents of this cell, if they are not a valid formula.
+	/// Formula contents are rebuilt from formula when needed
 	/// </summary>
 	string contents;
 
 	/// <summary>
-	/// Previous contents of this cell
+	/// Version of this cell in its spreadsheet's VersionLog, which holds
+	/// its previous contents. NoVersion if it was never edited
 	/// </summary>
-	list<string> previousContents;
+	uint32_t version;
+
+	/// <summary>
+	/// Value of this cell as last computed by the spreadsheet
+	/// </summary>
+	CellValue value;
+
+	/// <summary>
+	/// Compiled form of contents, relative to id. Null if contents are not a
+	/// valid formula. Immutable, so copies of this cell, and other cells with
+	/// the same relative formula, share it
+	/// </summary>
+	shared_ptr<const Formula> formula;
 
 public:
 
@@ -38,20 +56,36 @@ public:
 	/// <summary>
 	/// Create a new cell with no prior state
 	/// </summary>
-	/// <param name="name">Name of cell, should be [A-Z][0-9]</param>
+	/// <param name="id">Coordinates of cell</param>
 	/// <param name="contents">Contents of cell. Should be a valid formula, string, or double</param>
-	Cell(const string name, const string contents); // contents of cell get set through method
+	Cell(const CellId id, const string contents); // contents of cell get set through method
 
 	/// <summary>
-	/// Creates a new cell with a prior state
+	/// Creates a cell at a version of its spreadsheet's history
 	/// </summary>
-	/// <param name="name">Cell name, should be [A-Z][0-9]</param>
+	/// <param name="id">Coordinates of cell</param>
 	/// <param name="contents">Contents of cell. Should be a valid formula, string, or double</param>
-	/// <param name="priorContents">Prior contents of cell before last edit. Should be a valid formula, string, or double</param>
-	Cell(const string name, const string contents, const list<string> priorContents);
+	/// <param name="version">Version in the spreadsheet's VersionLog holding contents</param>
+	Cell(const CellId id, const string contents, const uint32_t version);
+
+	/// <summary>
+	/// Creates a cell at a version of its spreadsheet's history without compiling its
+	/// contents, for loading a spreadsheet. A formula stays text, and counts as invalid,
+	/// until ShareFormula gives the cell its compiled form
+	/// </summary>
+	/// <param name="id">Coordinates of cell</param>
+	/// <param name="contents">Contents of cell</param>
+	/// <param name="version">Version in the spreadsheet's VersionLog holding contents</param>
+	static Cell Uncompiled(const CellId id, const string& contents, const uint32_t version);
+
+	/// <summary>
+	/// Get cell coordinates
+	/// </summary>
+	/// <returns>Id of cell</returns>
+	const CellId GetId() const;
 
 	/// <summary>
-	/// Get cell name
+	/// Get cell name. Only meant for serialization, use GetId everywhere else
 	/// </summary>
 	/// <returns>Name of cell</returns>
 	const string GetName() const;
@@ -62,48 +96,71 @@ public:
 	/// <returns>Contents of cell</returns>
 	const string GetContents() const;
 
+	/// <summary>
+	/// Gets the value of this cell, as last computed by the spreadsheet
+	/// </summary>
+	/// <returns>Computed value of cell</returns>
+	const CellValue GetValue() const;
+
+	/// <summary>
+	/// Stores a newly computed value for this cell
+	/// </summary>
+	/// <param name="newValue">Computed value</param>
+	void SetValue(const CellValue newValue);
+
 	/// <summary>
 	/// Gets all other cells referenced by this cell (variables)
 	/// If this cell is not a formula the list returned is empty
+	/// Does not parse anything, the list is resolved from the compiled formula
 	/// </summary>
 	/// <returns>Variables (cells) in this cell's contents</returns>
-	const vector<string> GetVariables() const;
+	vector<CellId> GetVariables() const;
 
 	/// <summary>
-	/// Sets the contents of this cell.
-	/// Throws an exception with an appropriate message if there is an issue with the new contents
+	/// Gets the ranges passed to aggregate functions in this cell's formula
+	/// If this cell is not a formula the list returned is empty
 	/// </summary>
-	/// <param name="newContents">New contents of cell</param>
-	void SetContents(const string newContents);
+	/// <returns>Distinct ranges in this cell's contents</returns>
+	vector<CellRange> GetRanges() const;
+
+	/// <summary>
+	/// Gets the compiled formula in this cell's contents
+	/// </summary>
+	/// <returns>The formula, or null if the contents are not a valid formula</returns>
+	const shared_ptr<const Formula>& GetFormula() const;
 
 	/// <summary>
-	/// Gets the state of this cell prior to the most recent edit
+	/// Compiles cell contents, if they are a formula, into a formula of its own.
+	/// Spreadsheets share formulas between cells through a FormulaTable instead
 	/// </summary>
-	/// <returns></returns>
-	const string GetPreviousState() const;
+	/// <param name="contents">Cell contents</param>
+	/// <param name="anchor">Cell the contents are for</param>
+	/// <returns>The compiled formula, or null if contents are not a valid formula</returns>
+	static shared_ptr<const Formula> Compile(const string& contents, const CellId anchor);
 
 	/// <summary>
-	/// Gets a list of all prior states of this cell
-	/// Current state is not included
+	/// Gets the version of this cell in its spreadsheet's VersionLog
 	/// </summary>
-	/// <returns>A list of formulas, with front() being the most recent state of
-	/// the cell and back() being the least recent state</returns>
-	const list<string> GetPreviousStates() const;
+	/// <returns>The version, NoVersion if the cell was never edited</returns>
+	uint32_t GetVersion() const;
 
 	/// <summary>
-	/// Whether a previous state exists for this cell
-	/// In other words: true if we can revert this cell
+	/// Sets the contents of this cell. Edits, reverts and undos all come through
+	/// here, the VersionLog decides which version the cell is moving to
 	/// </summary>
-	/// <returns>True if we have a previous state to rever to,
-	/// false if the previous state was empty</returns>
-	const bool CanRevert() const;
+	/// <param name="newContents">New contents of cell</param>
+	/// <param name="newVersion">Version in the spreadsheet's VersionLog holding newContents</param>
+	/// <param name="compiled">newContents already compiled for this cell, to avoid parsing it again.
+	/// If null, newContents is compiled here</param>
+	void SetContents(const string newContents, const uint32_t newVersion, const shared_ptr<const Formula> compiled = nullptr);
 
 	/// <summary>
-	/// Reverts this cell to its previous content.
-	/// If no previous content exists, returns false
+	/// Replaces this cell's formula with an equivalent one compiled for the same
+	/// cell, such as the copy a FormulaTable shares, or gives a cell made by
+	/// Uncompiled its formula. Contents and history are unchanged
 	/// </summary>
-	/// <returns>True on successful revert, else false</returns>
-	bool Revert();
+	/// <param name="shared">Formula compiled from this cell's contents for this cell</param>
+	void ShareFormula(const shared_ptr<const Formula> shared);
 
 	/// <summary>
 	/// Less than operator
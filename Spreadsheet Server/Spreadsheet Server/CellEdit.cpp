@@ -1,6 +1,6 @@
 #include "CellEdit.h"
 
-CellEdit::CellEdit(string name, string state) : PriorState(state), name(name)
+CellEdit::CellEdit(const CellId id, const string state) : PriorState(state), id(id)
 {
 }
 
@@ -8,6 +8,10 @@ string CellEdit::GetPriorContents() const {
 	return PriorState;
 }
 
+const CellId CellEdit::GetId() const {
+	return id;
+}
+
 const string CellEdit::GetName() const {
-	return name;
+	return id.ToString();
 }
\ No newline at end of file
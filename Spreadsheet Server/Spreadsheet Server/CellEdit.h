@@ -19,17 +19,18 @@ private:
 	string PriorState;
 
 	/// <summary>
-	/// Name of the cell
+	/// Coordinates of the cell
 	/// </summary>
-	string name;
+	CellId id;
 
 public:
 
 	/// <summary>
 	/// Creates a new CellEdit
 	/// </summary>
+	/// <param name="id">Cell that was edited</param>
 	/// <param name="state">State of the cell BEFORE this edit</param>
-	CellEdit(const string name, const string state);
+	CellEdit(const CellId id, const string state);
 
 	/// <summary>
 	/// Gets the contents of the prior state of the cell stored here
@@ -38,7 +39,13 @@ public:
 	string GetPriorContents() const;
 
 	/// <summary>
-	/// Get cell name
+	/// Get cell coordinates
+	/// </summary>
+	/// <returns>Id of cell stored in this object</returns>
+	const CellId GetId() const;
+
+	/// <summary>
+	/// Get cell name. Only meant for serialization
 	/// </summary>
 	/// <returns>Name of cell stored in this object</returns>
 	const string GetName() const;
@@ -0,0 +1,74 @@
+#include "CellId.h"
+
+// See CellId.h for documentation
+
+CellId::CellId() : packed(InvalidPacked) {
+}
+
+CellId::CellId(const int column, const int row) : packed(((uint64_t)(uint32_t)column << 32) | (uint32_t)row) {
+}
+
+/// <summary>
+/// Most letters and digits in a valid cell name, as in XFD1048576
+/// </summary>
+static const size_t MaxLetters = 3;
+static const size_t MaxDigits = 7;
+
+CellId CellId::Parse(const string& name) {
+	if (name.size() < 2 || name.size() > MaxLetters + MaxDigits)
+		return CellId();
+
+	// Columns are numbered in bijective base 26: A is 1, Z is 26, AA is 27
+	size_t i = 0;
+	int column = 0;
+	for (; i < name.size() && name[i] >= 'A' && name[i] <= 'Z'; i++)
+		column = column * 26 + (name[i] - 'A' + 1);
+	if (i == 0 || i > MaxLetters || i == name.size() || name.size() - i > MaxDigits)
+		return CellId();
+
+	int row = 0;
+	for (; i < name.size(); i++) {
+		if (name[i] < '0' || name[i] > '9')
+			return CellId();
+		row = row * 10 + (name[i] - '0');
+	}
+
+	if (column > Columns || row >= Rows)
+		return CellId();
+	return CellId(column - 1, row);
+}
+
+const bool CellId::IsValid() const {
+	return packed != InvalidPacked;
+}
+
+const int CellId::Column() const {
+	return (int)(packed >> 32);
+}
+
+const int CellId::Row() const {
+	return (int)(packed & 0xFFFFFFFF);
+}
+
+const uint64_t CellId::Packed() const {
+	return packed;
+}
+
+string CellId::ToString() const {
+	string name;
+	for (int column = Column() + 1; column > 0; column = (column - 1) / 26)
+		name.insert(name.begin(), (char)('A' + (column - 1) % 26));
+	return name + to_string(Row());
+}
+
+bool CellId::operator== (const CellId& other) const {
+	return packed == other.packed;
+}
+
+bool CellId::operator!= (const CellId& other) const {
+	return packed != other.packed;
+}
+
+bool CellId::operator< (const CellId& other) const {
+	return packed < other.packed;
+}
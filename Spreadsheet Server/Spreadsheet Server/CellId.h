@@ -0,0 +1,112 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <functional>
+
+#ifndef CellId_H
+#define CellId_H
+
+using namespace std;
+
+/// <summary>
+/// Identifies a cell by its packed column/row coordinates.
+/// Cell names are parsed into a CellId once, when they come in from a client or a file,
+/// and converted back to a name only when sent out or saved
+/// </summary>
+class CellId
+{
+private:
+	/// <summary>
+	/// Column in the upper 32 bits, row in the lower 32 bits
+	/// </summary>
+	uint64_t packed;
+
+	/// <summary>
+	/// Packed value used for ids that don't refer to a cell
+	/// </summary>
+	static const uint64_t InvalidPacked = UINT64_MAX;
+
+public:
+	/// <summary>
+	/// Number of columns in a spreadsheet, A through XFD
+	/// </summary>
+	static const int Columns = 16384;
+
+	/// <summary>
+	/// Number of rows in a spreadsheet, 0 through 1,048,576
+	/// </summary>
+	static const int Rows = 1048577;
+
+	/// <summary>
+	/// Creates an invalid CellId
+	/// </summary>
+	CellId();
+
+	/// <summary>
+	/// Creates a CellId from coordinates
+	/// </summary>
+	/// <param name="column">Zero-based column, 0 is column A</param>
+	/// <param name="row">Row number, as written in the cell name</param>
+	CellId(const int column, const int row);
+
+	/// <summary>
+	/// Parses a cell name of the form [A-Z]{1,3}[0-9]{1,7}, e.g. B12 or XFD1048576,
+	/// where columns count A to Z, then AA to AZ, BA and so on up to XFD.
+	/// Lowercase letters are not accepted. Names longer than the longest valid
+	/// name are rejected before being read, so this takes constant time
+	/// </summary>
+	/// <param name="name">Cell name</param>
+	/// <returns>The parsed id, or an invalid id if name is not a valid cell name</returns>
+	static CellId Parse(const string& name);
+
+	/// <summary>
+	/// Whether this id refers to a cell
+	/// </summary>
+	/// <returns>False if this id came from a failed Parse or the default constructor</returns>
+	const bool IsValid() const;
+
+	/// <summary>
+	/// Gets the zero-based column
+	/// </summary>
+	/// <returns>Column, 0 is column A</returns>
+	const int Column() const;
+
+	/// <summary>
+	/// Gets the row, as written in the cell name
+	/// </summary>
+	/// <returns>Row number</returns>
+	const int Row() const;
+
+	/// <summary>
+	/// Gets the packed integer representation, for hashing and serialization
+	/// </summary>
+	/// <returns>Packed column/row</returns>
+	const uint64_t Packed() const;
+
+	/// <summary>
+	/// Converts this id back into a cell name
+	/// </summary>
+	/// <returns>Cell name, e.g. "B12" or "AA7"</returns>
+	string ToString() const;
+
+	bool operator== (const CellId& other) const;
+	bool operator!= (const CellId& other) const;
+
+	/// <summary>
+	/// Orders ids by column, then by row
+	/// </summary>
+	bool operator< (const CellId& other) const;
+};
+
+namespace std {
+	/// <summary>
+	/// Allows CellId to be used as a key in unordered containers
+	/// </summary>
+	template<> struct hash<CellId> {
+		size_t operator()(const CellId& id) const {
+			return hash<uint64_t>()(id.Packed());
+		}
+	};
+}
+
+#endif
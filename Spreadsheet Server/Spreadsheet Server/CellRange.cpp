@@ -0,0 +1,51 @@
+#include "CellRange.h"
+#include <algorithm>
+
+// See CellRange.h for documentation
+
+CellRange::CellRange() : topLeft(), bottomRight() {
+}
+
+CellRange::CellRange(const CellId first, const CellId second) :
+	topLeft(min(first.Column(), second.Column()), min(first.Row(), second.Row())),
+	bottomRight(max(first.Column(), second.Column()), max(first.Row(), second.Row())) {
+}
+
+CellRange CellRange::Parse(const string& range) {
+	size_t colon = range.find(':');
+	if (colon == string::npos) {
+		CellId cell = CellId::Parse(range);
+		return cell.IsValid() ? CellRange(cell, cell) : CellRange();
+	}
+
+	CellId first = CellId::Parse(range.substr(0, colon));
+	CellId second = CellId::Parse(range.substr(colon + 1));
+	if (!first.IsValid() || !second.IsValid())
+		return CellRange();
+	return CellRange(first, second);
+}
+
+const bool CellRange::IsValid() const {
+	return topLeft.IsValid();
+}
+
+const CellId CellRange::TopLeft() const {
+	return topLeft;
+}
+
+const CellId CellRange::BottomRight() const {
+	return bottomRight;
+}
+
+const bool CellRange::Contains(const CellId cell) const {
+	return cell.Column() >= topLeft.Column() && cell.Column() <= bottomRight.Column()
+		&& cell.Row() >= topLeft.Row() && cell.Row() <= bottomRight.Row();
+}
+
+string CellRange::ToString() const {
+	return topLeft.ToString() + ":" + bottomRight.ToString();
+}
+
+bool CellRange::operator== (const CellRange& other) const {
+	return topLeft == other.topLeft && bottomRight == other.bottomRight;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <string>
+#include "CellId.h"
+
+#ifndef CellRange_H
+#define CellRange_H
+
+using namespace std;
+
+/// <summary>
+/// A rectangular block of cells, such as A1:B20, including both corners
+/// </summary>
+class CellRange
+{
+private:
+	/// <summary>
+	/// Corner with the lowest column and row
+	/// </summary>
+	CellId topLeft;
+
+	/// <summary>
+	/// Corner with the highest column and row
+	/// </summary>
+	CellId bottomRight;
+
+public:
+	/// <summary>
+	/// Creates an invalid range
+	/// </summary>
+	CellRange();
+
+	/// <summary>
+	/// Creates a range between two corners, given in any order
+	/// </summary>
+	/// <param name="first">One corner</param>
+	/// <param name="second">The opposite corner</param>
+	CellRange(const CellId first, const CellId second);
+
+	/// <summary>
+	/// Parses a range of the form A1:B20, or a single cell name as a one cell range
+	/// </summary>
+	/// <param name="range">Range text</param>
+	/// <returns>The parsed range, or an invalid range if either corner is not a valid cell name</returns>
+	static CellRange Parse(const string& range);
+
+	/// <summary>
+	/// Whether this range refers to cells
+	/// </summary>
+	/// <returns>False if this range came from a failed Parse or the default constructor</returns>
+	const bool IsValid() const;
+
+	/// <summary>
+	/// Gets the corner with the lowest column and row
+	/// </summary>
+	const CellId TopLeft() const;
+
+	/// <summary>
+	/// Gets the corner with the highest column and row
+	/// </summary>
+	const CellId BottomRight() const;
+
+	/// <summary>
+	/// Whether a cell is inside this range
+	/// </summary>
+	/// <param name="cell">Cell to check</param>
+	/// <returns>True if cell is inside or on the edge of this range</returns>
+	const bool Contains(const CellId cell) const;
+
+	/// <summary>
+	/// Converts this range back into text
+	/// </summary>
+	/// <returns>Range text, e.g. "A1:B20"</returns>
+	string ToString() const;
+
+	bool operator== (const CellRange& other) const;
+};
+
+#endif
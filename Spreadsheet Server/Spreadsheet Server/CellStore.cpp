@@ -0,0 +1,207 @@
+#include "CellStore.h"
+#include <bitset>
+#include <stdexcept>
+
+// See CellStore.h for documentation
+
+static_assert(CellStore::TileColumns * CellStore::TileRows == 64, "Tile::populated has one bit per slot");
+
+/// <summary>
+/// Bits of the tile key used for the tile row. Rows / TileRows tiles fit in 17 bits
+/// </summary>
+static const int TileRowBits = 17;
+
+/// <summary>
+/// Levels of the tile tree, each consuming 6 bits of the tile key. Columns / TileColumns
+/// tiles fit in 12 bits, so keys fit in 29 bits and 5 levels cover them
+/// </summary>
+static const int Levels = 5;
+static const int BitsPerLevel = 6;
+
+static_assert(((CellId::Rows + CellStore::TileRows - 1) / CellStore::TileRows) <= (1 << TileRowBits), "Tile rows fit their bits");
+static_assert(((CellId::Columns + CellStore::TileColumns - 1) / CellStore::TileColumns) <= (1 << (Levels * BitsPerLevel - TileRowBits)), "Tile keys fit the tree");
+
+/// <summary>
+/// Last owner handed out by NewOwner
+/// </summary>
+static atomic<uint64_t> lastOwner(0);
+
+CellStore::CellStore() : root(), size(0), owner(NewOwner()) {
+}
+
+CellStore::CellStore(const CellStore& other) : root(other.root), size(other.size), owner(NewOwner()) {
+	// Tiles other owned are now shared with this store, so neither may write them in place
+	other.owner = NewOwner();
+}
+
+CellStore::CellStore(CellStore&& other) : root(move(other.root)), size(other.size), owner(other.owner.load()) {
+	other.size = 0;
+	other.owner = NewOwner();
+}
+
+CellStore& CellStore::operator= (const CellStore& other) {
+	if (this != &other) {
+		root = other.root;
+		size = other.size;
+		owner = NewOwner();
+		other.owner = NewOwner();
+	}
+	return *this;
+}
+
+CellStore& CellStore::operator= (CellStore&& other) {
+	if (this != &other) {
+		root = move(other.root);
+		size = other.size;
+		owner = other.owner.load();
+		other.size = 0;
+		other.owner = NewOwner();
+	}
+	return *this;
+}
+
+uint64_t CellStore::NewOwner() {
+	return ++lastOwner;
+}
+
+uint64_t CellStore::TileKey(const CellId cell) {
+	return ((uint64_t)(cell.Column() / TileColumns) << TileRowBits) | (uint64_t)(cell.Row() / TileRows);
+}
+
+unsigned CellStore::SlotIndex(const CellId cell) {
+	return (unsigned)((cell.Column() % TileColumns) * TileRows + cell.Row() % TileRows);
+}
+
+unsigned CellStore::ChildIndex(const uint64_t key, const int level) {
+	return (unsigned)(key >> ((Levels - 1 - level) * BitsPerLevel)) & ((1 << BitsPerLevel) - 1);
+}
+
+size_t CellStore::Rank(const uint64_t mask, const unsigned index) {
+	return bitset<64>(mask & ((1ULL << index) - 1)).count();
+}
+
+bool CellStore::OnSheet(const CellId cell) {
+	return cell.IsValid() && cell.Column() < CellId::Columns && cell.Row() < CellId::Rows;
+}
+
+const Cell* CellStore::Find(const CellId cell) const {
+	if (!OnSheet(cell))
+		return nullptr;
+
+	const uint64_t key = TileKey(cell);
+	const Branch* branch = root.get();
+	for (int level = 0; branch != nullptr; level++) {
+		const unsigned child = ChildIndex(key, level);
+		if ((branch->present & (1ULL << child)) == 0)
+			return nullptr;
+		if (level < Levels - 1) {
+			branch = branch->branches[Rank(branch->present, child)].get();
+			continue;
+		}
+
+		const Tile& tile = *branch->tiles[Rank(branch->present, child)];
+		const unsigned slot = SlotIndex(cell);
+		if ((tile.populated & (1ULL << slot)) == 0)
+			return nullptr;
+		return &tile.cells[Rank(tile.populated, slot)];
+	}
+	return nullptr;
+}
+
+CellStore::Tile* CellStore::WritableTile(const CellId cell, const bool create) {
+	const uint64_t owner = this->owner;
+	if (!root) {
+		if (!create)
+			return nullptr;
+		root = make_shared<Branch>(Branch{ owner, 0, {}, {} });
+	}
+	else if (root->owner != owner) {
+		root = make_shared<Branch>(*root);
+		root->owner = owner;
+	}
+
+	const uint64_t key = TileKey(cell);
+	Branch* branch = root.get();
+	for (int level = 0; level < Levels - 1; level++) {
+		const unsigned child = ChildIndex(key, level);
+		const size_t rank = Rank(branch->present, child);
+		if ((branch->present & (1ULL << child)) == 0) {
+			if (!create)
+				return nullptr;
+			branch->branches.insert(branch->branches.begin() + rank, make_shared<Branch>(Branch{ owner, 0, {}, {} }));
+			branch->present |= 1ULL << child;
+		}
+		shared_ptr<Branch>& next = branch->branches[rank];
+		if (next->owner != owner) {
+			next = make_shared<Branch>(*next);
+			next->owner = owner;
+		}
+		branch = next.get();
+	}
+
+	const unsigned child = ChildIndex(key, Levels - 1);
+	const size_t rank = Rank(branch->present, child);
+	if ((branch->present & (1ULL << child)) == 0) {
+		if (!create)
+			return nullptr;
+		branch->tiles.insert(branch->tiles.begin() + rank, make_shared<Tile>(Tile{ owner, 0, {} }));
+		branch->present |= 1ULL << child;
+	}
+	shared_ptr<Tile>& tile = branch->tiles[rank];
+	if (tile->owner != owner) {
+		tile = make_shared<Tile>(*tile);
+		tile->owner = owner;
+	}
+	return tile.get();
+}
+
+Cell* CellStore::Modify(const CellId cell) {
+	// Check first, so looking for a missing cell doesn't copy anything
+	if (Find(cell) == nullptr)
+		return nullptr;
+	Tile* tile = WritableTile(cell, false);
+	return &tile->cells[Rank(tile->populated, SlotIndex(cell))];
+}
+
+Cell& CellStore::Insert(const CellId cell) {
+	if (!OnSheet(cell))
+		throw out_of_range("Cell " + cell.ToString() + " is not on the sheet");
+	Tile& tile = *WritableTile(cell, true);
+	const unsigned slot = SlotIndex(cell);
+	const size_t rank = Rank(tile.populated, slot);
+	if ((tile.populated & (1ULL << slot)) == 0) {
+		tile.cells.insert(tile.cells.begin() + rank, Cell(cell, ""));
+		tile.populated |= 1ULL << slot;
+		size++;
+	}
+	return tile.cells[rank];
+}
+
+bool CellStore::Contains(const CellId cell) const {
+	return Find(cell) != nullptr;
+}
+
+size_t CellStore::Size() const {
+	return size;
+}
+
+void CellStore::Clear() {
+	root.reset();
+	size = 0;
+}
+
+void CellStore::ForEach(const function<void(const Cell&)>& visit) const {
+	if (root)
+		ForEach(*root, 0, visit);
+}
+
+void CellStore::ForEach(const Branch& branch, const int level, const function<void(const Cell&)>& visit) {
+	if (level < Levels - 1) {
+		for (const shared_ptr<Branch>& next : branch.branches)
+			ForEach(*next, level + 1, visit);
+		return;
+	}
+	for (const shared_ptr<Tile>& tile : branch.tiles)
+		for (const Cell& cell : tile->cells)
+			visit(cell);
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <functional>
+#include <atomic>
+#include "Cell.h"
+#include "CellId.h"
+
+#ifndef CellStore_H
+#define CellStore_H
+
+using namespace std;
+
+/// <summary>
+/// Holds the cells of one spreadsheet in fixed-size tiles, each covering
+/// TileColumns columns by TileRows rows. A tile keeps only its populated
+/// cells, contiguously, in slot order, plus a bitmask of which slots are
+/// populated; a cell's position is the number of populated slots before it.
+/// Slots run down each column, the same order CellId sorts in, so walking
+/// a column or a whole tile touches memory in order.
+///
+/// Tiles are found through a tree with 64 children per branch, keyed by tile
+/// coordinates. Branches keep only the children that exist, the same way tiles
+/// keep only their cells, so memory is proportional to populated cells, not to
+/// sheet size. The tree is persistent: copying a CellStore copies only the
+/// pointer to its root, so taking a snapshot of a whole sheet is O(1). Every
+/// tile and branch records the owner that created it, and copying a store gives
+/// both stores new owners, so writing through a store copies the tile and
+/// branches on the way to it unless it created them since it was last copied.
+///
+/// Not thread safe, except that a copy may be read on one thread while the
+/// store it was copied from is written on another: writes never touch
+/// anything a copy can reach. Concurrent Find calls are fine, but nothing
+/// may run alongside Modify, Insert or Clear on the same store
+/// </summary>
+class CellStore
+{
+public:
+	/// <summary>
+	/// Columns covered by one tile
+	/// </summary>
+	static const int TileColumns = 4;
+
+	/// <summary>
+	/// Rows covered by one tile
+	/// </summary>
+	static const int TileRows = 16;
+
+private:
+	/// <summary>
+	/// The populated cells of one tile, and which slots they are in
+	/// </summary>
+	struct Tile
+	{
+		/// <summary>
+		/// Owner of the store that created this tile
+		/// </summary>
+		uint64_t owner;
+
+		/// <summary>
+		/// Bit i is set if slot i holds a cell. Tiles have exactly 64 slots
+		/// </summary>
+		uint64_t populated;
+
+		/// <summary>
+		/// Cells of the populated slots, in slot order
+		/// </summary>
+		vector<Cell> cells;
+	};
+
+	/// <summary>
+	/// A node of the tile tree. Branches on the last level hold tiles,
+	/// the others hold branches
+	/// </summary>
+	struct Branch
+	{
+		/// <summary>
+		/// Owner of the store that created this branch
+		/// </summary>
+		uint64_t owner;
+
+		/// <summary>
+		/// Bit i is set if child i exists
+		/// </summary>
+		uint64_t present;
+
+		/// <summary>
+		/// Existing children, in child order
+		/// </summary>
+		vector<shared_ptr<Branch>> branches;
+		vector<shared_ptr<Tile>> tiles;
+	};
+
+	/// <summary>
+	/// Root of the tile tree, null if no cell was ever inserted
+	/// </summary>
+	shared_ptr<Branch> root;
+
+	/// <summary>
+	/// Number of populated cells
+	/// </summary>
+	size_t size;
+
+	/// <summary>
+	/// Identifies the tiles and branches this store may write in place. Changed
+	/// whenever the store is copied, which may happen under a read lock on
+	/// several threads at once, hence atomic and mutable
+	/// </summary>
+	mutable atomic<uint64_t> owner;
+
+	/// <summary>
+	/// Returns an owner no store has had before
+	/// </summary>
+	static uint64_t NewOwner();
+
+	/// <summary>
+	/// Key of the tile holding a cell: tile column in the upper bits, tile row in the lower
+	/// </summary>
+	static uint64_t TileKey(const CellId cell);
+
+	/// <summary>
+	/// Index of a cell's slot within its tile
+	/// </summary>
+	static unsigned SlotIndex(const CellId cell);
+
+	/// <summary>
+	/// Index of the child to follow at a level of the tree for a tile key
+	/// </summary>
+	static unsigned ChildIndex(const uint64_t key, const int level);
+
+	/// <summary>
+	/// Number of bits set in mask below bit index: the position of
+	/// item index in a vector that only holds the items whose bit is set
+	/// </summary>
+	static size_t Rank(const uint64_t mask, const unsigned index);
+
+	/// <summary>
+	/// Whether a cell lies within the sheet's bounds
+	/// </summary>
+	static bool OnSheet(const CellId cell);
+
+	/// <summary>
+	/// Finds the tile holding a cell for writing, first copying it and the
+	/// branches leading to it if this store doesn't own them
+	/// </summary>
+	/// <param name="cell">Cell in the tile</param>
+	/// <param name="create">Whether to create the tile if it doesn't exist</param>
+	/// <returns>The tile, or null if it doesn't exist and create is false</returns>
+	Tile* WritableTile(const CellId cell, const bool create);
+
+	static void ForEach(const Branch& branch, const int level, const function<void(const Cell&)>& visit);
+
+public:
+	/// <summary>
+	/// Creates an empty store
+	/// </summary>
+	CellStore();
+
+	/// <summary>
+	/// Copies a store in O(1). Both stores share every tile until one of them writes to it
+	/// </summary>
+	CellStore(const CellStore& other);
+	CellStore(CellStore&& other);
+	CellStore& operator= (const CellStore& other);
+	CellStore& operator= (CellStore&& other);
+
+	/// <summary>
+	/// Finds a populated cell for reading
+	/// </summary>
+	/// <param name="cell">Cell to find</param>
+	/// <returns>The cell, or null if it isn't populated</returns>
+	const Cell* Find(const CellId cell) const;
+
+	/// <summary>
+	/// Finds a populated cell for writing. Copies its tile first if this
+	/// store doesn't own it, so use Find when only reading
+	/// </summary>
+	/// <param name="cell">Cell to find</param>
+	/// <returns>The cell, or null if it isn't populated. Other cells of its
+	/// tile may move on Insert, so this is only good until the next Insert</returns>
+	Cell* Modify(const CellId cell);
+
+	/// <summary>
+	/// Returns a cell for writing, populating it with empty contents if it
+	/// isn't already. Throws if cell is not on the sheet
+	/// </summary>
+	/// <param name="cell">Cell to get</param>
+	/// <returns>The cell. Other cells of its tile may move, so pointers
+	/// from Modify are only good until the next Insert</returns>
+	Cell& Insert(const CellId cell);
+
+	/// <summary>
+	/// Whether a cell is populated
+	/// </summary>
+	bool Contains(const CellId cell) const;
+
+	/// <summary>
+	/// Number of populated cells
+	/// </summary>
+	size_t Size() const;
+
+	/// <summary>
+	/// Removes every cell. Copies of this store keep theirs
+	/// </summary>
+	void Clear();
+
+	/// <summary>
+	/// Calls visit on every populated cell, ordered by tile column, then by
+	/// tile row, then by slot within each tile
+	/// </summary>
+	/// <param name="visit">Called once per cell</param>
+	void ForEach(const function<void(const Cell&)>& visit) const;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "CellValue.h"
+#include <cstdlib>
+#include <cstdio>
+
+// See CellValue.h for documentation
+
+CellValue::CellValue() : kind(Kind::Empty), number(0) {
+}
+
+CellValue::CellValue(const double number) : kind(Kind::Number), number(number) {
+}
+
+CellValue::CellValue(const Kind kind) : kind(kind), number(0) {
+}
+
+CellValue CellValue::FromContents(const string& contents) {
+	if (contents.size() == 0)
+		return CellValue();
+
+	// Only treat the contents as a number if all of it parses as one
+	char first = contents[0];
+	if ((first >= '0' && first <= '9') || first == '.' || first == '-' || first == '+') {
+		char* end;
+		double result = strtod(contents.c_str(), &end);
+		if (end == contents.c_str() + contents.size())
+			return CellValue(result);
+	}
+
+	return CellValue(Kind::Text);
+}
+
+const CellValue::Kind CellValue::GetKind() const {
+	return kind;
+}
+
+const double CellValue::GetNumber() const {
+	return kind == Kind::Number ? number : 0;
+}
+
+string CellValue::ToString() const {
+	if (kind == Kind::Error)
+		return "#ERROR";
+	if (kind != Kind::Number)
+		return "";
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.15g", number);
+	return string(buffer);
+}
+
+bool CellValue::operator== (const CellValue& other) const {
+	return kind == other.kind && GetNumber() == other.GetNumber();
+}
+
+bool CellValue::operator!= (const CellValue& other) const {
+	return !(*this == other);
+}
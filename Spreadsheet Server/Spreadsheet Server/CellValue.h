@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+
+#ifndef CellValue_H
+#define CellValue_H
+
+using namespace std;
+
+/// <summary>
+/// The computed value of a cell.
+/// Numbers and formulas evaluate to a number (or an error),
+/// anything else is text whose value is just the cell contents
+/// </summary>
+class CellValue
+{
+public:
+	/// <summary>
+	/// What kind of value a cell holds
+	/// </summary>
+	enum class Kind { Empty, Number, Text, Error };
+
+private:
+	/// <summary>
+	/// Kind of this value
+	/// </summary>
+	Kind kind;
+
+	/// <summary>
+	/// Numeric value, only meaningful when kind is Number
+	/// </summary>
+	double number;
+
+public:
+	/// <summary>
+	/// Creates an empty value
+	/// </summary>
+	CellValue();
+
+	/// <summary>
+	/// Creates a numeric value
+	/// </summary>
+	/// <param name="number">The number</param>
+	CellValue(const double number);
+
+	/// <summary>
+	/// Creates a value of a kind that carries no number (Empty, Text or Error)
+	/// </summary>
+	/// <param name="kind">Kind of value</param>
+	CellValue(const Kind kind);
+
+	/// <summary>
+	/// Computes the value of a cell that isn't a formula
+	/// </summary>
+	/// <param name="contents">Cell contents, must not start with =</param>
+	/// <returns>Empty, Number if contents is a number, else Text</returns>
+	static CellValue FromContents(const string& contents);
+
+	/// <summary>
+	/// Gets the kind of this value
+	/// </summary>
+	/// <returns>Kind of value</returns>
+	const Kind GetKind() const;
+
+	/// <summary>
+	/// Gets the number held by this value
+	/// </summary>
+	/// <returns>The number, or 0 if this is not a Number</returns>
+	const double GetNumber() const;
+
+	/// <summary>
+	/// Formats this value for sending to clients
+	/// </summary>
+	/// <returns>The number, "#ERROR" for errors, or "" for empty and text values</returns>
+	string ToString() const;
+
+	bool operator== (const CellValue& other) const;
+	bool operator!= (const CellValue& other) const;
+};
+
+#endif
@@ -3,7 +3,7 @@
 
 // See client.h for method docs
 
-Client::Client(const int ID, const string username, it_connection state)
+Client::Client(const int ID, const string username, connection_ptr state)
 	: state(state), username(username), ID(ID)
 {
 }
@@ -3,9 +3,10 @@
 #include <boost/asio.hpp> 
 #include "Connection.h"
 #include <list>
+#include <memory>
 
 using namespace std;
-using it_connection = std::list<Connection>::iterator;
+using connection_ptr = std::shared_ptr<Connection>;
 
 #ifndef CLIENT_H
 #define CLIENT_H
@@ -23,7 +24,7 @@ public:
 	/// </summary>
 	/// <param name="ID">Unique ID of the client</param>
 	/// <param name="username">Client username</param>
-	Client(const int ID, const string username, it_connection state);
+	Client(const int ID, const string username, connection_ptr state);
 
 	/// <summary>
 	/// Gets ID
@@ -56,7 +57,7 @@ private:
 	/// <summary>
 	/// Client networking information
 	/// </summary>
-	it_connection state;
+	connection_ptr state;
 
 };
 
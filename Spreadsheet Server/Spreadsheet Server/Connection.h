@@ -4,16 +4,23 @@
 #define CONNECTION_H
 
 #include <boost/asio.hpp> 
+#include <deque>
+#include <memory>
+#include <string>
 
 
 /// <summary>
 /// Represents a single network connection. This contains the user's socket and its state.
-/// Similar to SocketState from CS3500
+/// Similar to SocketState from CS3500.
+/// Everything touching the socket runs on the connection's strand, so reads and writes
+/// from the server's threads never overlap, and messages are written one after another
 /// </summary>
 struct Connection {
 	boost::asio::ip::tcp::socket socket;				// The socket
 	boost::asio::streambuf read_buffer;					// The data received 
 	boost::asio::io_service& stored_service;				// Stored for copy constructor
+	boost::asio::io_service::strand strand;				// Runs this connection's handlers one at a time
+	std::deque<std::shared_ptr<std::string>> outbox;	// Messages waiting to be written, the front one is being written
 	int ID;
 	bool user_chosen = false;
 
@@ -2,11 +2,13 @@
 //Produce for CS 3505 final project. 
 #include "DependencyGraph.h"
 #include <iostream>
+#include <algorithm>
+#include <climits>
 
 /// <summary>
 /// Constructs a new, empty dependency graph
 /// </summary>
-DependencyGraph::DependencyGraph() : size(0), dependees(), dependents()
+DependencyGraph::DependencyGraph() : size(0), dependees(), dependents(), rangeDependees(), rangeDependents(), order(), lowestOrder(0), highestOrder(0), ordered(true)
 {
 }
 
@@ -20,33 +22,35 @@ int DependencyGraph::Size() const
 }
 
 /// <summary>
-/// Returns whether the given node has dependents.
+/// Returns whether the given node has dependents, directly or through a range.
 /// </summary>
 /// <param name="s"></param>
 /// <returns></returns>
-bool DependencyGraph::HasDependents(const string& s)
+bool DependencyGraph::HasDependents(const CellId& s)
 {
-	return dependents[s].size() > 0;
+	return dependents[s].size() > 0 || rangeDependents.Stabs(s);
 }
 
 /// <summary>
-/// Returns whether the given node has dependees.
+/// Returns whether the given node has dependees, either cells or ranges.
 /// </summary>
 /// <param name="s"></param>
 /// <returns></returns>
-bool DependencyGraph::HasDependees(const string& s)
+bool DependencyGraph::HasDependees(const CellId& s)
 {
-	return dependees[s].size() > 0;
+	auto ranges = rangeDependees.find(s);
+	return dependees[s].size() > 0 || (ranges != rangeDependees.end() && ranges->second.size() > 0);
 }
 
 /// <summary>
-/// Returns the dependees of the given node.
+/// Returns the cells the given node depends on directly.
+/// Ranges it depends on are returned by GetRangeDependees instead.
 /// </summary>
 /// <param name="s"></param>
 /// <returns></returns>
-vector<string> DependencyGraph::GetDependees(const string& s)
+vector<CellId> DependencyGraph::GetDependees(const CellId& s)
 {
-	vector<string> output = vector<string>();
+	vector<CellId> output = vector<CellId>();
 	for (auto iter = dependees[s].begin(); iter != dependees[s].end(); ++iter)
 	{
 		output.push_back(*iter);
@@ -55,26 +59,77 @@ vector<string> DependencyGraph::GetDependees(const string& s)
 }
 
 /// <summary>
-/// Returns the dependents of the given node.
+/// Returns the dependents of the given node, including those with a range containing it.
+/// A node with several such ranges is returned once per range.
 /// </summary>
 /// <param name="s"></param>
 /// <returns></returns>
-vector<string> DependencyGraph::GetDependents(const string& s)
+vector<CellId> DependencyGraph::GetDependents(const CellId& s)
 {
-	vector<string> output = vector<string>();
-	for (auto iter = dependents[s].begin(); iter != dependents[s].end(); ++iter)
+	vector<CellId> output = vector<CellId>();
+	AppendDependents(s, output);
+	return output;
+}
+
+/// <summary>
+/// Returns the ranges the given node depends on.
+/// </summary>
+/// <param name="s"></param>
+/// <returns></returns>
+vector<CellRange> DependencyGraph::GetRangeDependees(const CellId& s)
+{
+	auto ranges = rangeDependees.find(s);
+	if (ranges == rangeDependees.end())
+		return vector<CellRange>();
+	return ranges->second;
+}
+
+/// <summary>
+/// Appends the direct dependents of s, then every node with a range containing s.
+/// </summary>
+/// <param name="s"></param>
+/// <param name="output"></param>
+void DependencyGraph::AppendDependents(const CellId& s, vector<CellId>& output) const
+{
+	auto edges = dependents.find(s);
+	if (edges != dependents.end())
+		output.insert(output.end(), edges->second.begin(), edges->second.end());
+	rangeDependents.Stab(s, output);
+}
+
+/// <summary>
+/// Appends every node inside range that has a position in the topological order.
+/// Nodes without one have no dependees, so callers looking for paths can ignore them.
+/// Looks up each cell of small ranges, but scans the order instead when the range is
+/// larger than the graph, so the cost never depends on the size of the range alone.
+/// </summary>
+/// <param name="range"></param>
+/// <param name="output"></param>
+void DependencyGraph::AppendOrderedIn(const CellRange& range, vector<CellId>& output) const
+{
+	size_t columns = range.BottomRight().Column() - range.TopLeft().Column() + 1;
+	size_t rows = range.BottomRight().Row() - range.TopLeft().Row() + 1;
+	if (columns * rows > order.size())
 	{
-		output.push_back(*iter);
+		for (auto iter = order.begin(); iter != order.end(); ++iter)
+			if (range.Contains(iter->first))
+				output.push_back(iter->first);
+		return;
 	}
-	return output;
+	for (int column = range.TopLeft().Column(); column <= range.BottomRight().Column(); column++)
+		for (int row = range.TopLeft().Row(); row <= range.BottomRight().Row(); row++)
+			if (order.count(CellId(column, row)) == 1)
+				output.push_back(CellId(column, row));
 }
 
 /// <summary>
 /// Adds the given dependency: t depends on s. 
+/// Keeps the topological order up to date, reordering only the nodes
+/// between t and s in the current order if the new edge points backwards.
 /// </summary>
 /// <param name="s"></param>
 /// <param name="t"></param>
-void DependencyGraph::AddDependency(const string& s, const string& t)
+void DependencyGraph::AddDependency(const CellId& s, const CellId& t)
 {
 	if (dependents[s].count(t) == 0)
 	{
@@ -85,6 +140,281 @@ void DependencyGraph::AddDependency(const string& s, const string& t)
 		return;
 
 	dependees[t].insert(s);
+
+	int sOrder = GetOrder(s, true);
+	int tOrder = GetOrder(t, false);
+	if (ordered && sOrder > tOrder)
+		ordered = Reorder(s, t);
+}
+
+/// <summary>
+/// Adds the given range dependency: t depends on every cell inside range.
+/// Only cells of the range that already have a position in the topological order
+/// can be ordered after t, and each of those is moved before t as if by AddDependency.
+/// </summary>
+/// <param name="range"></param>
+/// <param name="t"></param>
+void DependencyGraph::AddRangeDependency(const CellRange& range, const CellId& t)
+{
+	vector<CellRange>& ranges = rangeDependees[t];
+	if (find(ranges.begin(), ranges.end(), range) != ranges.end())
+		return;
+	ranges.push_back(range);
+	rangeDependents.Add(range, t);
+	size++;
+
+	GetOrder(t, false);
+	if (range.Contains(t))
+		ordered = false;
+	if (!ordered)
+		return;
+
+	vector<CellId> inside;
+	AppendOrderedIn(range, inside);
+	for (const CellId& node : inside)
+		if (ordered && order[node] > order[t])
+			ordered = Reorder(node, t);
+}
+
+/// <summary>
+/// Removes the given range dependency (t depends on range), if it exists.
+/// </summary>
+/// <param name="range"></param>
+/// <param name="t"></param>
+void DependencyGraph::RemoveRangeDependency(const CellRange& range, const CellId& t)
+{
+	auto ranges = rangeDependees.find(t);
+	if (ranges == rangeDependees.end())
+		return;
+	auto found = find(ranges->second.begin(), ranges->second.end(), range);
+	if (found == ranges->second.end())
+		return;
+	ranges->second.erase(found);
+	rangeDependents.Remove(range, t);
+	size--;
+}
+
+/// <summary>
+/// Returns the position of s in the topological order, giving it one if it has none.
+/// A node seen for the first time has no dependees yet, so it can go first if it is
+/// about to get a dependent, or last if it is about to get a dependee, without moving
+/// anything. The exception is a node inside someone's range, which already has dependents:
+/// it goes first too, and the new edge is then fixed up like any other backwards edge.
+/// </summary>
+/// <param name="s"></param>
+/// <param name="asSource">Whether s is about to become the dependee of a new edge</param>
+/// <returns></returns>
+int DependencyGraph::GetOrder(const CellId& s, const bool asSource)
+{
+	auto found = order.find(s);
+	if (found != order.end())
+		return found->second;
+
+	int position = (asSource || rangeDependents.Stabs(s)) ? --lowestOrder : ++highestOrder;
+	order[s] = position;
+	return position;
+}
+
+/// <summary>
+/// Gets the position of every node in the topological order, empty if a cycle made it unusable
+/// </summary>
+vector<pair<CellId, int>> DependencyGraph::GetPositions() const
+{
+	if (!ordered)
+		return vector<pair<CellId, int>>();
+	return vector<pair<CellId, int>>(order.begin(), order.end());
+}
+
+/// <summary>
+/// Restores positions from GetPositions into an empty graph. Positions must be distinct;
+/// the graph is left as it was if they aren't. An edge added later against the order is
+/// still reordered as usual, so positions that don't match the edges only cost time
+/// </summary>
+/// <returns>False if the positions weren't loaded</returns>
+bool DependencyGraph::LoadPositions(const vector<pair<CellId, int>>& positions)
+{
+	if (size != 0 || !order.empty())
+		return false;
+	unordered_map<CellId, int> loaded;
+	unordered_set<int> taken;
+	loaded.reserve(positions.size());
+	taken.reserve(positions.size());
+	int lowest = 0;
+	int highest = 0;
+	for (const pair<CellId, int>& position : positions)
+	{
+		if (!taken.insert(position.second).second || !loaded.insert(position).second)
+			return false;
+		lowest = min(lowest, position.second);
+		highest = max(highest, position.second);
+	}
+	order = move(loaded);
+	lowestOrder = lowest;
+	highestOrder = highest;
+	return true;
+}
+
+/// <summary>
+/// Restores the topological order after adding the edge s -> t when t came before s
+/// (Pearce-Kelly). Only nodes ordered between t and s can be affected: those reachable
+/// from t are shifted after those that reach s, reusing the same set of positions.
+/// </summary>
+/// <param name="s"></param>
+/// <param name="t"></param>
+/// <returns>False if the edge closed a cycle, in which case no order exists</returns>
+bool DependencyGraph::Reorder(const CellId& s, const CellId& t)
+{
+	int lowerBound = order[t];
+	int upperBound = order[s];
+
+	// Nodes reachable from t that are ordered before s
+	vector<CellId> forward;
+	unordered_set<CellId> visited;
+	vector<CellId> toVisit;
+	vector<CellId> edges;
+	toVisit.push_back(t);
+	visited.insert(t);
+	while (toVisit.size() != 0)
+	{
+		CellId node = toVisit.back();
+		toVisit.pop_back();
+		forward.push_back(node);
+		edges.clear();
+		AppendDependents(node, edges);
+		for (const CellId& next : edges)
+		{
+			if (next == s)
+				return false;
+			if (order[next] < upperBound && visited.insert(next).second)
+				toVisit.push_back(next);
+		}
+	}
+
+	// Nodes that reach s that are ordered after t
+	vector<CellId> backward;
+	toVisit.push_back(s);
+	visited.insert(s);
+	while (toVisit.size() != 0)
+	{
+		CellId node = toVisit.back();
+		toVisit.pop_back();
+		backward.push_back(node);
+		edges.clear();
+		auto cells = dependees.find(node);
+		if (cells != dependees.end())
+			edges.insert(edges.end(), cells->second.begin(), cells->second.end());
+		auto ranges = rangeDependees.find(node);
+		if (ranges != rangeDependees.end())
+			for (const CellRange& range : ranges->second)
+				AppendOrderedIn(range, edges);
+		for (const CellId& previous : edges)
+			if (order[previous] > lowerBound && visited.insert(previous).second)
+				toVisit.push_back(previous);
+	}
+
+	// Hand the affected positions back out: everything reaching s first, then everything reachable from t
+	auto byOrder = [this](const CellId& a, const CellId& b) { return order[a] < order[b]; };
+	sort(forward.begin(), forward.end(), byOrder);
+	sort(backward.begin(), backward.end(), byOrder);
+	vector<int> positions;
+	for (const CellId& node : backward)
+		positions.push_back(order[node]);
+	for (const CellId& node : forward)
+		positions.push_back(order[node]);
+	sort(positions.begin(), positions.end());
+
+	size_t next = 0;
+	for (const CellId& node : backward)
+		order[node] = positions[next++];
+	for (const CellId& node : forward)
+		order[node] = positions[next++];
+
+	return true;
+}
+
+/// <summary>
+/// Returns whether s depending on every node of newDependees and every cell of newRanges
+/// (in place of its current dependees) would create a circular dependency. Thanks to the
+/// topological order, a dependee ordered before s can never be reached from s, so usually
+/// no search is needed at all; otherwise only nodes ordered between s and the furthest
+/// dependee are visited. Cells of a range are only considered if they have dependees
+/// themselves, since nothing else can be reached from s.
+/// </summary>
+/// <param name="s"></param>
+/// <param name="newDependees"></param>
+/// <param name="newRanges"></param>
+/// <returns></returns>
+bool DependencyGraph::WouldCreateCycle(const CellId& s, const vector<CellId>& newDependees, const vector<CellRange>& newRanges) const
+{
+	vector<CellId> candidates;
+	for (const CellId& dependee : newDependees)
+	{
+		if (dependee == s)
+			return true;
+		candidates.push_back(dependee);
+	}
+	for (const CellRange& range : newRanges)
+	{
+		if (range.Contains(s))
+			return true;
+		AppendOrderedIn(range, candidates);
+	}
+
+	// Without an order s has no dependees, so only its range dependents lead anywhere
+	auto sOrder = order.find(s);
+	if (sOrder == order.end() && !rangeDependents.Stabs(s))
+		return false;
+
+	unordered_set<CellId> targets;
+	int upperBound = INT_MIN;
+	for (const CellId& dependee : candidates)
+	{
+		// Nodes without an order have no dependees, so nothing reaches them
+		auto dependeeOrder = order.find(dependee);
+		if (dependeeOrder == order.end())
+			continue;
+		if (ordered && sOrder != order.end() && dependeeOrder->second < sOrder->second)
+			continue;
+		targets.insert(dependee);
+		upperBound = max(upperBound, dependeeOrder->second);
+	}
+
+	if (targets.size() == 0)
+		return false;
+	return Reaches(s, targets, ordered ? upperBound : INT_MAX);
+}
+
+/// <summary>
+/// Searches the dependents of s, transitively, for any of targets, skipping nodes
+/// ordered after upperBound since they can't lead back to a target.
+/// </summary>
+/// <param name="s"></param>
+/// <param name="targets"></param>
+/// <param name="upperBound"></param>
+/// <returns></returns>
+bool DependencyGraph::Reaches(const CellId& s, const unordered_set<CellId>& targets, const int upperBound) const
+{
+	unordered_set<CellId> visited;
+	vector<CellId> toVisit;
+	vector<CellId> edges;
+	toVisit.push_back(s);
+	visited.insert(s);
+	while (toVisit.size() != 0)
+	{
+		CellId node = toVisit.back();
+		toVisit.pop_back();
+		edges.clear();
+		AppendDependents(node, edges);
+		for (const CellId& next : edges)
+		{
+			if (targets.count(next) == 1)
+				return true;
+			auto nextOrder = order.find(next);
+			if (nextOrder != order.end() && nextOrder->second <= upperBound && visited.insert(next).second)
+				toVisit.push_back(next);
+		}
+	}
+	return false;
 }
 
 /// <summary>
@@ -92,12 +422,12 @@ void DependencyGraph::AddDependency(const string& s, const string& t)
 /// </summary>
 /// <param name="s"></param>
 /// <param name="t"></param>
-void DependencyGraph::RemoveDependency(const string& s, const string& t)
+void DependencyGraph::RemoveDependency(const CellId& s, const CellId& t)
 {
 	//this is necessary, since while erasing we might
 	//delete the memory address for s or t
-	string s_ = s;
-	string t_ = t;
+	CellId s_ = s;
+	CellId t_ = t;
 	if (dependents[s].count(t) == 0)
 		return;
 
@@ -108,16 +438,20 @@ void DependencyGraph::RemoveDependency(const string& s, const string& t)
 }
 
 /// <summary>
-/// Replaces all of the dependents of s with a new list of dependents.
+/// Replaces all of the direct dependents of s with a new list of dependents.
+/// Cells depending on s through a range are kept
 /// </summary>
 /// <param name="s"></param>
 /// <param name="newDependents"></param>
-void DependencyGraph::ReplaceDependents(const string& s, const vector<string>& newDependents)
+void DependencyGraph::ReplaceDependents(const CellId& s, const vector<CellId>& newDependents)
 {
-	while (HasDependents(s))
+	// Only direct dependents, HasDependents also counts ranges s is in, which this leaves alone
+	auto found = dependents.find(s);
+	while (found != dependents.end() && !found->second.empty())
 	{
-		const string& s_ = *dependents[s].begin();
+		const CellId s_ = *found->second.begin();
 		RemoveDependency(s, s_);
+		found = dependents.find(s);
 	}
 
 	// adds the provided new dependents of s
@@ -126,18 +460,129 @@ void DependencyGraph::ReplaceDependents(const string& s, const vector<string>& n
 }
 
 /// <summary>
-/// Replaces all of the dependees of s with a new list of dependees.
+/// Replaces all of the dependees of s with a new list of dependees and ranges.
 /// </summary>
 /// <param name="s"></param>
-/// <param name="newDependents"></param>
-void DependencyGraph::ReplaceDependees(const string& s, const vector<string>& newDependees)
+/// <param name="newDependees"></param>
+/// <param name="newRanges"></param>
+void DependencyGraph::ReplaceDependees(const CellId& s, const vector<CellId>& newDependees, const vector<CellRange>& newRanges)
 {
-	while (HasDependees(s))
+	while (dependees[s].size() > 0)
 	{
-		const string& s_ = *dependees[s].begin();
+		const CellId& s_ = *dependees[s].begin();
 		RemoveDependency(s_, s);
 	}
+	for (const CellRange& range : GetRangeDependees(s))
+		RemoveRangeDependency(range, s);
 
 	for (int i = 0; i < newDependees.size(); i++)
 		AddDependency(newDependees[i], s);
+	for (const CellRange& range : newRanges)
+		AddRangeDependency(range, s);
+}
+
+/// <summary>
+/// Returns s together with every node that directly or indirectly depends on it.
+/// </summary>
+/// <param name="s"></param>
+/// <returns></returns>
+unordered_set<CellId> DependencyGraph::GetTransitiveDependents(const CellId& s)
+{
+	unordered_set<CellId> nodes;
+	nodes.insert(s);
+	return GetTransitiveDependents(nodes);
+}
+
+/// <summary>
+/// Returns the nodes together with every node that directly or indirectly depends on any of them.
+/// Dependents shared by several nodes are only visited once.
+/// </summary>
+/// <param name="nodes"></param>
+/// <returns></returns>
+unordered_set<CellId> DependencyGraph::GetTransitiveDependents(const unordered_set<CellId>& nodes)
+{
+	unordered_set<CellId> result;
+	vector<CellId> toVisit(nodes.begin(), nodes.end());
+	while (toVisit.size() != 0)
+	{
+		CellId node = toVisit.back();
+		toVisit.pop_back();
+		if (result.insert(node).second)
+			AppendDependents(node, toVisit);
+	}
+	return result;
+}
+
+/// <summary>
+/// Splits a set of nodes into topological levels, considering only dependencies
+/// between nodes of the set. Level 0 holds the nodes with no dependees in the set,
+/// and every other node is one level past its deepest dependee, so the nodes
+/// within a level never depend on each other and can be processed in parallel.
+/// Nodes that are part of a cycle can't be leveled and are put in circular instead.
+/// A range counts as one dependee per node of the set inside it.
+/// </summary>
+/// <param name="nodes"></param>
+/// <param name="circular"></param>
+/// <returns></returns>
+vector<vector<CellId>> DependencyGraph::GetTopologicalLevels(const unordered_set<CellId>& nodes, vector<CellId>& circular)
+{
+	// Kahn's algorithm, processed a whole wave of ready nodes at a time
+	unordered_map<CellId, int> remaining;
+	vector<CellId> ready;
+	for (const CellId& node : nodes)
+	{
+		int count = 0;
+		for (auto iter = dependees[node].begin(); iter != dependees[node].end(); ++iter)
+			if (nodes.count(*iter) == 1)
+				count++;
+		auto ranges = rangeDependees.find(node);
+		if (ranges != rangeDependees.end())
+		{
+			for (const CellRange& range : ranges->second)
+			{
+				size_t area = (size_t)(range.BottomRight().Column() - range.TopLeft().Column() + 1)
+					* (range.BottomRight().Row() - range.TopLeft().Row() + 1);
+				if (area > nodes.size())
+				{
+					for (const CellId& other : nodes)
+						if (range.Contains(other))
+							count++;
+				}
+				else
+				{
+					for (int column = range.TopLeft().Column(); column <= range.BottomRight().Column(); column++)
+						for (int row = range.TopLeft().Row(); row <= range.BottomRight().Row(); row++)
+							if (nodes.count(CellId(column, row)) == 1)
+								count++;
+				}
+			}
+		}
+		remaining[node] = count;
+		if (count == 0)
+			ready.push_back(node);
+	}
+
+	vector<vector<CellId>> levels;
+	vector<CellId> edges;
+	while (ready.size() != 0)
+	{
+		vector<CellId> next;
+		for (const CellId& node : ready)
+		{
+			edges.clear();
+			AppendDependents(node, edges);
+			for (const CellId& dependent : edges)
+				if (nodes.count(dependent) == 1 && --remaining[dependent] == 0)
+					next.push_back(dependent);
+		}
+		levels.push_back(ready);
+		ready.swap(next);
+	}
+
+	// Anything left over is part of a cycle
+	for (auto iter = remaining.begin(); iter != remaining.end(); ++iter)
+		if (iter->second > 0)
+			circular.push_back(iter->first);
+
+	return levels;
 }
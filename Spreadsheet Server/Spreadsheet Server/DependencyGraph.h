@@ -1,8 +1,10 @@
 #pragma once
-#include <string>
 #include <vector>
-#include <map>
+#include <unordered_map>
 #include <unordered_set>
+#include "CellId.h"
+#include "CellRange.h"
+#include "RangeIndex.h"
 
 #ifndef DependencyGraph_H
 #define DependencyGraph_H
@@ -12,26 +14,60 @@ using namespace std;
 class DependencyGraph
 {
 private:
-	map<string, unordered_set<string>> dependees;
-	map<string, unordered_set<string>> dependents;
+	unordered_map<CellId, unordered_set<CellId>> dependees;
+	unordered_map<CellId, unordered_set<CellId>> dependents;
 	int size;
 
+	// Ranges each node depends on as a whole (one entry per range, however many cells it covers),
+	// and the reverse lookup from a cell to the nodes with a range containing it
+	unordered_map<CellId, vector<CellRange>> rangeDependees;
+	RangeIndex rangeDependents;
+
+	// Dynamic topological order (Pearce-Kelly): for every edge s -> t, order[s] < order[t]
+	unordered_map<CellId, int> order;
+	int lowestOrder;
+	int highestOrder;
+	// False once a cycle has been added (only possible when loading a corrupt file),
+	// after which order can't be trusted and cycle checks search the whole graph
+	bool ordered;
+
+	int GetOrder(const CellId& s, const bool asSource);
+	bool Reorder(const CellId& s, const CellId& t);
+	bool Reaches(const CellId& s, const unordered_set<CellId>& targets, const int upperBound) const;
+	void AppendDependents(const CellId& s, vector<CellId>& output) const;
+	void AppendOrderedIn(const CellRange& range, vector<CellId>& output) const;
+
 public:
 	DependencyGraph();
 
 	// indexer not included
 	int Size() const;
 
-	bool HasDependents(const string& s);
-	bool HasDependees(const string& s);
+	bool HasDependents(const CellId& s);
+	bool HasDependees(const CellId& s);
+
+	vector<CellId> GetDependees(const CellId& s);
+	vector<CellId> GetDependents(const CellId& s);
+	vector<CellRange> GetRangeDependees(const CellId& s);
+
+	void AddDependency(const CellId& s, const CellId& t);
+	void RemoveDependency(const CellId& s, const CellId& t);
+	void AddRangeDependency(const CellRange& range, const CellId& t);
+	void RemoveRangeDependency(const CellRange& range, const CellId& t);
+	void ReplaceDependents(const CellId& s, const vector<CellId>& newDependents);
+	void ReplaceDependees(const CellId& s, const vector<CellId>& newDependees, const vector<CellRange>& newRanges);
+
+	bool WouldCreateCycle(const CellId& s, const vector<CellId>& newDependees, const vector<CellRange>& newRanges) const;
 
-	vector<string> GetDependees(const string& s);
-	vector<string> GetDependents(const string& s);
+	// Position of every node in the topological order, for saving the graph. Empty once a cycle
+	// has made the order unusable. Positions given back to LoadPositions on an empty graph before
+	// adding the same edges mean none of them needs reordering
+	vector<pair<CellId, int>> GetPositions() const;
+	bool LoadPositions(const vector<pair<CellId, int>>& positions);
 
-	void AddDependency(const string& s, const string& t);
-	void RemoveDependency(const string& s, const string& t);
-	void ReplaceDependents(const string& s, const vector<string>& newDependents);
-	void ReplaceDependees(const string& s, const vector<string>& newDependees);
+	unordered_set<CellId> GetTransitiveDependents(const CellId& s);
+	unordered_set<CellId> GetTransitiveDependents(const unordered_set<CellId>& nodes);
+	vector<vector<CellId>> GetTopologicalLevels(const unordered_set<CellId>& nodes, vector<CellId>& circular);
 };
 
 #endif
\ No newline at end of file
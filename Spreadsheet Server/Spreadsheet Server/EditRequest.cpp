@@ -1,11 +1,17 @@
 #include "EditRequest.h"
 #include <string>
 
-EditRequest::EditRequest(string type, string cellName, string content, shared_ptr<Client> client) :
-	type(type), cellName(cellName), content(content), client(client)
+EditRequest::EditRequest() : type(), cellName(), cell(), content(), edits(), client()
 {
 }
 
+EditRequest::EditRequest(string type, string cellName, string content, shared_ptr<Client> client, const vector<pair<string, string>>& edits) :
+	type(type), cellName(cellName), cell(CellId::Parse(cellName)), content(content), edits(), client(client)
+{
+	for (const pair<string, string>& edit : edits)
+		this->edits.push_back(pair<CellId, string>(CellId::Parse(edit.first), edit.second));
+}
+
 string EditRequest::GetType()
 {
 	return type;
@@ -16,11 +22,21 @@ string EditRequest::GetName()
 	return cellName;
 }
 
+CellId EditRequest::GetCell()
+{
+	return cell;
+}
+
 string EditRequest::GetContent()
 {
 	return content;
 }
 
+const vector<pair<CellId, string>>& EditRequest::GetEdits()
+{
+	return edits;
+}
+
 shared_ptr<Client> EditRequest::GetClient() {
 	return client;
 }
\ No newline at end of file
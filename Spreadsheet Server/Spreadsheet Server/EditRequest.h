@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
+#include <vector>
 #include "Cell.h"
+#include "CellId.h"
 #include "Client.h"
 
 #ifndef EditRequest_H
@@ -20,21 +22,38 @@ private:
 	string type;
 
 	/// <summary>
-	/// Name of cell to be edited
+	/// Name of cell to be edited, as sent by the client
 	/// </summary>
 	string cellName;
 
+	/// <summary>
+	/// Cell to be edited, parsed from cellName.
+	/// Invalid if cellName was not a valid cell name
+	/// </summary>
+	CellId cell;
+
 	/// <summary>
 	/// Requested content of cell
 	/// </summary>
 	string content;
 
+	/// <summary>
+	/// Cells and their requested contents, for an editCells request.
+	/// Cells are invalid if the client sent a bad cell name
+	/// </summary>
+	vector<pair<CellId, string>> edits;
+
 	/// <summary>
 	/// Client who sent this request
 	/// </summary>
 	shared_ptr<Client> client;
 
 public:
+	/// <summary>
+	/// Creates an empty EditRequest, with no type and no client
+	/// </summary>
+	EditRequest();
+
 	/// <summary>
 	/// Creates a new EditRequest
 	/// </summary>
@@ -42,7 +61,8 @@ public:
 	/// <param name="cellName">cellName field</param>
 	/// <param name="content">content field</param>
 	/// <param name="client">Request sender</param>
-	EditRequest(string type, string cellName, string content, shared_ptr<Client> client);
+	/// <param name="edits">cells field, for editCells: names of cells and their contents</param>
+	EditRequest(string type, string cellName, string content, shared_ptr<Client> client, const vector<pair<string, string>>& edits = vector<pair<string, string>>());
 
 	/// <summary>
 	/// Gets request type
@@ -55,11 +75,22 @@ public:
 	/// <returns>Name of a cell</returns>
 	string GetName();
 	/// <summary>
+	/// Gets the parsed cell
+	/// </summary>
+	/// <returns>Cell coordinates, invalid if the client sent a bad cell name</returns>
+	CellId GetCell();
+	/// <summary>
 	/// Gets cell content
 	/// </summary>
 	/// <returns>Cell content</returns>
 	string GetContent();
 
+	/// <summary>
+	/// Gets the cells and contents of an editCells request
+	/// </summary>
+	/// <returns>Cells and their contents, empty for other requests</returns>
+	const vector<pair<CellId, string>>& GetEdits();
+
 	/// <summary>
 	/// Gets client
 	/// </summary>
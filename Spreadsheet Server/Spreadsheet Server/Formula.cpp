@@ -1,180 +1,627 @@
 #include "Formula.h"
 #include <cstring>
+#include <cstdlib>
 #include <iostream>
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <tuple>
+
+// Lane-wise kernels for EvaluateBatch use the widest vector instructions the
+// compiler is allowed to emit, and plain loops on anything else
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FORMULA_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FORMULA_SSE2
+#endif
 
 using namespace std;
 
 /// <summary>
 /// Creates a Formula from a string that consists of an infix expression written as
 /// described in the class comment.  If the expression is syntactically incorrect,
-/// throws an exception with an explanatory Message.
+/// throws an exception whose what() describes the error and where it was found.
+/// Use Parse to check a formula without exceptions.
 /// 
-/// Variables are valid if they are of the form [A-Z][1-99] (i.e., F43, I99, A1)
+/// Variables are valid if they are cell names such as F43, AB7 or XFD1048576 (see CellId::Parse)
 /// 
 /// new Formula("X2+Y3") should succeed
 /// new Formula("X+Y3") should throw an exception, since 'X' is not a valid variable
 /// new Formula("2X+Y3") should throw an exception, since "2X+Y3" is syntactically incorrect.
+/// 
+/// Ranges such as A1:B20 may only appear as the single argument of an aggregate
+/// function: SUM, AVERAGE, MIN, MAX or COUNT. A single cell is also accepted, e.g. SUM(A1)
+/// 
+/// References are stored relative to anchor, the cell this formula is for
 /// </summary>
-Formula::Formula(string formula)
+Formula::Formula(const string formula, const CellId anchor) : maxStackDepth(0), temporaryCount(0)
 {
-	// Eliminate = at front
-	if (formula.size() > 0 && formula[0] == '=') {
-		formula = formula.substr(1);
-	}
-	else {
-		throw exception();
-	}
+	FormulaParseResult result = Build(formula, anchor);
+	if (!result.Succeeded())
+		throw runtime_error(result.ToString());
+}
 
-	// Track last variable for operator following rule and extra following rule
-	bool lastWasOpeningOrOperator = false;
-	bool lastWasClosingNumberOrVar = false;
-	// Track parenthesis counts
-	int closedParens = 0;
-	int openParens = 0;
-	vector<string> allTokens = GetTokens(formula);
-	// Make sure we have tokens
-	if (allTokens.size() == 0) {
-		throw exception();
-		return;
-	}
-		
-	for (int itr = 0; itr < allTokens.size(); itr++)
-	{
-		Token newToken = Token(allTokens[itr]);
-		// Validate based on previous token
-		if (newToken.Type == "op")
-		{
-			if (newToken.Content.compare("(") == 0)
-			{
-				openParens++;
-				lastWasOpeningOrOperator = true;
-				if (lastWasClosingNumberOrVar)
-				{
-					throw exception();
-				}
-			}
-			else if (newToken.Content == ")")
-			{
-				closedParens++;
-				lastWasClosingNumberOrVar = true;
-				if (lastWasOpeningOrOperator)
-				{
-					throw exception();
+/// <summary>
+/// Creates an empty Formula for Parse to build into
+/// </summary>
+Formula::Formula() : maxStackDepth(0), temporaryCount(0)
+{
+}
+
+/// <summary>
+/// Parses and compiles a formula without throwing.
+/// </summary>
+/// <param name="formula">Formula text, starting with =</param>
+/// <param name="anchor">Cell the formula is for</param>
+/// <param name="result">Set to the error found, or FormulaError::None</param>
+/// <returns>The compiled formula, or nullptr if result holds an error</returns>
+shared_ptr<const Formula> Formula::Parse(const string& formula, const CellId anchor, FormulaParseResult& result)
+{
+	shared_ptr<Formula> parsed(new Formula());
+	result = parsed->Build(formula, anchor);
+	if (!result.Succeeded())
+		return nullptr;
+	return parsed;
+}
+
+/// <summary>
+/// Lexes and validates a formula and writes its template, the text GetTemplate would
+/// return, without compiling it. Formulas with the same template compile the same, so
+/// the template can be looked up before paying for Compile
+/// </summary>
+/// <param name="formula">Formula text, starting with =</param>
+/// <param name="anchor">Cell the formula is for</param>
+/// <param name="tokens">Set to the formula's tokens, for Compile</param>
+/// <param name="templateText">Set to the template, or left alone on error</param>
+/// <returns>The first error found, if any</returns>
+FormulaParseResult Formula::Scan(const string& formula, const CellId anchor, vector<Token>& tokens, string& templateText)
+{
+	tokens.clear();
+	FormulaParseResult result = Lex(formula, tokens);
+	if (result.Succeeded())
+		result = Validate(tokens, formula.size());
+	if (result.Succeeded())
+		templateText = ToTemplate(formula, tokens, anchor);
+	return result;
+}
+
+/// <summary>
+/// Compiles a formula Scan accepted, from what Scan gave back
+/// </summary>
+shared_ptr<const Formula> Formula::Compile(const vector<Token>& tokens, const CellId anchor, string templateText)
+{
+	shared_ptr<Formula> compiled(new Formula());
+	compiled->text = move(templateText);
+	compiled->Compile(tokens, anchor);
+	return compiled;
+}
+
+/// <summary>
+/// Lexes, validates and compiles formula into this, which must be empty
+/// </summary>
+/// <returns>The first error found, if any. Nothing is compiled on error</returns>
+FormulaParseResult Formula::Build(const string& formula, const CellId anchor)
+{
+	vector<Token> tokens;
+	FormulaParseResult result = Scan(formula, anchor, tokens, text);
+	if (result.Succeeded())
+		Compile(tokens, anchor);
+	return result;
+}
+
+static bool IsDigit(const char c) {
+	return c >= '0' && c <= '9';
+}
+
+static bool IsLetter(const char c) {
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+/// <summary>
+/// Returns the index just past the run of letters and digits starting at start,
+/// and writes that run, capitalized, to name
+/// </summary>
+static size_t ReadName(const string& formula, const size_t start, string& name) {
+	size_t end = start;
+	name.clear();
+	while (end < formula.size() && (IsLetter(formula[end]) || IsDigit(formula[end])))
+		name += (char)toupper(formula[end++]);
+	return end;
+}
+
+/// <summary>
+/// Aggregate functions by name, capitalized
+/// </summary>
+static const struct { const char* name; OpCode function; } Functions[] = {
+	{ "SUM", OpCode::Sum },
+	{ "AVERAGE", OpCode::Average },
+	{ "MIN", OpCode::Min },
+	{ "MAX", OpCode::Max },
+	{ "COUNT", OpCode::Count }
+};
+
+/// <summary>
+/// Splits a formula into tokens. Letters may be in either case.
+/// Numbers are read with from_chars, so "1.2.3" or "." is an error here
+/// rather than being read up to the part that makes sense
+/// </summary>
+/// <param name="formula">Formula text, starting with =</param>
+/// <param name="tokens">Tokens are appended here</param>
+/// <returns>The first error found, if any</returns>
+FormulaParseResult Formula::Lex(const string& formula, vector<Token>& tokens)
+{
+	if (formula.size() == 0 || formula[0] != '=')
+		return { FormulaError::MissingEquals, 0 };
+
+	const char* characters = formula.data();
+	string name;
+	size_t i = 1;
+	while (i < formula.size()) {
+		const char c = formula[i];
+		Token token = {};
+		token.position = i;
+
+		if (c == '+' || c == '-' || c == '*' || c == '/') {
+			token.kind = Token::Kind::Operator;
+			token.op = c;
+			token.length = 1;
+		}
+		else if (c == '(' || c == ')') {
+			token.kind = c == '(' ? Token::Kind::OpenParenthesis : Token::Kind::CloseParenthesis;
+			token.length = 1;
+		}
+		else if (IsDigit(c) || c == '.') {
+			size_t end = i;
+			while (end < formula.size() && (IsDigit(formula[end]) || formula[end] == '.'))
+				end++;
+			from_chars_result parsed = from_chars(characters + i, characters + end, token.number);
+			if (parsed.ec != errc() || parsed.ptr != characters + end)
+				return { FormulaError::InvalidNumber, i };
+			token.kind = Token::Kind::Number;
+			token.length = end - i;
+		}
+		else if (IsLetter(c)) {
+			size_t end = ReadName(formula, i, name);
+			token.kind = Token::Kind::Function;
+			bool isFunction = false;
+			for (const auto& function : Functions) {
+				if (name == function.name) {
+					token.function = function.function;
+					isFunction = true;
+					break;
 				}
 			}
-			else {
-				if (lastWasOpeningOrOperator)
-				{
-					throw exception();
+
+			if (!isFunction) {
+				token.first = CellId::Parse(name);
+				if (!token.first.IsValid())
+					return { FormulaError::InvalidReference, i };
+				token.kind = Token::Kind::Cell;
+
+				// A colon joins two cells into one range token
+				if (end < formula.size() && formula[end] == ':') {
+					size_t second = end + 1;
+					end = ReadName(formula, second, name);
+					token.second = CellId::Parse(name);
+					if (!token.second.IsValid())
+						return { FormulaError::InvalidReference, second };
+					token.kind = Token::Kind::Range;
 				}
-				lastWasOpeningOrOperator = true;
-				lastWasClosingNumberOrVar = false;
 			}
+			token.length = end - i;
 		}
-		else if (newToken.Type == "var")
-		{
-			if (lastWasClosingNumberOrVar)
-			{
-				throw exception();
-			}
-			lastWasOpeningOrOperator = false;
-			lastWasClosingNumberOrVar = true;
+		else {
+			return { FormulaError::InvalidCharacter, i };
 		}
-		else if (newToken.Type == "val")
-		{
-			if (lastWasClosingNumberOrVar)
-			{
-				throw exception();
-			}
-			lastWasClosingNumberOrVar = true;
-			lastWasOpeningOrOperator = false;
+
+		tokens.push_back(token);
+		i += token.length;
+	}
+
+	if (tokens.size() == 0)
+		return { FormulaError::Empty, 1 };
+	return { FormulaError::None, 0 };
+}
+
+/// <summary>
+/// Checks that tokens form a well formed infix expression: operands and
+/// operators alternate, parentheses balance, and ranges only appear as the
+/// argument of a function call, which is read as a whole: name ( range or cell )
+/// </summary>
+/// <param name="tokens">Output of Lex</param>
+/// <param name="end">Length of the formula text, reported for errors at its end</param>
+/// <returns>The first error found, if any</returns>
+FormulaParseResult Formula::Validate(const vector<Token>& tokens, const size_t end)
+{
+	// Whether the next token must start an operand, i.e. we're at the start,
+	// or after an operator or (
+	bool expectOperand = true;
+	size_t openParens = 0;
+
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const Token& token = tokens[i];
+		switch (token.kind) {
+		case Token::Kind::Number:
+		case Token::Kind::Cell:
+			if (!expectOperand)
+				return { FormulaError::ExpectedOperator, token.position };
+			expectOperand = false;
+			break;
+
+		case Token::Kind::Range:
+			return { FormulaError::RangeOutsideFunction, token.position };
+
+		case Token::Kind::Function:
+			if (!expectOperand)
+				return { FormulaError::ExpectedOperator, token.position };
+			if (i + 1 >= tokens.size() || tokens[i + 1].kind != Token::Kind::OpenParenthesis)
+				return { FormulaError::InvalidFunctionCall, i + 1 < tokens.size() ? tokens[i + 1].position : end };
+			if (i + 2 >= tokens.size() || (tokens[i + 2].kind != Token::Kind::Range && tokens[i + 2].kind != Token::Kind::Cell))
+				return { FormulaError::InvalidFunctionCall, i + 2 < tokens.size() ? tokens[i + 2].position : end };
+			if (i + 3 >= tokens.size() || tokens[i + 3].kind != Token::Kind::CloseParenthesis)
+				return { FormulaError::InvalidFunctionCall, i + 3 < tokens.size() ? tokens[i + 3].position : end };
+			i += 3;
+			expectOperand = false;
+			break;
+
+		case Token::Kind::OpenParenthesis:
+			if (!expectOperand)
+				return { FormulaError::ExpectedOperator, token.position };
+			openParens++;
+			break;
+
+		case Token::Kind::CloseParenthesis:
+			if (openParens == 0)
+				return { FormulaError::UnbalancedParentheses, token.position };
+			if (expectOperand)
+				return { FormulaError::ExpectedOperand, token.position };
+			openParens--;
+			break;
+
+		case Token::Kind::Operator:
+			if (expectOperand)
+				return { FormulaError::ExpectedOperand, token.position };
+			expectOperand = true;
+			break;
 		}
+	}
+
+	if (expectOperand)
+		return { FormulaError::ExpectedOperand, end };
+	if (openParens != 0)
+		return { FormulaError::UnbalancedParentheses, end };
+	return { FormulaError::None, 0 };
+}
 
-		if (closedParens > openParens)
-		{
-			throw exception();
+/// <summary>
+/// Writes the normalized text of validated tokens, with every reference relative to anchor
+/// </summary>
+/// <param name="formula">Formula text tokens were lexed from, for literals as typed</param>
+/// <param name="tokens">Tokens that already passed Validate</param>
+/// <param name="anchor">Cell references are made relative to</param>
+string Formula::ToTemplate(const string& formula, const vector<Token>& tokens, const CellId anchor)
+{
+	string text;
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const Token& token = tokens[i];
+		switch (token.kind) {
+		case Token::Kind::Function: {
+			// Validate guarantees ( argument ) follows. Corners keep the order they were typed in
+			const Token& argument = tokens[i + 2];
+			i += 3;
+			for (const auto& function : Functions)
+				if (function.function == token.function)
+					text += function.name;
+			text += "(" + ToText(ToOffset(argument.first, anchor));
+			if (argument.kind == Token::Kind::Range)
+				text += ":" + ToText(ToOffset(argument.second, anchor));
+			text += ")";
+			break;
 		}
 
-		tokens.push_back(newToken);
-	}
+		case Token::Kind::Cell:
+			text += ToText(ToOffset(token.first, anchor));
+			break;
 
-	// Make sure parethensis counts are equal
-	if (openParens != closedParens)
-	{
-		throw exception();
-	}
+		case Token::Kind::Number:
+			text.append(formula, token.position, token.length);
+			break;
 
-	// Make sure we have at least one token
-	if (tokens.size() == 0)
-	{
-		throw exception();
-	}
-	// Make sure start & end tokens are correct
-	if (tokens[0].Type == "op" && tokens[0].Content != "(")
-	{
-		throw exception();
-	}
-	else if (tokens[tokens.size() - 1].Type == "op" && tokens[tokens.size() - 1].Content != ")")
-	{
-		throw exception();
+		case Token::Kind::OpenParenthesis:
+			text += '(';
+			break;
+
+		case Token::Kind::CloseParenthesis:
+			text += ')';
+			break;
+
+		case Token::Kind::Operator:
+			text += token.op;
+			break;
+
+		default:
+			break;
+		}
 	}
+	return text;
 }
 
 /// <summary>
-/// Provides a list of tokens from the provided string.
-/// Automatically capitalizes all letters in variable names.
-/// Throws an exception if unable to parse token
+/// Lowers validated infix tokens into a postfix program using the shunting-yard
+/// algorithm. Literals were already parsed by Lex, and variables are resolved to
+/// indices into the variable table, so Evaluate never touches a string.
+/// The text is written separately, by ToTemplate
 /// </summary>
-/// <param name="s"></param>
-/// <returns></returns>
-vector<string> Formula::GetTokens(string s) {
-	//I would LOVE to use the regex that kopta provided last semeseter,
-	//but i think it will be easier and more understandable to just 
-	//use lots of conditionals instead
-	vector<string> output;
+/// <param name="tokens">Tokens that already passed Validate</param>
+/// <param name="anchor">Cell references are made relative to</param>
+void Formula::Compile(const vector<Token>& tokens, const CellId anchor)
+{
+	vector<char> ops;
+	size_t depth = 0;
+	maxStackDepth = 0;
+
+	// Emits the instruction for a binary operator popped off the ops stack
+	auto emitOperator = [&](char op) {
+		Instruction instruction = { OpCode::Add, 0, 0 };
+		if (op == '-')
+			instruction.op = OpCode::Subtract;
+		else if (op == '*')
+			instruction.op = OpCode::Multiply;
+		else if (op == '/')
+			instruction.op = OpCode::Divide;
+		program.push_back(instruction);
+		depth--;
+	};
+	auto precedence = [](char op) {
+		return (op == '*' || op == '/') ? 2 : (op == '+' || op == '-') ? 1 : 0;
+	};
+	auto push = [&](const Instruction& instruction) {
+		program.push_back(instruction);
+		depth++;
+		if (depth > maxStackDepth)
+			maxStackDepth = depth;
+	};
+
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const Token& token = tokens[i];
+		switch (token.kind) {
+		case Token::Kind::Function: {
+			// Validate guarantees ( argument ) follows. The range table is normalized
+			const Token& argument = tokens[i + 2];
+			i += 3;
+			CellRange range(argument.first, argument.first);
+			if (argument.kind == Token::Kind::Range)
+				range = CellRange(argument.first, argument.second);
+			pair<CellOffset, CellOffset> corners(ToOffset(range.TopLeft(), anchor), ToOffset(range.BottomRight(), anchor));
+			push({ token.function, GetRangeIndex(corners), 0 });
+			break;
+		}
+
+		case Token::Kind::Cell: {
+			CellOffset offset = ToOffset(token.first, anchor);
+			push({ OpCode::PushVariable, GetVariableIndex(offset), 0 });
+			break;
+		}
+
+		case Token::Kind::Number:
+			push({ OpCode::PushValue, 0, token.number });
+			break;
+
+		case Token::Kind::OpenParenthesis:
+			ops.push_back('(');
+			break;
+
+		case Token::Kind::CloseParenthesis:
+			while (ops.back() != '(') {
+				emitOperator(ops.back());
+				ops.pop_back();
+			}
+			ops.pop_back();
+			break;
 
-	for (int i = 0; i < s.size(); i++)
-		s[i] = toupper(s[i]);
+		case Token::Kind::Operator:
+			// Operators are left associative, so flush anything of equal or higher precedence
+			while (ops.size() != 0 && precedence(ops.back()) >= precedence(token.op)) {
+				emitOperator(ops.back());
+				ops.pop_back();
+			}
+			ops.push_back(token.op);
+			break;
 
-	for (int i = 0; i < s.size(); i++) {
-		//parse as an operator
-		if (s[i] == '(' || s[i] == ')' || s[i] == '*' || s[i] == '/' || s[i] == '+' || s[i] == '-')
-		{
-			output.push_back(string(1, s[i])); continue;
+		default:
+			break;
 		}
+	}
+
+	while (ops.size() != 0) {
+		emitOperator(ops.back());
+		ops.pop_back();
+	}
+
+	Optimize();
+}
 
-		//parse as a variable
-		//65 is ascii for 'A', 90 is ascii for 'Z'
-		if ((int)s[i] >= 65 && (int)s[i] <= 90) {
-			int j = i + 1;
+/// <summary>
+/// Rewrites the compiled program so it does less work per evaluation. The program
+/// is read back into an expression graph where identical subexpressions are one
+/// node, folding operators whose operands are both literals into a literal as it
+/// goes. Folding stops at a literal division by zero, which is kept so evaluating
+/// it still fails. The graph is then written out again in the same order, with
+/// any operator or aggregate used more than once stored in a temporary the first
+/// time and loaded after that. Nothing is regrouped, so results don't change
+/// </summary>
+void Formula::Optimize()
+{
+	const uint32_t none = UINT32_MAX;
+	struct Node
+	{
+		Instruction instruction;
+		uint32_t left;
+		uint32_t right;
+		uint32_t uses;
+		uint32_t temporary;
+	};
+	vector<Node> nodes;
+	map<tuple<OpCode, uint32_t, uint64_t, uint32_t, uint32_t>, uint32_t> known;
 
-			while (j < s.size() && (((int)s[j] >= 65 && (int)s[j] <= 90) || ((int)s[j] >= 48 && (int)s[j] <= 57)))
-				j++;
+	// Returns the node for an instruction applied to operand nodes, reusing an identical one
+	auto getNode = [&](const Instruction& instruction, uint32_t left, uint32_t right) {
+		uint64_t value;
+		memcpy(&value, &instruction.value, sizeof(value));
+		// + and * are commutative, so A1*B1 and B1*A1 are the same subexpression
+		bool commutative = instruction.op == OpCode::Add || instruction.op == OpCode::Multiply;
+		auto key = make_tuple(instruction.op, instruction.variable, value,
+			commutative ? min(left, right) : left, commutative ? max(left, right) : right);
+		auto found = known.find(key);
+		if (found != known.end())
+			return found->second;
+		nodes.push_back({ instruction, left, right, 0, none });
+		known.emplace(key, (uint32_t)(nodes.size() - 1));
+		return (uint32_t)(nodes.size() - 1);
+	};
 
-			output.push_back(s.substr(i, j - i));
-			i = j - 1;
+	vector<uint32_t> operands;
+	for (const Instruction& instruction : program) {
+		if (instruction.op != OpCode::Add && instruction.op != OpCode::Subtract
+			&& instruction.op != OpCode::Multiply && instruction.op != OpCode::Divide) {
+			operands.push_back(getNode(instruction, none, none));
 			continue;
 		}
 
-		//parse as a double
-		//48 is ascii for '0', 57 is ascii for '9', 46 is ascii for '.'
-		if ((int)s[i] == 46 || ((int)s[i] >= 48 && (int)s[i] <= 57))
-		{
+		uint32_t right = operands.back();
+		operands.pop_back();
+		uint32_t left = operands.back();
+		operands.pop_back();
+		const Instruction& a = nodes[left].instruction;
+		const Instruction& b = nodes[right].instruction;
+		if (a.op != OpCode::PushValue || b.op != OpCode::PushValue || (instruction.op == OpCode::Divide && b.value == 0)) {
+			operands.push_back(getNode(instruction, left, right));
+			continue;
+		}
 
-			int j = i + 1;
-			while (j < s.size() && ((int)s[j] == 46 || ((int)s[j] >= 48 && (int)s[j] <= 57)))
-				j++;
+		Instruction folded = { OpCode::PushValue, 0, 0 };
+		if (instruction.op == OpCode::Add)
+			folded.value = a.value + b.value;
+		else if (instruction.op == OpCode::Subtract)
+			folded.value = a.value - b.value;
+		else if (instruction.op == OpCode::Multiply)
+			folded.value = a.value * b.value;
+		else
+			folded.value = a.value / b.value;
+		operands.push_back(getNode(folded, none, none));
+	}
 
-			output.push_back(s.substr(i, j - i));
-			i = j - 1;
+	// Count the uses of each node reachable from the result. Operands are
+	// always created before the operators using them, so one pass backwards
+	// sees every user of a node before the node itself
+	const uint32_t root = operands.back();
+	nodes[root].uses = 1;
+	for (size_t i = nodes.size(); i-- > 0;) {
+		if (nodes[i].uses != 0 && nodes[i].left != none) {
+			nodes[nodes[i].left].uses++;
+			nodes[nodes[i].right].uses++;
+		}
+	}
+
+	// Write the graph back out in postfix order, without recursing since
+	// formulas can nest deeply
+	program.clear();
+	maxStackDepth = 0;
+	temporaryCount = 0;
+	size_t depth = 0;
+	vector<pair<uint32_t, bool>> pending = { { root, false } };
+	while (pending.size() != 0) {
+		const uint32_t index = pending.back().first;
+		const bool operandsWritten = pending.back().second;
+		pending.pop_back();
+		Node& node = nodes[index];
+
+		if (node.temporary != none) {
+			program.push_back({ OpCode::Load, node.temporary, 0 });
+			depth++;
+		}
+		else if (node.left != none && !operandsWritten) {
+			pending.push_back({ index, true });
+			pending.push_back({ node.right, false });
+			pending.push_back({ node.left, false });
 			continue;
 		}
+		else {
+			program.push_back(node.instruction);
+			if (node.left != none)
+				depth--;
+			else
+				depth++;
 
-		//if s[i] was none of the above, throw
-		throw exception();
+			// Literals and variables are as cheap to push again as to load
+			if (node.uses > 1 && node.instruction.op != OpCode::PushValue && node.instruction.op != OpCode::PushVariable) {
+				node.temporary = (uint32_t)temporaryCount++;
+				program.push_back({ OpCode::Store, node.temporary, 0 });
+			}
+		}
+
+		if (depth > maxStackDepth)
+			maxStackDepth = depth;
 	}
+}
+
+/// <summary>
+/// Returns the index of a cell in the variable table, adding it if necessary
+/// </summary>
+/// <param name="cell">Referenced cell, relative to the anchor</param>
+/// <returns>Index usable as Instruction::variable</returns>
+uint32_t Formula::GetVariableIndex(const CellOffset& cell)
+{
+	for (uint32_t i = 0; i < variables.size(); i++)
+		if (variables[i] == cell)
+			return i;
+	variables.push_back(cell);
+	return (uint32_t)(variables.size() - 1);
+}
 
-	return output;
+/// <summary>
+/// Returns the index of a range in the range table, adding it if necessary
+/// </summary>
+/// <param name="range">Corners of a range passed to an aggregate function, relative to the anchor</param>
+/// <returns>Index usable as Instruction::variable of an aggregate instruction</returns>
+uint32_t Formula::GetRangeIndex(const pair<CellOffset, CellOffset>& range)
+{
+	for (uint32_t i = 0; i < ranges.size(); i++)
+		if (ranges[i].first == range.first && ranges[i].second == range.second)
+			return i;
+	ranges.push_back(range);
+	return (uint32_t)(ranges.size() - 1);
+}
+
+/// <summary>
+/// Converts a cell into a reference relative to anchor
+/// </summary>
+CellOffset Formula::ToOffset(const CellId cell, const CellId anchor)
+{
+	return { cell.Column() - anchor.Column(), cell.Row() - anchor.Row() };
+}
+
+/// <summary>
+/// Converts a reference relative to anchor back into a cell. Returns an invalid
+/// cell if the reference falls off the sheet
+/// </summary>
+CellId Formula::ToCell(const CellOffset& offset, const CellId anchor)
+{
+	int column = anchor.Column() + offset.column;
+	int row = anchor.Row() + offset.row;
+	if (column < 0 || column >= CellId::Columns || row < 0 || row >= CellId::Rows)
+		return CellId();
+	return CellId(column, row);
+}
+
+/// <summary>
+/// Writes a relative reference the way it appears in the text of a formula
+/// </summary>
+string Formula::ToText(const CellOffset& offset)
+{
+	return "R[" + to_string(offset.row) + "]C[" + to_string(offset.column) + "]";
 }
 
 /// <summary>
@@ -186,217 +633,411 @@ vector<string> Formula::GetTokens(string s) {
 /// this Formula, the value is returned. Otherwise, an error is THROWN - this is different
 /// than original behavior, since I didn't wanna deal with a formula error class.
 /// </summary>
-double Formula::Evaluate(map<string, double> lookup) {
-	// Init stacks
+double Formula::Evaluate(map<CellId, double> lookup, const CellId anchor) {
 	vector<double> values;
-	vector<char> ops;
-	for (int itr = 0; itr < tokens.size(); ++itr) {
-		Token s = tokens[itr];
-		double value;
-		// Evaluate if token is a number or variable
-		if (s.Type != "op") {
-			// Assign value if token is a variable
-			if (s.Type == "var")
-			{
-				value = lookup[s.Content];
-			}
-			else
-			{
-				value = stod(s.Content);
-			}
-			// Evaluate / or *
-			if (ops.size() != 0 && (ops.back() == '/' || ops.back() == '*'))
-			{
-				if (values.size() == 0)
-				{
-					throw exception();
-				}
-				else
-				{
-					values.push_back(applyOperation(value, values.back(), ops.back()));
-					values.pop_back();
-					ops.pop_back();
-				}
-			}
-			else {
-				values.push_back(value);
-			}
-			// Evaluate if token is + or -
+	values.reserve(variables.size());
+	for (const CellOffset& variable : variables)
+		values.push_back(lookup[ToCell(variable, anchor)]);
+	return Run(values.data(), anchor, nullptr);
+}
+
+/// <summary>
+/// Evaluates this Formula with variable values given in the same order
+/// as GetVariables, and ranges at anchor aggregated by rangeLookup. Throws on division
+/// by zero, or if the formula uses ranges and no rangeLookup is given.
+/// </summary>
+double Formula::Evaluate(const vector<double>& variableValues, const CellId anchor, const RangeLookup* rangeLookup) const {
+	if (variableValues.size() < variables.size())
+		throw exception();
+	return Run(variableValues.data(), anchor, rangeLookup);
+}
+
+/// <summary>
+/// Number of lanes EvaluateBatch keeps on its stack at once, small enough
+/// for a whole stack of them to stay in the L1 cache
+/// </summary>
+static const size_t BatchChunk = 256;
+
+/// <summary>
+/// Applies a binary operator lane by lane: a[i] = a[i] op b[i].
+/// Lanes dividing by zero are marked in failed, their result is meaningless
+/// </summary>
+static void ApplyLanes(const OpCode op, double* a, const double* b, const size_t count, uint8_t* failed) {
+	size_t i = 0;
+#if defined(FORMULA_AVX)
+	const size_t width = 4;
+	for (; i + width <= count; i += width) {
+		__m256d left = _mm256_loadu_pd(a + i), right = _mm256_loadu_pd(b + i);
+		switch (op) {
+		case OpCode::Add: left = _mm256_add_pd(left, right); break;
+		case OpCode::Subtract: left = _mm256_sub_pd(left, right); break;
+		case OpCode::Multiply: left = _mm256_mul_pd(left, right); break;
+		default: {
+			int zeros = _mm256_movemask_pd(_mm256_cmp_pd(right, _mm256_setzero_pd(), _CMP_EQ_OQ));
+			for (size_t lane = 0; zeros != 0; lane++, zeros >>= 1)
+				failed[i + lane] |= zeros & 1;
+			left = _mm256_div_pd(left, right);
 		}
-		else if (s.Content.compare("+") == 0 || s.Content.compare("-") == 0) {
-			if (values.size() > 1 && ops.size() != 0 && ((ops.back() == '+') || (ops.back() == '-'))) {
-				double a = values.back(); values.pop_back();
-				double b = values.back(); values.pop_back();
-				char c = ops.back(); ops.pop_back();
-				values.push_back(applyOperation(a, b, c));
-			}
-			ops.push_back(s.Content[0]);
-			// Push *, /, or ( to ops stack
 		}
-		else if (s.Content.compare("*") == 0 || s.Content.compare("/") == 0 || s.Content.compare("(") == 0) {
-			ops.push_back(s.Content[0]);
-			// Evaluate closing parenthesis
+		_mm256_storeu_pd(a + i, left);
+	}
+#elif defined(FORMULA_SSE2)
+	const size_t width = 2;
+	for (; i + width <= count; i += width) {
+		__m128d left = _mm_loadu_pd(a + i), right = _mm_loadu_pd(b + i);
+		switch (op) {
+		case OpCode::Add: left = _mm_add_pd(left, right); break;
+		case OpCode::Subtract: left = _mm_sub_pd(left, right); break;
+		case OpCode::Multiply: left = _mm_mul_pd(left, right); break;
+		default: {
+			int zeros = _mm_movemask_pd(_mm_cmpeq_pd(right, _mm_setzero_pd()));
+			failed[i] |= zeros & 1;
+			failed[i + 1] |= (zeros >> 1) & 1;
+			left = _mm_div_pd(left, right);
 		}
-		else if (s.Content.compare(")") == 0) {
-			// See if parenthesis is matched
-			if (ops.size() != 0 && ops.back() == '(')
-			{
-				ops.pop_back();
-			}
-			// Make sure we have enough values
-			if (values.size() <= 1) {
-				if (ops.size() != 0 && ops.back() == '(') {
-					ops.pop_back();
-					continue;
-				}
+		}
+		_mm_storeu_pd(a + i, left);
+	}
+#endif
+	// Whatever didn't fill a whole vector
+	for (; i < count; i++) {
+		switch (op) {
+		case OpCode::Add: a[i] += b[i]; break;
+		case OpCode::Subtract: a[i] -= b[i]; break;
+		case OpCode::Multiply: a[i] *= b[i]; break;
+		default:
+			if (b[i] == 0)
+				failed[i] = 1;
+			a[i] /= b[i];
+		}
+	}
+}
+
+/// <summary>
+/// Evaluates this formula's program once per lane, for count lanes at a time, where
+/// each lane is a formula of the same shape (see SameShape). The stack holds a whole
+/// column of lanes per slot, so each instruction becomes one vectorized loop.
+/// variableValues[v * count + i] is the value of variable v in lane i. Lanes whose
+/// failed flag is set on entry are still computed, and lanes dividing by zero get
+/// their failed flag set; the result of a failed lane is meaningless.
+/// Formulas with aggregate functions can't be batched and throw.
+/// </summary>
+/// <param name="variableValues">Variable values, one column of count lanes per variable</param>
+/// <param name="count">Number of lanes</param>
+/// <param name="results">Receives the result of each lane</param>
+/// <param name="failed">Flag per lane, set where the lane divided by zero</param>
+void Formula::EvaluateBatch(const double* variableValues, const size_t count, double* results, uint8_t* failed) const {
+	if (ranges.size() != 0)
+		throw exception();
+
+	// Temporaries are kept in slots past the deepest the stack gets
+	vector<double> stack((max(maxStackDepth, (size_t)1) + temporaryCount) * min(count, BatchChunk));
+	for (size_t first = 0; first < count; first += BatchChunk) {
+		const size_t lanes = min(BatchChunk, count - first);
+		double* temporaries = stack.data() + maxStackDepth * lanes;
+		size_t top = 0;
+		for (const Instruction& instruction : program) {
+			double* slot = stack.data() + top * lanes;
+			switch (instruction.op) {
+			case OpCode::Store:
+				copy(slot - lanes, slot, temporaries + instruction.variable * lanes);
+				break;
+			case OpCode::Load: {
+				const double* temporary = temporaries + instruction.variable * lanes;
+				copy(temporary, temporary + lanes, slot);
+				top++;
+				break;
 			}
-			// Run + or -
-			if (ops.size() != 0 && ops.back() == '+' || ops.back() == '-') {
-				double a = values.back(); values.pop_back();
-				double b = values.back(); values.pop_back();
-				char c = ops.back(); ops.pop_back();
-				values.push_back(applyOperation(a, b, c));
-				if (ops.size() != 0 && ops.back() == '(') {
-					ops.pop_back();
-				}
+			case OpCode::PushValue:
+				fill(slot, slot + lanes, instruction.value);
+				top++;
+				break;
+			case OpCode::PushVariable: {
+				const double* column = variableValues + instruction.variable * count + first;
+				copy(column, column + lanes, slot);
+				top++;
+				break;
 			}
-			// Run * or /
-			if (ops.size() != 0 && ops.back() == '*' || ops.back() == '/') {
-				double a = values.back(); values.pop_back();
-				double b = values.back(); values.pop_back();
-				char c = ops.back(); ops.pop_back();
-				values.push_back(applyOperation(a, b, c));
+			default:
+				top--;
+				ApplyLanes(instruction.op, slot - 2 * lanes, slot - lanes, lanes, failed + first);
+				break;
 			}
 		}
+		copy(stack.data(), stack.data() + lanes, results + first);
 	}
+}
 
-	double result = 0;
-
-	// Final check & return
-	if (ops.size() == 0) {
-		if (values.size() == 1) {
-			result = values.back();
-			values.pop_back();
-		}
+/// <summary>
+/// Runs the compiled program on a value stack. Programs that fit in the
+/// inline buffer (nearly all of them) are evaluated without allocating.
+/// </summary>
+/// <param name="variableValues">Values indexed by Instruction::variable</param>
+/// <param name="anchor">Cell the formula is evaluated for, which ranges are relative to</param>
+/// <param name="rangeLookup">Computes aggregate instructions, may be null if there are none</param>
+/// <returns>Result of the formula</returns>
+double Formula::Run(const double* variableValues, const CellId anchor, const RangeLookup* rangeLookup) const {
+	// Temporaries are kept past the deepest the stack gets
+	const size_t inlineDepth = 32;
+	double inlineStack[inlineDepth];
+	vector<double> heapStack;
+	double* stack = inlineStack;
+	if (maxStackDepth + temporaryCount > inlineDepth) {
+		heapStack.resize(maxStackDepth + temporaryCount);
+		stack = heapStack.data();
 	}
-	else if (ops.size() == 1) {
-		if (values.size() == 2) {
-			double a = values.back(); values.pop_back();
-			double b = values.back(); values.pop_back();
-			char c = ops.back(); ops.pop_back();
-			result = applyOperation(a, b, c);
+	double* temporaries = stack + maxStackDepth;
+
+	size_t top = 0;
+	for (const Instruction& instruction : program) {
+		switch (instruction.op) {
+		case OpCode::PushValue:
+			stack[top++] = instruction.value;
+			break;
+		case OpCode::PushVariable:
+			stack[top++] = variableValues[instruction.variable];
+			break;
+		case OpCode::Add:
+			top--;
+			stack[top - 1] += stack[top];
+			break;
+		case OpCode::Subtract:
+			top--;
+			stack[top - 1] -= stack[top];
+			break;
+		case OpCode::Multiply:
+			top--;
+			stack[top - 1] *= stack[top];
+			break;
+		case OpCode::Divide:
+			top--;
+			if (stack[top] == 0)
+				throw exception();
+			stack[top - 1] /= stack[top];
+			break;
+		case OpCode::Store:
+			temporaries[instruction.variable] = stack[top - 1];
+			break;
+		case OpCode::Load:
+			stack[top++] = temporaries[instruction.variable];
+			break;
+		case OpCode::Sum:
+		case OpCode::Average:
+		case OpCode::Min:
+		case OpCode::Max:
+		case OpCode::Count:
+			if (rangeLookup == nullptr)
+				throw exception();
+			stack[top++] = rangeLookup->Aggregate(instruction.op, CellRange(
+				ToCell(ranges[instruction.variable].first, anchor), ToCell(ranges[instruction.variable].second, anchor)));
+			break;
 		}
 	}
 
-	return result;
+	// A program left with anything but its one result wasn't compiled by Parse or checked by Load
+	if (top != 1)
+		throw exception();
+	return stack[0];
 }
 
 /// <summary>
-/// Runs an algebraic operation on two integers
-/// </summary>
-/// <param name="op">Operator to use. Accepts +-*/</param>
-/// <param name="a">Int before the operator</param>
-/// <param name="a">Int after the operator</param>
-/// <exception cref="System.ArgumentException">Thrown when op isn't one of the four
-/// valid operators </exception>
-double Formula::applyOperation(double a, double b, char op) {
-	if (op == '+')
-		return a + b;
-	else if (op == '-')
-		return b - a;
-	else if (op == '*')
-		return a * b;
-	else if (op == '/')
-		if (a == 0)
-			throw exception();
-		else
-			return b / a;
-	else
-		throw exception();
+/// Returns the number of distinct variables in this formula
+/// </summary>
+size_t Formula::VariableCount() const {
+	return variables.size();
 }
 
 /// <summary>
-/// Returns a list of the variables that occur in this 
-/// formula. Variables are tokens that are not operations or doubles.
+/// Returns one variable of this formula as seen from the cell anchor, without
+/// building the whole list like GetVariables
 /// </summary>
-const vector<string> Formula::GetVariables() const {
-	vector<string> result;
+CellId Formula::GetVariable(const size_t index, const CellId anchor) const {
+	return ToCell(variables[index], anchor);
+}
 
-	// Loop through tokens, add vars to result
-	for (auto itr = tokens.begin(); itr != tokens.end(); ++itr) {
-		if (itr->Type == "var") {
-			result.push_back(itr->Content);
-		}
-	}
+/// <summary>
+/// Returns a list of the distinct variables that occur in this 
+/// formula, in order of first appearance, as seen from the cell anchor.
+/// Variables are tokens that are not operations or doubles.
+/// </summary>
+vector<CellId> Formula::GetVariables(const CellId anchor) const {
+	vector<CellId> result;
+	result.reserve(variables.size());
+	for (const CellOffset& variable : variables)
+		result.push_back(ToCell(variable, anchor));
+	return result;
+}
 
+/// <summary>
+/// Returns whether this formula has any aggregate functions
+/// </summary>
+bool Formula::HasRanges() const {
+	return ranges.size() != 0;
+}
+
+/// <summary>
+/// Returns the distinct ranges passed to aggregate functions in this formula,
+/// as seen from the cell anchor
+/// </summary>
+vector<CellRange> Formula::GetRanges(const CellId anchor) const {
+	vector<CellRange> result;
+	result.reserve(ranges.size());
+	for (const pair<CellOffset, CellOffset>& range : ranges)
+		result.push_back(CellRange(ToCell(range.first, anchor), ToCell(range.second, anchor)));
 	return result;
 }
 
 /// <summary>
-/// Returns a string containing no spaces which represents the formula.
+/// Returns the relative text of this formula, e.g. R[0]C[-2]*R[0]C[-1] for =A1*B1 in C1.
+/// Formulas with the same template compile to the same program and references,
+/// so one of them can stand in for all of them
 /// </summary>
-string Formula::ToString() const {
-	string result("=");
+const string& Formula::GetTemplate() const {
+	return text;
+}
 
-	// Loop through tokens, add each to result
-	for (auto itr = tokens.begin(); itr != tokens.end(); ++itr) {
-		result += (itr->Content);
+/// <summary>
+/// Returns a string containing no spaces which represents the formula,
+/// with references written as cell names as seen from the cell anchor.
+/// </summary>
+string Formula::ToString(const CellId anchor) const {
+	string result = "=";
+	size_t start = 0;
+	for (size_t marker = text.find("R["); marker != string::npos; marker = text.find("R[", start)) {
+		// Markers are always R[row]C[column], written by ToText
+		result.append(text, start, marker - start);
+		char* end;
+		long row = strtol(text.c_str() + marker + 2, &end, 10);
+		long column = strtol(end + 3, &end, 10);
+		result += ToCell({ (int32_t)column, (int32_t)row }, anchor).ToString();
+		start = end + 1 - text.c_str();
 	}
-
+	result.append(text, start, string::npos);
 	return result;
 }
 
 /// <summary>
-/// Constructs a new token class from the given string.
-/// This is where the validator is run, to ensure that the given
-/// string is a valid token.
+/// Returns the compiled program, for saving this formula (see Load)
 /// </summary>
-/// <param name="token"></param>
-Token::Token(string token) {
-	// Check if token is value, normalize if so
-	double output;
-	try {
-		output = stod(token);
-		Content = token;
-		Type = "val";
-		return;
-	}
-	catch (exception e)
-	{
-	}
+const vector<Instruction>& Formula::GetProgram() const {
+	return program;
+}
 
-	if (token.compare("*") == 0 || token.compare("/") == 0 || token.compare("-") == 0 || token.compare("+") == 0 ||
-		token.compare("(") == 0 || token.compare(")") == 0) {
-		Content = token;
-		Type = "op";
-	}
-	else if (IsValid(token)) {
-		Type = "var";
-		Content = token;
-	}
-	else {
-		throw exception();
-	}
+/// <summary>
+/// Returns the variables of this formula relative to its anchor, indexed by Instruction::variable
+/// </summary>
+const vector<CellOffset>& Formula::GetOffsets() const {
+	return variables;
+}
+
+/// <summary>
+/// Returns the ranges of this formula relative to its anchor, indexed by Instruction::variable
+/// </summary>
+const vector<pair<CellOffset, CellOffset>>& Formula::GetRangeOffsets() const {
+	return ranges;
 }
 
 /// <summary>
-/// Returns whether the given token is a valid variable.
-/// For this spreadsheet application, this means it is some number of upper case letters
-/// followed by a sequence of digits.
+/// Returns the deepest the value stack gets while running the program
 /// </summary>
-/// <param name="token"></param>
-/// <returns></returns>
-bool Token::IsValid(string token) {
-	if (token.size() <= 1 || token.size() > 3)
-		return false;
-	//65 is ascii for 'A', 90 is ascii for 'Z'
-	if ((int)token[0] < 65 || (int)token[0] > 90)
-		return false;
+size_t Formula::GetMaxStackDepth() const {
+	return maxStackDepth;
+}
+
+/// <summary>
+/// Returns the number of temporaries used by Store and Load instructions
+/// </summary>
+size_t Formula::GetTemporaryCount() const {
+	return temporaryCount;
+}
+
+/// <summary>
+/// Rebuilds a formula saved from GetProgram, GetOffsets, GetRangeOffsets, GetTemplate,
+/// GetMaxStackDepth and GetTemporaryCount, without parsing anything. The program is
+/// checked as it would run: every index must be in its table, and the stack must never
+/// run dry or grow past maxStackDepth, and hold one value at the end
+/// </summary>
+/// <returns>The formula, or nullptr if the parts don't make a program that can run</returns>
+shared_ptr<const Formula> Formula::Load(vector<Instruction> program, vector<CellOffset> variables,
+	vector<pair<CellOffset, CellOffset>> ranges, string text, const size_t maxStackDepth, const size_t temporaryCount) {
+	size_t depth = 0;
+	for (const Instruction& instruction : program) {
+		switch (instruction.op) {
+		case OpCode::PushValue:
+			depth++;
+			break;
+		case OpCode::PushVariable:
+			if (instruction.variable >= variables.size())
+				return nullptr;
+			depth++;
+			break;
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+			if (depth < 2)
+				return nullptr;
+			depth--;
+			break;
+		case OpCode::Store:
+			if (depth < 1 || instruction.variable >= temporaryCount)
+				return nullptr;
+			break;
+		case OpCode::Load:
+			if (instruction.variable >= temporaryCount)
+				return nullptr;
+			depth++;
+			break;
+		case OpCode::Sum:
+		case OpCode::Average:
+		case OpCode::Min:
+		case OpCode::Max:
+		case OpCode::Count:
+			if (instruction.variable >= ranges.size())
+				return nullptr;
+			depth++;
+			break;
+		default:
+			return nullptr;
+		}
+		if (depth > maxStackDepth)
+			return nullptr;
+	}
+	if (depth != 1)
+		return nullptr;
+
+	shared_ptr<Formula> formula(new Formula());
+	formula->program = move(program);
+	formula->variables = move(variables);
+	formula->ranges = move(ranges);
+	formula->text = move(text);
+	formula->maxStackDepth = maxStackDepth;
+	formula->temporaryCount = temporaryCount;
+	return formula;
+}
 
-	for (int i = 1; i < token.size(); i++)
-		//48 is ascii for '0', 57 is ascii for '9'
-		if ((int)token[i] < 48 || (int)token[i] > 57)
-			return false;
+bool CellOffset::operator== (const CellOffset& other) const {
+	return column == other.column && row == other.row;
+}
+
+bool FormulaParseResult::Succeeded() const {
+	return error == FormulaError::None;
+}
 
-	return true;
+string FormulaParseResult::ToString() const {
+	const char* description = "no error";
+	switch (error) {
+	case FormulaError::None: return description;
+	case FormulaError::MissingEquals: description = "formula must start with ="; break;
+	case FormulaError::Empty: description = "formula is empty"; break;
+	case FormulaError::InvalidCharacter: description = "invalid character"; break;
+	case FormulaError::InvalidNumber: description = "invalid number"; break;
+	case FormulaError::InvalidReference: description = "invalid cell reference"; break;
+	case FormulaError::ExpectedOperand: description = "expected a number, cell or ("; break;
+	case FormulaError::ExpectedOperator: description = "expected an operator"; break;
+	case FormulaError::UnbalancedParentheses: description = "unbalanced parentheses"; break;
+	case FormulaError::InvalidFunctionCall: description = "function must be called on one range or cell"; break;
+	case FormulaError::RangeOutsideFunction: description = "range used outside a function"; break;
+	}
+	return string(description) + " at position " + to_string(position);
 }
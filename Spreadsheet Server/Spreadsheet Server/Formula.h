@@ -1,36 +1,256 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <cstdint>
+#include <memory>
+#include "CellId.h"
+#include "CellRange.h"
 
 #ifndef Formula_H
 #define Formula_H
 
 using namespace std;
 
-class Token
+/// <summary>
+/// Operation codes of a compiled formula program
+/// </summary>
+enum class OpCode : uint8_t
+{
+	PushValue,
+	PushVariable,
+	Add,
+	Subtract,
+	Multiply,
+	Divide,
+	Sum,
+	Average,
+	Min,
+	Max,
+	Count,
+	Store,
+	Load
+};
+
+/// <summary>
+/// Kinds of error found while parsing a formula
+/// </summary>
+enum class FormulaError : uint8_t
+{
+	None,
+	/// <summary>The text doesn't start with =</summary>
+	MissingEquals,
+	/// <summary>Nothing follows the =</summary>
+	Empty,
+	/// <summary>A character that can't start any token</summary>
+	InvalidCharacter,
+	/// <summary>Digits and dots that don't form a number, e.g. 1.2.3</summary>
+	InvalidNumber,
+	/// <summary>A name that isn't a cell, range or function, e.g. XFE1 or X</summary>
+	InvalidReference,
+	/// <summary>An operator, ) or the end of the formula where a number, cell or ( is needed</summary>
+	ExpectedOperand,
+	/// <summary>A number, cell, function or ( right after another operand</summary>
+	ExpectedOperator,
+	/// <summary>A ) without a matching (, or a ( that is never closed</summary>
+	UnbalancedParentheses,
+	/// <summary>A function name not followed by a range or cell in parentheses</summary>
+	InvalidFunctionCall,
+	/// <summary>A range anywhere but as the argument of a function</summary>
+	RangeOutsideFunction
+};
+
+/// <summary>
+/// Outcome of parsing a formula: the error found, if any, and where
+/// </summary>
+struct FormulaParseResult
+{
+	FormulaError error;
+
+	/// <summary>
+	/// Index into the formula text, counting the leading =, where the error was found
+	/// </summary>
+	size_t position;
+
+	/// <summary>
+	/// Whether the formula parsed without error
+	/// </summary>
+	bool Succeeded() const;
+
+	/// <summary>
+	/// Describes the error for people, e.g. "expected a number, cell or ( at position 4"
+	/// </summary>
+	string ToString() const;
+};
+
+/// <summary>
+/// One lexical token of a formula
+/// </summary>
+struct Token
+{
+	enum class Kind : uint8_t
+	{
+		Number,
+		Cell,
+		Range,
+		Function,
+		Operator,
+		OpenParenthesis,
+		CloseParenthesis
+	};
+
+	Kind kind;
+
+	/// <summary>
+	/// Where the token starts in the formula text, and how many characters it spans
+	/// </summary>
+	size_t position;
+	size_t length;
+
+	/// <summary>
+	/// Value of a Number
+	/// </summary>
+	double number;
+
+	/// <summary>
+	/// The cell of a Cell, or the corners of a Range in the order they were written
+	/// </summary>
+	CellId first;
+	CellId second;
+
+	/// <summary>
+	/// One of + - * / for an Operator
+	/// </summary>
+	char op;
+
+	/// <summary>
+	/// Aggregate instruction of a Function
+	/// </summary>
+	OpCode function;
+};
+
+/// <summary>
+/// A single instruction of a compiled formula program.
+/// Literals are stored already parsed in value, variables are stored
+/// as an index into the formula's variable table, and aggregate functions
+/// store an index into the formula's range table in variable.
+/// Store copies the top of the stack into temporary number variable, leaving
+/// it on the stack, and Load pushes a temporary back; they hold subexpressions
+/// that appear more than once in the formula
+/// </summary>
+struct Instruction
+{
+	OpCode op;
+	uint32_t variable;
+	double value;
+};
+
+/// <summary>
+/// Supplies aggregates over cell ranges to a formula being evaluated
+/// </summary>
+class RangeLookup
 {
-private:
-	string Type;
-	string Content;
-	friend class Formula;
-	static bool IsValid(string token);
 public:
-	Token(string token); // s must be valid, or will throw
+	virtual ~RangeLookup() {}
+
+	/// <summary>
+	/// Computes an aggregate function over a range of cells.
+	/// Throws if the result is an error, e.g. the range contains an error
+	/// </summary>
+	/// <param name="function">One of OpCode::Sum, Average, Min, Max or Count</param>
+	/// <param name="range">Cells to aggregate</param>
+	/// <returns>The aggregate value</returns>
+	virtual double Aggregate(const OpCode function, const CellRange& range) const = 0;
 };
 
+/// <summary>
+/// A cell reference relative to the cell holding a formula, as in R1C1 notation
+/// </summary>
+struct CellOffset
+{
+	int32_t column;
+	int32_t row;
+
+	bool operator== (const CellOffset& other) const;
+};
+
+/// <summary>
+/// A compiled formula. References are stored relative to the cell the formula
+/// was compiled for (its anchor), so one Formula can be shared by every cell
+/// holding the same formula filled down or across a sheet: =A1*B1 in C1 and
+/// =A2*B2 in C2 are both R[0]C[-2]*R[0]C[-1]. Methods that deal in cells
+/// take the anchor of the cell asking
+/// </summary>
 class Formula
 {
 private:
-	//the tokens of this formula
-	vector<Token> tokens;
-	static vector<string> GetTokens(string s);
-	static double applyOperation(double a, double b, char op);
+	/// <summary>
+	/// Postfix program this formula was compiled into
+	/// </summary>
+	vector<Instruction> program;
+
+	/// <summary>
+	/// Distinct cells referenced by this formula, indexed by Instruction::variable
+	/// </summary>
+	vector<CellOffset> variables;
+
+	/// <summary>
+	/// Top left and bottom right corner of each distinct range referenced by
+	/// aggregate functions, indexed by Instruction::variable
+	/// </summary>
+	vector<pair<CellOffset, CellOffset>> ranges;
+
+	/// <summary>
+	/// Normalized text of this formula without the leading =, with every
+	/// reference written as R[row offset]C[column offset]
+	/// </summary>
+	string text;
+
+	/// <summary>
+	/// Deepest the value stack gets while running program
+	/// </summary>
+	size_t maxStackDepth;
+
+	/// <summary>
+	/// Number of temporaries used by Store and Load instructions in program
+	/// </summary>
+	size_t temporaryCount;
+
+	Formula();
+	static FormulaParseResult Lex(const string& formula, vector<Token>& tokens);
+	static FormulaParseResult Validate(const vector<Token>& tokens, const size_t end);
+	static string ToTemplate(const string& formula, const vector<Token>& tokens, const CellId anchor);
+	FormulaParseResult Build(const string& formula, const CellId anchor);
+	void Compile(const vector<Token>& tokens, const CellId anchor);
+	void Optimize();
+	uint32_t GetVariableIndex(const CellOffset& cell);
+	uint32_t GetRangeIndex(const pair<CellOffset, CellOffset>& range);
+	static CellOffset ToOffset(const CellId cell, const CellId anchor);
+	static CellId ToCell(const CellOffset& offset, const CellId anchor);
+	static string ToText(const CellOffset& offset);
+	double Run(const double* variableValues, const CellId anchor, const RangeLookup* rangeLookup) const;
 
 public:
-	Formula(const string formula);
-	double Evaluate(map<string, double> lookup);
-	const vector<string> GetVariables() const;
-	string ToString() const;
+	Formula(const string formula, const CellId anchor = CellId(0, 0));
+	static shared_ptr<const Formula> Parse(const string& formula, const CellId anchor, FormulaParseResult& result);
+	static FormulaParseResult Scan(const string& formula, const CellId anchor, vector<Token>& tokens, string& templateText);
+	static shared_ptr<const Formula> Compile(const vector<Token>& tokens, const CellId anchor, string templateText);
+	double Evaluate(map<CellId, double> lookup, const CellId anchor = CellId(0, 0));
+	double Evaluate(const vector<double>& variableValues, const CellId anchor = CellId(0, 0), const RangeLookup* rangeLookup = nullptr) const;
+	void EvaluateBatch(const double* variableValues, const size_t count, double* results, uint8_t* failed) const;
+	size_t VariableCount() const;
+	CellId GetVariable(const size_t index, const CellId anchor) const;
+	vector<CellId> GetVariables(const CellId anchor = CellId(0, 0)) const;
+	bool HasRanges() const;
+	vector<CellRange> GetRanges(const CellId anchor = CellId(0, 0)) const;
+	const string& GetTemplate() const;
+	string ToString(const CellId anchor = CellId(0, 0)) const;
+	const vector<Instruction>& GetProgram() const;
+	const vector<CellOffset>& GetOffsets() const;
+	const vector<pair<CellOffset, CellOffset>>& GetRangeOffsets() const;
+	size_t GetMaxStackDepth() const;
+	size_t GetTemporaryCount() const;
+	static shared_ptr<const Formula> Load(vector<Instruction> program, vector<CellOffset> variables,
+		vector<pair<CellOffset, CellOffset>> ranges, string text, const size_t maxStackDepth, const size_t temporaryCount);
 };
 
-#endif
\ No newline at end of file
+#endif
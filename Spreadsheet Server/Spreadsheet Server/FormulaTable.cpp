@@ -0,0 +1,65 @@
+#include "FormulaTable.h"
+
+// See FormulaTable.h for documentation
+
+FormulaTable::FormulaTable() : templates(), sweepAt(64), lock() {
+}
+
+shared_ptr<const Formula> FormulaTable::Intern(const string& contents, const CellId anchor) {
+	FormulaParseResult result;
+	return Intern(contents, anchor, result);
+}
+
+shared_ptr<const Formula> FormulaTable::Intern(const string& contents, const CellId anchor, FormulaParseResult& result) {
+	result = { FormulaError::None, 0 };
+	if (contents.size() == 0 || contents[0] != '=')
+		return nullptr;
+
+	// The template only takes lexing, so a filled-down column compiles once
+	vector<Token> tokens;
+	string templateText;
+	result = Formula::Scan(contents, anchor, tokens, templateText);
+	if (!result.Succeeded())
+		return nullptr;
+	{
+		lock_guard<mutex> guard(lock);
+		auto found = templates.find(templateText);
+		if (found != templates.end()) {
+			shared_ptr<const Formula> existing = found->second.lock();
+			if (existing)
+				return existing;
+		}
+	}
+
+	// Compiled outside the lock. If another thread gets the template in first, Share returns its copy
+	return Share(Formula::Compile(tokens, anchor, move(templateText)));
+}
+
+shared_ptr<const Formula> FormulaTable::Share(const shared_ptr<const Formula>& formula) {
+	lock_guard<mutex> guard(lock);
+	weak_ptr<const Formula>& entry = templates[formula->GetTemplate()];
+	shared_ptr<const Formula> existing = entry.lock();
+	if (existing)
+		return existing;
+	entry = formula;
+
+	if (templates.size() >= sweepAt) {
+		for (auto iter = templates.begin(); iter != templates.end();) {
+			if (iter->second.expired())
+				iter = templates.erase(iter);
+			else
+				++iter;
+		}
+		sweepAt = templates.size() * 2 + 64;
+	}
+	return formula;
+}
+
+size_t FormulaTable::Size() {
+	lock_guard<mutex> guard(lock);
+	size_t live = 0;
+	for (const pair<const string, weak_ptr<const Formula>>& entry : templates)
+		if (!entry.second.expired())
+			live++;
+	return live;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "CellId.h"
+#include "Formula.h"
+
+#ifndef FormulaTable_H
+#define FormulaTable_H
+
+using namespace std;
+
+/// <summary>
+/// Interns the formulas of one spreadsheet by their relative template (see
+/// Formula::GetTemplate), so every cell of a filled-down column shares one
+/// compiled Formula instead of holding its own copy. Templates are held weakly
+/// and disappear once no cell uses them. Safe to use from several threads
+/// </summary>
+class FormulaTable
+{
+private:
+	/// <summary>
+	/// Formulas by template
+	/// </summary>
+	unordered_map<string, weak_ptr<const Formula>> templates;
+
+	/// <summary>
+	/// Size templates may grow to before entries of unused templates are swept out
+	/// </summary>
+	size_t sweepAt;
+
+	mutex lock;
+
+public:
+	/// <summary>
+	/// Creates an empty table
+	/// </summary>
+	FormulaTable();
+
+	/// <summary>
+	/// Parses the contents of a cell, returning the shared formula for its template.
+	/// Only contents whose template isn't in use yet are compiled
+	/// </summary>
+	/// <param name="contents">Cell contents</param>
+	/// <param name="anchor">Cell the contents are for</param>
+	/// <returns>The formula, or null if contents are not a valid formula</returns>
+	shared_ptr<const Formula> Intern(const string& contents, const CellId anchor);
+
+	/// <summary>
+	/// Same as Intern above, also reporting why contents starting with = failed to parse
+	/// </summary>
+	/// <param name="result">Set to the parse error, or FormulaError::None</param>
+	shared_ptr<const Formula> Intern(const string& contents, const CellId anchor, FormulaParseResult& result);
+
+	/// <summary>
+	/// Adds a formula that's already compiled, such as one loaded from a file, to the table
+	/// </summary>
+	/// <param name="formula">Formula to add, not null</param>
+	/// <returns>The formula the table holds for its template: this one, unless it already had one</returns>
+	shared_ptr<const Formula> Share(const shared_ptr<const Formula>& formula);
+
+	/// <summary>
+	/// Gets the number of templates currently in use
+	/// </summary>
+	size_t Size();
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "HistoryFile.h"
+#include <stdexcept>
+
+// See HistoryFile.h for documentation
+
+HistoryFile::HistoryFile(const string path) : path(path), file(), cache(), recent() {
+	// Opening for appending creates the file, then it's reopened for reading too
+	ofstream create(path, ios::binary | ios::app);
+	create.close();
+	file.open(path, ios::binary | ios::in | ios::out);
+	if (!file.good())
+		throw runtime_error("Could not open history file " + path);
+}
+
+uint64_t HistoryFile::Append(const string& record) {
+	lock_guard<mutex> guard(lock);
+	file.clear();
+	file.seekp(0, ios::end);
+	const uint64_t offset = (uint64_t)file.tellp();
+
+	// Each record is its length followed by its bytes
+	const uint64_t size = record.size();
+	file.write((const char*)&size, sizeof(size));
+	file.write(record.data(), record.size());
+	file.flush();
+	if (!file.good())
+		throw runtime_error("Could not write history file " + path);
+	return offset;
+}
+
+shared_ptr<const string> HistoryFile::Read(const uint64_t offset) {
+	lock_guard<mutex> guard(lock);
+	auto cached = cache.find(offset);
+	if (cached != cache.end()) {
+		recent.splice(recent.begin(), recent, cached->second.second);
+		return cached->second.first;
+	}
+
+	file.clear();
+	file.seekg(offset);
+	uint64_t size = 0;
+	file.read((char*)&size, sizeof(size));
+	shared_ptr<string> record = make_shared<string>();
+	if (file.good()) {
+		record->resize(size);
+		file.read(&(*record)[0], size);
+	}
+	if (!file.good())
+		throw runtime_error("No history record at " + to_string(offset) + " in " + path);
+
+	recent.push_front(offset);
+	cache[offset] = make_pair(record, recent.begin());
+	if (cache.size() > CachedRecords) {
+		cache.erase(recent.back());
+		recent.pop_back();
+	}
+	return record;
+}
+
+const string& HistoryFile::GetPath() const {
+	return path;
+}
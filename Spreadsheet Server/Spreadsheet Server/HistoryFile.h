@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <fstream>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+#ifndef HistoryFile_H
+#define HistoryFile_H
+
+using namespace std;
+
+/// <summary>
+/// An append-only file of records, holding the part of a spreadsheet's history
+/// too old to keep in memory (see VersionLog::SpillTo). Records are written once
+/// and never change, so the offset a record was written at identifies it for good.
+/// The last few records read are cached, since reading deep into history tends to
+/// walk one record after another. Safe to use from several threads
+/// </summary>
+class HistoryFile
+{
+private:
+	/// <summary>
+	/// Path of the file
+	/// </summary>
+	string path;
+
+	/// <summary>
+	/// The file, opened for reading and appending
+	/// </summary>
+	fstream file;
+
+	/// <summary>
+	/// Recently read records by offset, and their offsets from most to least recently used
+	/// </summary>
+	unordered_map<uint64_t, pair<shared_ptr<const string>, list<uint64_t>::iterator>> cache;
+	list<uint64_t> recent;
+
+	mutex lock;
+
+public:
+	/// <summary>
+	/// Records kept in the cache
+	/// </summary>
+	static const size_t CachedRecords = 8;
+
+	/// <summary>
+	/// Opens a history file, creating it if it doesn't exist. Throws if it can't be opened
+	/// </summary>
+	/// <param name="path">Path of the file</param>
+	HistoryFile(const string path);
+
+	/// <summary>
+	/// Appends a record to the end of the file. Throws if writing fails
+	/// </summary>
+	/// <param name="record">Bytes of the record</param>
+	/// <returns>Offset identifying the record</returns>
+	uint64_t Append(const string& record);
+
+	/// <summary>
+	/// Reads a record back. Throws if there's no record at offset
+	/// </summary>
+	/// <param name="offset">Offset returned by Append</param>
+	/// <returns>Bytes of the record</returns>
+	shared_ptr<const string> Read(const uint64_t offset);
+
+	/// <summary>
+	/// Gets the path of the file
+	/// </summary>
+	const string& GetPath() const;
+};
+
+#endif
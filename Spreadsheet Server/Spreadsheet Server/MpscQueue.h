@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+#ifndef MpscQueue_H
+#define MpscQueue_H
+
+using namespace std;
+
+/// <summary>
+/// Unbounded lock-free queue that any number of threads push to and one thread pops from.
+/// A push is one atomic exchange, so network threads never wait on each other or on the
+/// thread draining the queue.
+///
+/// Items are kept in a linked list running from the oldest node to the newest. Pushing
+/// swaps the new node in as the newest, then links the node it replaced to it. Between
+/// those two steps the item is in the queue but can't be reached yet, so TryPop may
+/// report the queue empty while a push is finishing. Whoever drains the queue must be told
+/// about pushes some other way (ServerController posts a drain after pushing) and not
+/// rely on TryPop alone.
+/// T must be default constructible and movable
+/// </summary>
+template <typename T>
+class MpscQueue
+{
+private:
+	struct Node
+	{
+		atomic<Node*> next;
+		T value;
+	};
+
+	/// <summary>
+	/// Most recently pushed node. Producers swap themselves in here
+	/// </summary>
+	atomic<Node*> newest;
+
+	/// <summary>
+	/// Node whose value was popped last (or a blank one at first). The next value to pop
+	/// is in the node after it. Only used by the consumer
+	/// </summary>
+	Node* oldest;
+
+public:
+	/// <summary>
+	/// Creates an empty queue
+	/// </summary>
+	MpscQueue() {
+		Node* blank = new Node();
+		blank->next.store(nullptr, memory_order_relaxed);
+		newest.store(blank, memory_order_relaxed);
+		oldest = blank;
+	}
+
+	MpscQueue(const MpscQueue& other) = delete;
+	MpscQueue& operator= (const MpscQueue& other) = delete;
+
+	/// <summary>
+	/// Deletes the items still in the queue. No thread may be pushing
+	/// </summary>
+	~MpscQueue() {
+		while (oldest != nullptr) {
+			Node* next = oldest->next.load(memory_order_relaxed);
+			delete oldest;
+			oldest = next;
+		}
+	}
+
+	/// <summary>
+	/// Adds an item to the back of the queue. Safe to call from any thread
+	/// </summary>
+	/// <param name="value">Item to add</param>
+	void Push(T value) {
+		Node* node = new Node();
+		node->next.store(nullptr, memory_order_relaxed);
+		node->value = move(value);
+		Node* previous = newest.exchange(node, memory_order_acq_rel);
+		previous->next.store(node, memory_order_release);
+	}
+
+	/// <summary>
+	/// Takes the item at the front of the queue. Only one thread may pop at a time
+	/// </summary>
+	/// <param name="value">Receives the item</param>
+	/// <returns>False if no item could be taken</returns>
+	bool TryPop(T& value) {
+		Node* next = oldest->next.load(memory_order_acquire);
+		if (next == nullptr)
+			return false;
+		value = move(next->value);
+		delete oldest;
+		oldest = next;
+		return true;
+	}
+};
+
+#endif
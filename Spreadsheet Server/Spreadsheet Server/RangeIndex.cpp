@@ -0,0 +1,153 @@
+#include "RangeIndex.h"
+#include <algorithm>
+
+// See RangeIndex.h for documentation
+
+RangeIndex::RangeIndex() : nodes(), freeNodes(), root(-1), count(0), seed(2463534242u) {
+}
+
+/// <summary>
+/// Whether node is ordered before the entry (range, dependent). Entries are ordered by
+/// top row first, which is what lets a stabbing query skip everything starting below the cell
+/// </summary>
+bool RangeIndex::Before(const Node& node, const CellRange& range, const CellId dependent) const {
+	if (node.range.TopLeft().Row() != range.TopLeft().Row())
+		return node.range.TopLeft().Row() < range.TopLeft().Row();
+	if (!(node.range.TopLeft() == range.TopLeft()))
+		return node.range.TopLeft() < range.TopLeft();
+	if (!(node.range.BottomRight() == range.BottomRight()))
+		return node.range.BottomRight() < range.BottomRight();
+	return node.dependent < dependent;
+}
+
+/// <summary>
+/// Recomputes the subtree bounds of node from its own range and its children
+/// </summary>
+void RangeIndex::Pull(const int32_t node) {
+	Node& n = nodes[node];
+	n.maxRow = n.range.BottomRight().Row();
+	n.minColumn = n.range.TopLeft().Column();
+	n.maxColumn = n.range.BottomRight().Column();
+	for (int32_t child : { n.left, n.right }) {
+		if (child == -1)
+			continue;
+		n.maxRow = max(n.maxRow, nodes[child].maxRow);
+		n.minColumn = min(n.minColumn, nodes[child].minColumn);
+		n.maxColumn = max(n.maxColumn, nodes[child].maxColumn);
+	}
+}
+
+/// <summary>
+/// Splits the subtree at node into entries ordered before (range, dependent), and the rest.
+/// If inclusive, the entry (range, dependent) itself also goes into less
+/// </summary>
+void RangeIndex::Split(const int32_t node, const CellRange& range, const CellId dependent, const bool inclusive, int32_t& less, int32_t& rest) {
+	if (node == -1) {
+		less = rest = -1;
+		return;
+	}
+	bool goesLeft = Before(nodes[node], range, dependent)
+		|| (inclusive && nodes[node].range == range && nodes[node].dependent == dependent);
+	if (goesLeft) {
+		Split(nodes[node].right, range, dependent, inclusive, nodes[node].right, rest);
+		less = node;
+	}
+	else {
+		Split(nodes[node].left, range, dependent, inclusive, less, nodes[node].left);
+		rest = node;
+	}
+	Pull(node);
+}
+
+/// <summary>
+/// Joins two subtrees where every entry of left is ordered before every entry of right
+/// </summary>
+int32_t RangeIndex::Merge(const int32_t left, const int32_t right) {
+	if (left == -1)
+		return right;
+	if (right == -1)
+		return left;
+	if (nodes[left].priority > nodes[right].priority) {
+		nodes[left].right = Merge(nodes[left].right, right);
+		Pull(left);
+		return left;
+	}
+	nodes[right].left = Merge(left, nodes[right].left);
+	Pull(right);
+	return right;
+}
+
+void RangeIndex::Add(const CellRange& range, const CellId dependent) {
+	int32_t less, rest, equal;
+	Split(root, range, dependent, false, less, rest);
+	Split(rest, range, dependent, true, equal, rest);
+	if (equal == -1) {
+		// xorshift, so priorities (and thus the tree shape) are the same every run
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		Node node = { range, dependent, 0, 0, 0, seed, -1, -1 };
+		if (freeNodes.size() != 0) {
+			equal = freeNodes.back();
+			freeNodes.pop_back();
+			nodes[equal] = node;
+		}
+		else {
+			equal = (int32_t)nodes.size();
+			nodes.push_back(node);
+		}
+		Pull(equal);
+		count++;
+	}
+	root = Merge(Merge(less, equal), rest);
+}
+
+bool RangeIndex::Remove(const CellRange& range, const CellId dependent) {
+	int32_t less, rest, equal;
+	Split(root, range, dependent, false, less, rest);
+	Split(rest, range, dependent, true, equal, rest);
+	root = Merge(less, rest);
+	if (equal == -1)
+		return false;
+	freeNodes.push_back(equal);
+	count--;
+	return true;
+}
+
+void RangeIndex::Stab(const CellId cell, vector<CellId>& dependents) const {
+	Stab(root, cell, dependents);
+}
+
+void RangeIndex::Stab(const int32_t node, const CellId cell, vector<CellId>& dependents) const {
+	if (node == -1)
+		return;
+	const Node& n = nodes[node];
+	if (n.maxRow < cell.Row() || n.minColumn > cell.Column() || n.maxColumn < cell.Column())
+		return;
+	Stab(n.left, cell, dependents);
+	// Everything to the right starts at or below this range's top row
+	if (n.range.TopLeft().Row() > cell.Row())
+		return;
+	if (n.range.Contains(cell))
+		dependents.push_back(n.dependent);
+	Stab(n.right, cell, dependents);
+}
+
+bool RangeIndex::Stabs(const CellId cell) const {
+	return Stabs(root, cell);
+}
+
+bool RangeIndex::Stabs(const int32_t node, const CellId cell) const {
+	if (node == -1)
+		return false;
+	const Node& n = nodes[node];
+	if (n.maxRow < cell.Row() || n.minColumn > cell.Column() || n.maxColumn < cell.Column())
+		return false;
+	if (n.range.Contains(cell) || Stabs(n.left, cell))
+		return true;
+	return n.range.TopLeft().Row() <= cell.Row() && Stabs(n.right, cell);
+}
+
+size_t RangeIndex::Size() const {
+	return count;
+}
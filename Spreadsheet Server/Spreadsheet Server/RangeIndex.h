@@ -0,0 +1,104 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "CellId.h"
+#include "CellRange.h"
+
+#ifndef RangeIndex_H
+#define RangeIndex_H
+
+using namespace std;
+
+/// <summary>
+/// Stores which cells depend on which ranges, one entry per range no matter
+/// how many cells it covers, and answers "which ranges contain this cell"
+/// (a stabbing query) without looking at ranges far away from it.
+/// Implemented as a treap ordered by the top row of each range, where every
+/// node also knows the lowest bottom row and the column span of its subtree,
+/// so whole subtrees that end above the cell or miss its column are skipped
+/// </summary>
+class RangeIndex
+{
+private:
+	struct Node
+	{
+		CellRange range;
+		CellId dependent;
+		/// <summary>
+		/// Largest bottom row, and smallest and largest column, in this subtree
+		/// </summary>
+		int maxRow;
+		int minColumn;
+		int maxColumn;
+		uint32_t priority;
+		/// <summary>
+		/// Child indices into nodes, or -1 if absent
+		/// </summary>
+		int32_t left;
+		int32_t right;
+	};
+
+	/// <summary>
+	/// All nodes, including removed ones waiting to be reused
+	/// </summary>
+	vector<Node> nodes;
+
+	/// <summary>
+	/// Indices of removed nodes in nodes
+	/// </summary>
+	vector<int32_t> freeNodes;
+
+	int32_t root;
+	size_t count;
+	uint32_t seed;
+
+	bool Before(const Node& node, const CellRange& range, const CellId dependent) const;
+	void Pull(const int32_t node);
+	void Split(const int32_t node, const CellRange& range, const CellId dependent, const bool inclusive, int32_t& less, int32_t& rest);
+	int32_t Merge(const int32_t left, const int32_t right);
+	void Stab(const int32_t node, const CellId cell, vector<CellId>& dependents) const;
+	bool Stabs(const int32_t node, const CellId cell) const;
+
+public:
+	/// <summary>
+	/// Creates an empty index
+	/// </summary>
+	RangeIndex();
+
+	/// <summary>
+	/// Records that dependent depends on every cell of range. Adding the same pair twice has no effect
+	/// </summary>
+	/// <param name="range">Range referenced by dependent</param>
+	/// <param name="dependent">Cell whose formula references range</param>
+	void Add(const CellRange& range, const CellId dependent);
+
+	/// <summary>
+	/// Removes a pair added with Add
+	/// </summary>
+	/// <param name="range">Range referenced by dependent</param>
+	/// <param name="dependent">Cell whose formula referenced range</param>
+	/// <returns>False if the pair wasn't in the index</returns>
+	bool Remove(const CellRange& range, const CellId dependent);
+
+	/// <summary>
+	/// Appends the dependent of every range containing cell to dependents.
+	/// A dependent appears once for each of its ranges that contains cell
+	/// </summary>
+	/// <param name="cell">Cell to look up</param>
+	/// <param name="dependents">List to append to</param>
+	void Stab(const CellId cell, vector<CellId>& dependents) const;
+
+	/// <summary>
+	/// Whether any range contains cell
+	/// </summary>
+	/// <param name="cell">Cell to look up</param>
+	/// <returns>True if cell has at least one dependent through a range</returns>
+	bool Stabs(const CellId cell) const;
+
+	/// <summary>
+	/// Gets the number of ranges in the index
+	/// </summary>
+	size_t Size() const;
+};
+
+#endif
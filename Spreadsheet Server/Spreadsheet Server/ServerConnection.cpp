@@ -5,6 +5,9 @@
 #include <list>
 #include <memory>
 #include <sstream>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
@@ -16,25 +19,65 @@ using boost::property_tree::ptree;
 using boost::property_tree::read_json;
 using boost::property_tree::write_json;
 
-ServerConnection::ServerConnection(ServerController* control) : s_ioservice(), s_acceptor(s_ioservice), connections(), control(control) {
+ServerConnection::ServerConnection(ServerController* control) : s_ioservice(), s_acceptor(s_ioservice), control(control), started(false) {
 }
 
 void ServerConnection::run()
 {
+	// This thread and one more per other core all run handlers
+	started = true;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < threads; i++)
+		workers.emplace_back([this]() { s_ioservice.run(); });
 	s_ioservice.run();
 
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+bool ServerConnection::running()
+{
+	return started && !s_ioservice.stopped();
+}
+
+boost::asio::io_service& ServerConnection::service()
+{
+	return s_ioservice;
+}
+
+void ServerConnection::send(it_connection state, std::shared_ptr<std::string> msg_buffer)
+{
+	state->strand.post([this, state, msg_buffer]() {
+		if (!state->socket.is_open())
+			return;
+		// Only one write at a time, or messages could interleave on the socket
+		state->outbox.push_back(msg_buffer);
+		if (state->outbox.size() == 1)
+			write_next(state);
+	});
+}
+
+void ServerConnection::write_next(it_connection state)
+{
+	std::shared_ptr<std::string> buffer = state->outbox.front();
+	auto handler = boost::bind(&ServerConnection::mng_send, this, state, buffer, boost::asio::placeholders::error);
+	boost::asio::async_write(state->socket, boost::asio::buffer(*buffer), state->strand.wrap(handler));
 }
 
 void ServerConnection::mng_send(it_connection state, std::shared_ptr<std::string> msg_buffer, boost::system::error_code const& error)
 {
-	// Reports an error message, if present
+	// Reports an error message, if present, and drops the rest of the outbox
 	if (error)
 	{
 		std::cout << error.message() << std::endl;
+		state->outbox.clear();
+		return;
 	}
-	else {
-		std::string s((std::istreambuf_iterator<char>(&state->read_buffer)), std::istreambuf_iterator<char>());
-	}
+
+	state->outbox.pop_front();
+	if (!state->outbox.empty())
+		write_next(state);
 }
 
 void ServerConnection::mng_receive(it_connection state, boost::system::error_code const& error, size_t bytes)
@@ -42,16 +85,16 @@ void ServerConnection::mng_receive(it_connection state, boost::system::error_cod
 	// Check for client disconnect
 	if ((boost::asio::error::eof == error) || (boost::asio::error::connection_reset == error)) {
 		delete_client(state->ID);
-		connections.erase(state);
 		return;
 	}
 
 	// Only process if bytes are received
 	if (bytes > 0)
 	{
-		std::string s((std::istreambuf_iterator<char>(&state->read_buffer)), std::istreambuf_iterator<char>());
+		// Take every complete line received. A line still arriving stays in the buffer for the next read
+		std::string s(boost::asio::buffers_begin(state->read_buffer.data()), boost::asio::buffers_end(state->read_buffer.data()));
+		s = s.substr(0, s.rfind('\n') + 1);
 		std::cout << "Received message: " << s;
-		state->read_buffer.commit(s.size());
 		state->read_buffer.consume(s.size());
 		// Checks if this JSON and needs to be serialized
 		if (s.at(0) != '{') {
@@ -64,10 +107,13 @@ void ServerConnection::mng_receive(it_connection state, boost::system::error_cod
 					userName = s.substr(0, s.find('\n'));
 				// Creates client if userName is provided
 
-				state->setID(ids);
-				shared_ptr<Client> client = make_shared<Client>(ids, userName, state);
-				connected_clients.emplace(ids, client);
-				ids++;
+				{
+					std::lock_guard<std::mutex> guard(clients_lock);
+					state->setID(ids);
+					shared_ptr<Client> client = make_shared<Client>(ids, userName, state);
+					connected_clients.emplace(ids, client);
+					ids++;
+				}
 				state->user_chosen = true;
 
 				std::cout << "Sending spreadsheet names to: " << s << std::endl;
@@ -79,17 +125,14 @@ void ServerConnection::mng_receive(it_connection state, boost::system::error_cod
 				for (auto name : control->GetSpreadsheetNames()) {
 					sentSpreadsheet = true;
 					std::cout << "Spreadsheet: " << name << std::endl;
-					auto buffer = std::make_shared<std::string>(name + "\n");
-					auto handler = boost::bind(&ServerConnection::mng_send, this, state, buffer, boost::asio::placeholders::error);
-					boost::asio::async_write(state->socket, boost::asio::buffer(*buffer), handler);
+					send(state, std::make_shared<std::string>(name + "\n"));
 				}
 
 				auto buffer = std::make_shared<std::string>("\n\n");
 				if (sentSpreadsheet)
 					buffer = std::make_shared<std::string>("\n");
 
-				auto handler = boost::bind(&ServerConnection::mng_send, this, state, buffer, boost::asio::placeholders::error);
-				boost::asio::async_write(state->socket, boost::asio::buffer(*buffer), handler);
+				send(state, buffer);
 			}
 
 			//Spreadsheet to be chosen, client is connected to it
@@ -97,8 +140,7 @@ void ServerConnection::mng_receive(it_connection state, boost::system::error_cod
 				std::string ss_name(s);
 				if (s[s.size() - 1] == '\n')
 					ss_name = s.substr(0, s.size() - 1);
-				shared_ptr<Client> c = connected_clients.at(state->ID);
-				control->ConnectClientToSpreadsheet(c, ss_name);
+				control->ConnectClientToSpreadsheet(find_client(state->ID), ss_name);
 			}
 		}
 		else {
@@ -126,12 +168,17 @@ void ServerConnection::mng_receive(it_connection state, boost::system::error_cod
 
 					//Selector and messageType gone!
 					// Create a client pointer to add to the stack of requests
-					shared_ptr<Client> c = connected_clients.at(state->ID);
-					EditRequest request(requestType, cellName, content, c);
+					// editCells sends a block of cells as an object mapping cell names to contents
+					std::vector<std::pair<std::string, std::string>> edits;
+					if (requestType == "editCells")
+						for (const std::pair<const std::string, ptree>& edit : pt2.get_child("cells"))
+							edits.push_back(std::make_pair(edit.first, edit.second.get_value<std::string>()));
+
+					EditRequest request(requestType, cellName, content, find_client(state->ID), edits);
 					control->ProcessClientRequest(request);
 				}
 				catch (const exception& e) {
-					EditRequest request("JSONerror", "", "", connected_clients.at(state->ID));
+					EditRequest request("JSONerror", "", "", find_client(state->ID));
 					control->ProcessClientRequest(request);
 					cout << "Bad json read: " << e.what() << endl;
 				}
@@ -164,12 +211,12 @@ void ServerConnection::mng_accept(it_connection state, boost::system::error_code
 void ServerConnection::async_receive(it_connection state)
 {
 	auto handler = boost::bind(&ServerConnection::mng_receive, this, state, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred);
-	boost::asio::async_read_until(state->socket, state->read_buffer, "\n", handler);
+	boost::asio::async_read_until(state->socket, state->read_buffer, "\n", state->strand.wrap(handler));
 }
 
 void ServerConnection::begin_accept()
 {
-	auto state = connections.emplace(connections.begin(), s_ioservice);
+	auto state = std::make_shared<Connection>(s_ioservice);
 	auto handler = boost::bind(&ServerConnection::mng_accept, this, state, boost::asio::placeholders::error);
 
 	s_acceptor.async_accept(state->socket, handler);
@@ -195,10 +242,7 @@ void ServerConnection::broadcast(std::list<shared_ptr<Client>>& clients, std::st
 	for (shared_ptr<Client> client : clients)
 	{
 		try {
-			if (client->state->socket.is_open()) {
-				auto handler = boost::bind(&ServerConnection::mng_send, this, client->state, buffer, boost::asio::placeholders::error);
-				boost::asio::async_write(client->state->socket, boost::asio::buffer(*buffer), handler);
-			}
+			send(client->state, buffer);
 		}
 		catch (exception e) {
 			cout << "Could not send message to client " << client->GetID() << endl;
@@ -208,14 +252,22 @@ void ServerConnection::broadcast(std::list<shared_ptr<Client>>& clients, std::st
 }
 
 void ServerConnection::delete_client(int ID) {
-	//in this case, nothing to delete
-	if (connected_clients.count(ID) == 0)
-		return;
+	shared_ptr<Client> c;
+	{
+		std::lock_guard<std::mutex> guard(clients_lock);
+		//in this case, nothing to delete
+		if (connected_clients.count(ID) == 0)
+			return;
+		c = connected_clients.at(ID);
+		connected_clients.erase(ID);
+	}
 
-	shared_ptr<Client> c = connected_clients.at(ID);
 	if (c->spreadsheet != "")
 		control->DisconnectClient(c);
+}
 
-	connected_clients.erase(ID);
+shared_ptr<Client> ServerConnection::find_client(int ID) {
+	std::lock_guard<std::mutex> guard(clients_lock);
+	return connected_clients.at(ID);
 }
 
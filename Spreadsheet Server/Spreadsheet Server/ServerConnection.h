@@ -7,6 +7,8 @@
 #include <stack>
 #include <boost/asio.hpp> 
 #include <unordered_map>
+#include <mutex>
+#include <atomic>
 
 
 #ifndef SERVER_CONNECTION_H
@@ -16,20 +18,22 @@
 class ServerController;
 
 /// <summary>
-/// Networking of the server. Able to establish client / server connections via TCP Listener
+/// Networking of the server. Able to establish client / server connections via TCP Listener.
+/// The io_service is run by a thread per core. Each connection's handlers run on its
+/// strand, and ServerController runs each spreadsheet's work on a strand of its own
 /// </summary>
 class ServerConnection
 {
 	boost::asio::io_service s_ioservice;					// Boost class that supports asynchronous functions
 	boost::asio::ip::tcp::acceptor s_acceptor;				// Boost class that accepts clients					
 	shared_ptr<ServerController> control;								// The ServerController class associated with this connection
-	std::list<Connection> connections;						// List used to generate iterator for a connection
+	std::atomic<bool> started;								// Set once run is called
 		
 	unordered_map<int, shared_ptr<Client>> connected_clients;			// List of Connected clients
-	int ids = 0;											// Integer used to assign ID's (potential race condition)
-	
+	int ids = 0;											// Integer used to assign ID's
+	std::mutex clients_lock;								// Guards connected_clients and ids, used by every connection's handlers
 
-	using it_connection = std::list<Connection>::iterator;	// Iterator header used to represent a connection
+	using it_connection = connection_ptr;					// Pointer used to represent a connection, kept alive by its handlers and client
 
 public:
 	/// <summary>
@@ -39,12 +43,38 @@ public:
 	ServerConnection(ServerController* control);
 
 	/// <summary>
-	/// Starts the server. The io_service allows for asynchrony
+	/// Starts the server. The io_service allows for asynchrony, and is run by one thread per core.
+	/// Returns once the io_service stops
 	/// </summary>
 	void run();
 
 	/// <summary>
-	/// Handles when an error occurs in sending data to a client.
+	/// Whether threads are running the io_service, so work posted to it will get done
+	/// </summary>
+	bool running();
+
+	/// <summary>
+	/// Gets the io_service handlers run on, for creating strands
+	/// </summary>
+	boost::asio::io_service& service();
+
+	/// <summary>
+	/// Queues a message to be written to a connection after the ones already queued.
+	/// Safe to call from any thread
+	/// </summary>
+	/// <param name="state">The state of the connection</param>
+	/// <param name="msg_buffer">Message to write</param>
+	void send(it_connection state, std::shared_ptr<std::string> msg_buffer);
+
+	/// <summary>
+	/// Starts writing the message at the front of a connection's outbox. Runs on the connection's strand
+	/// </summary>
+	/// <param name="state">The state of the connection</param>
+	void write_next(it_connection state);
+
+	/// <summary>
+	/// Handles when a message has been sent to a client, or an error occurs in sending it.
+	/// Moves on to the next message in the connection's outbox
 	/// </summary>
 	/// <param name="state"></param>
 	/// <param name="msg_buffer"></param>
@@ -85,16 +115,23 @@ public:
 
 	/// <summary>
 	/// Sends out the given message to the given list of clients.
+	/// Safe to call from any thread
 	/// </summary>
 	/// <param name="clients"></param>
 	/// <param name="message"></param>
 	void broadcast(std::list<shared_ptr<Client>> &clients, std::string message);
 
 	/// <summary>
-	/// Deletes the specified client
+	/// Deletes the specified client. Safe to call from any thread
 	/// </summary>
 	/// <param name="terminate"></param>
 	void delete_client(int ID);
+
+	/// <summary>
+	/// Gets a connected client. Throws if there is no client with the ID
+	/// </summary>
+	/// <param name="ID">ID of the client</param>
+	shared_ptr<Client> find_client(int ID);
 };
 
 
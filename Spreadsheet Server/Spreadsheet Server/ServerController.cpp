@@ -2,6 +2,7 @@
 #include "Storage.h"
 #include <iostream>
 #include <algorithm>
+#include <future>
 
 //#include <boost/json.hpp>
 
@@ -9,7 +10,29 @@
 using namespace std;
 // See ServerController.h for method documentation
 
-ServerController::ServerController() : openSpreadsheets(), clientConnections(), storage(), threadkey(), network(make_shared<ServerConnection>(this)) {
+/// <summary>
+/// Most queued requests one drain of a spreadsheet's queue takes. A spreadsheet that
+/// keeps getting requests then shares its thread with other work between drains
+/// </summary>
+static const size_t RequestsPerDrain = 1024;
+
+/// <summary>
+/// Changes appended to a spreadsheet's edit log before it's compacted into a new snapshot
+/// </summary>
+static const size_t ChangesPerCompaction = 1024;
+
+size_t ServerController::idleMemoryBudget = 256 << 20;
+
+ServerController::ServerController() : openSpreadsheets(), idleSpreadsheets(), idleMemory(0), storage(), threadkey(), network(make_shared<ServerConnection>(this)) {
+}
+
+ServerController::OpenSpreadsheet::OpenSpreadsheet(boost::asio::io_service& service, const string name)
+	: name(name), state(), clients(), strand(service), queue(), drainPosted(false),
+	loggedVersions(0), loggedChanges(0), unlogged(), compactedOnLeave(false), closed(false), idle(false), idlePosition(), pendingJoins(0), memory(0) {
+}
+
+void ServerController::SetIdleMemoryBudget(const size_t bytes) {
+	idleMemoryBudget = bytes;
 }
 
 void ServerController::StartServer() {
@@ -18,224 +41,379 @@ void ServerController::StartServer() {
 	network->run();
 }
 
-void ServerController::ConnectClientToSpreadsheet(shared_ptr<Client> client, string spreadsheet) {
+bool ServerController::QueueRequest(const string& spreadsheet, const bool open, EditRequest request) {
 	Lock();
+	shared_ptr<OpenSpreadsheet> sheet;
+	auto found = openSpreadsheets.find(spreadsheet);
+	if (found != openSpreadsheets.end())
+		sheet = found->second;
+	else if (open) {
+		sheet = make_shared<OpenSpreadsheet>(network->service(), spreadsheet);
+		openSpreadsheets[spreadsheet] = sheet;
+	}
+	// Counted before the sheet can be evicted, see EvictSpreadsheet
+	if (sheet && request.GetType() == "join")
+		sheet->pendingJoins++;
+	Unlock();
+	if (!sheet)
+		return false;
+
+	// Only the first request since the last drain started needs to post one
+	sheet->queue.Push(request);
+	if (!sheet->drainPosted.exchange(true))
+		sheet->strand.post([this, sheet]() { ProcessQueue(sheet); });
+	return true;
+}
+
+void ServerController::ConnectClientToSpreadsheet(shared_ptr<Client> client, string spreadsheet) {
+	// Set before queueing, so requests the client sends next find the spreadsheet and queue up behind the join
+	client->spreadsheet = spreadsheet;
+	QueueRequest(spreadsheet, true, EditRequest("join", "", "", client));
+}
+
+void ServerController::ProcessQueue(shared_ptr<OpenSpreadsheet> sheet) {
+	// Cleared before popping, so a push this drain misses posts another
+	sheet->drainPosted = false;
+
+	vector<EditRequest> batch;
+	EditRequest request;
+	size_t popped = 0;
+	for (; popped < RequestsPerDrain && sheet->queue.TryPop(request); popped++) {
+		string type = request.GetType();
+		if (type == "join") {
+			Lock();
+			sheet->pendingJoins--;
+			Unlock();
+		}
+		if (sheet->closed) {
+			// Goes to whichever spreadsheet is open under the same name now
+			QueueRequest(sheet->name, type == "join", request);
+			continue;
+		}
+
+		// Joins and disconnects change who gets broadcasts, so requests before them are finished first
+		if (type == "join" || type == "disconnect") {
+			ProcessBatch(sheet, batch);
+			batch.clear();
+			if (type == "join")
+				JoinSpreadsheet(sheet, request.GetClient());
+			else
+				LeaveSpreadsheet(sheet, request.GetClient());
+		}
+		else
+			batch.push_back(request);
+	}
+	ProcessBatch(sheet, batch);
+
+	// Requests kept coming, let other work on this thread run before taking more
+	if (popped == RequestsPerDrain && !sheet->drainPosted.exchange(true))
+		sheet->strand.post([this, sheet]() { ProcessQueue(sheet); });
+}
+
+void ServerController::JoinSpreadsheet(shared_ptr<OpenSpreadsheet> sheet, shared_ptr<Client> client) {
+	// A client coming back to a spreadsheet kept loaded after everyone left takes it out of the idle ones
+	if (sheet->clients.empty()) {
+		Lock();
+		if (sheet->idle) {
+			idleSpreadsheets.erase(sheet->idlePosition);
+			idleMemory -= sheet->memory;
+			sheet->idle = false;
+		}
+		Unlock();
+	}
 
-	// See if any clients have this spreadsheet open, open if not
-	if (clientConnections.count(spreadsheet) < 1) {
-		StoredSpreadsheet newSS = storage.Open(spreadsheet);
-		shared_ptr<SpreadsheetState> toAdd = make_shared<SpreadsheetState>(newSS.cells, newSS.edits);
-		openSpreadsheets[spreadsheet] = toAdd;
-		list<shared_ptr<Client>> clientList;
-		clientConnections[spreadsheet] = clientList;
+	// The first client to join loads the spreadsheet, here so other spreadsheets aren't held up
+	if (!sheet->state) {
+		StoredSpreadsheet newSS = storage.Open(sheet->name);
+		sheet->state = make_shared<SpreadsheetState>(newSS);
+		sheet->loggedVersions = newSS.history.Size();
 	}
 
 	// Connect the client
-	clientConnections[spreadsheet].push_back(client);
-	client->spreadsheet = spreadsheet;
+	sheet->clients.push_back(client);
 
 	// Send spreadsheet cells to client
-	list<shared_ptr<Client>> sendTo = clientConnections[spreadsheet];
-	for (Cell cell : openSpreadsheets[spreadsheet]->GetPopulatedCells()) {
+	list<shared_ptr<Client>>& sendTo = sheet->clients;
+	StoredSpreadsheet snapshot = sheet->state->GetSnapshot();
+	snapshot.cells.ForEach([this, &sendTo](const Cell& cell) {
 		// Skip empty cells
 		if (cell.GetContents() == "")
-			continue;
+			return;
+		vector<pair<CellId, CellValue>> value;
+		value.push_back(pair<CellId, CellValue>(cell.GetId(), cell.GetValue()));
 		network->broadcast(sendTo, SerializeMessage(
 			"cellUpdated",
 			cell.GetName(),
 			cell.GetContents(),
 			NULL,
 			"",
-			""
+			"",
+			SerializeValues(value)
 		));
-	}
+	});
 
 	// Send ID to client
 	network->broadcast(sendTo, to_string(client->GetID()) + "\n");
-
-	Unlock();
 }
 
-
 void ServerController::ProcessClientRequest(EditRequest request) {
-	// First, process select request if applicable
-	if (request.GetType() == "selectCell") {
-		// Select cell
-		if (!SpreadsheetState::IsValid(request.GetName())) {
-			list<shared_ptr<Client>> toSend;
-			toSend.push_back(request.GetClient());
-			network->broadcast(toSend, SerializeMessage(
-				"requestError",
-				"",
-				"",
-				0,
-				"",
-				"Cannot select cell " + request.GetName()
-			));
-			return;
-		}
-		openSpreadsheets[request.GetClient()->spreadsheet]->
-			SelectCell(request.GetName(), request.GetClient()->GetID());
-
-		string message = SerializeMessage(
-			"cellSelected",
+	// Not connected to a spreadsheet, so there's nothing the request could act on
+	if (!QueueRequest(request.GetClient()->spreadsheet, false, request)) {
+		list<shared_ptr<Client>> toSend;
+		toSend.push_back(request.GetClient());
+		network->broadcast(toSend, SerializeMessage(
+			"requestError",
 			request.GetName(),
 			"",
-			request.GetClient()->GetID(),
-			request.GetClient()->GetUsername(),
-			""
-		);
-
-		// Broadcast select
-		network->broadcast(clientConnections[request.GetClient()->spreadsheet], message);
+			0,
+			"",
+			"Request rejected"
+		));
+	}
+}
 
+void ServerController::ProcessBatch(shared_ptr<OpenSpreadsheet> sheet, vector<EditRequest>& batch) {
+	if (batch.size() == 0)
 		return;
+	vector<SpreadsheetState::RequestResult> results = sheet->state->ApplyRequests(batch);
+
+	// A cell changed more than once is only sent once, where it was last changed
+	unordered_map<CellId, size_t> lastChange;
+	size_t lastUpdate = batch.size();
+	for (size_t i = 0; i < batch.size(); i++) {
+		for (const CellId& cell : results[i].changed)
+			lastChange[cell] = i;
+		if (!results[i].changed.empty())
+			lastUpdate = i;
 	}
 
-	if (request.GetType() == "undo") {
-		tuple<bool, string> undoRequestSuccess;
-		undoRequestSuccess = openSpreadsheets[request.GetClient()->spreadsheet]->
-			UndoLastEdit();
-
-		// If request successful, send out the new cell
-		if (get<0>(undoRequestSuccess)) {
-			// We save on every change, since this should be relatively fast
-			shared_ptr<SpreadsheetState> ss = openSpreadsheets[request.GetClient()->spreadsheet];
-			StoredSpreadsheet toStore(ss->GetPopulatedCells(), ss->GetEditHistory());
-			storage.Save(request.GetClient()->spreadsheet, toStore);
-			network->broadcast(clientConnections[request.GetClient()->spreadsheet],
-				SerializeMessage(
-					"cellUpdated",
-					get<1>(undoRequestSuccess),
-					openSpreadsheets[request.GetClient()->spreadsheet]->GetCell(get<1>(undoRequestSuccess)),
-					0,
-					"",
-					""
-				));
-			return;
+	// Everyone gets the selections and updates as one message, each sender gets its errors as another
+	string updates;
+	unordered_map<shared_ptr<Client>, string> errors;
+	for (size_t i = 0; i < batch.size(); i++) {
+		EditRequest& request = batch[i];
+		const SpreadsheetState::RequestResult& result = results[i];
+		if (result.succeeded && request.GetType() == "selectCell")
+			updates += SerializeMessage(
+				"cellSelected",
+				request.GetName(),
+				"",
+				request.GetClient()->GetID(),
+				request.GetClient()->GetUsername(),
+				""
+			);
+		else if (result.succeeded && !result.changed.empty()) {
+			vector<pair<CellId, string>> contents;
+			for (const CellId& cell : result.changed) {
+				if (lastChange[cell] != i)
+					continue;
+				contents.push_back(pair<CellId, string>(cell, ""));
+				try {
+					contents.back().second = sheet->state->GetCell(cell);
+				}
+				catch (exception e) {
+					/*the cell may be empty after an undo*/
+				}
+			}
+			if (contents.size() == 0)
+				continue;
+
+			// Values recomputed by the whole batch go with the last update
+			string values = i == lastUpdate ? SerializeValues(sheet->state->GetRecalculatedValues()) : "";
+			if (request.GetType() == "editCells" || result.changed.size() > 1)
+				updates += SerializeMessage("cellsUpdated", "", SerializeCells(contents), 0, "", "", values);
+			else
+				updates += SerializeMessage("cellUpdated", contents[0].first.ToString(), contents[0].second, 0, "", "", values);
 		}
-		else {
-			// Send error message to client for bad request
-			list<shared_ptr<Client>> toSend;
-			toSend.push_back(request.GetClient());
-			network->broadcast(toSend, SerializeMessage(
+		else if (!result.succeeded && result.error != "") {
+			bool named = request.GetType() != "selectCell" && request.GetType() != "undo";
+			errors[request.GetClient()] += SerializeMessage(
 				"requestError",
-				"",
+				named ? request.GetName() : "",
 				"",
 				0,
 				"",
-				get<1>(undoRequestSuccess)
-			));
-			return;
+				result.error
+			);
 		}
 	}
 
-	if (request.GetType() == "JSONerror") {
-		// Send error message to client for bad request
-		list<shared_ptr<Client>> toSend;
-		toSend.push_back(request.GetClient());
-		network->broadcast(toSend, SerializeMessage(
-			"requestError",
-			request.GetName(),
-			"",
-			0,
-			"",
-			"Request rejected"
-		));
-		return;
-	}
-
-	bool requestSuccess = false;
-	// Take action based on request type
-	if (request.GetType() == "editCell") {
-		//if the contents are the same, ignore this request
+	// One log record for the whole batch, holding only what it changed
+	if (lastUpdate != batch.size()) {
+		vector<CellId> moved;
+		for (const pair<const CellId, size_t>& changed : lastChange)
+			moved.push_back(changed.first);
+		// Cells of an earlier change whose record failed are logged again with this one
+		for (const CellId& cell : sheet->unlogged)
+			if (lastChange.count(cell) == 0)
+				moved.push_back(cell);
+		StoredSpreadsheet toStore = sheet->state->GetSnapshot();
 		try {
-			if (request.GetContent() == openSpreadsheets[request.GetClient()->spreadsheet]->GetCell(request.GetName()))
-				return;
+			storage.Append(sheet->name, toStore, sheet->loggedVersions, moved);
+			sheet->loggedVersions = toStore.history.Size();
+			sheet->unlogged.clear();
+			if (++sheet->loggedChanges >= ChangesPerCompaction)
+				CompactSpreadsheet(sheet);
 		}
-		catch (exception e) { 
-			/*this should occur when the cell doesn't exist yet in the spreadsheet*/ 
-			if (request.GetContent() == "")
-				return;
+		catch (exception e) {
+			// The changes stay applied, they just aren't on disk yet. Their versions go in the next record,
+			// and a compaction writes a whole snapshot past whatever the failed write left in the log
+			sheet->unlogged = moved;
+			CompactSpreadsheet(sheet);
+			for (size_t i = 0; i < batch.size(); i++) {
+				if (results[i].changed.empty())
+					continue;
+				errors[batch[i].GetClient()] += SerializeMessage(
+					"requestError",
+					batch[i].GetType() == "editCell" ? batch[i].GetName() : "",
+					"",
+					0,
+					"",
+					"Change could not be saved"
+				);
+			}
 		}
-		requestSuccess = openSpreadsheets[request.GetClient()->spreadsheet]->
-			EditCell(request.GetName(), request.GetContent(), request.GetClient()->GetID());
 	}
-	else if (request.GetType() == "revertCell") {
-		requestSuccess = openSpreadsheets[request.GetClient()->spreadsheet]->
-			RevertCell(request.GetName());
+
+	if (updates != "")
+		network->broadcast(sheet->clients, updates);
+	for (pair<const shared_ptr<Client>, string>& error : errors) {
+		list<shared_ptr<Client>> toSend;
+		toSend.push_back(error.first);
+		network->broadcast(toSend, error.second);
 	}
+}
 
-	// If request successful, send out the new cell
-	if (requestSuccess) {
-		// We save on every change, since this should be relatively fast
-		shared_ptr<SpreadsheetState> ss = openSpreadsheets[request.GetClient()->spreadsheet];
-		StoredSpreadsheet toStore(ss->GetPopulatedCells(), ss->GetEditHistory());
-		storage.Save(request.GetClient()->spreadsheet, toStore);
-		network->broadcast(clientConnections[request.GetClient()->spreadsheet],
-			SerializeMessage(
-				"cellUpdated",
-				request.GetName(),
-				openSpreadsheets[request.GetClient()->spreadsheet]->GetCell(request.GetName()),
-				0,
-				"",
-				""
-			));
+bool ServerController::CompactSpreadsheet(shared_ptr<OpenSpreadsheet> sheet) {
+	if (!storage.BeginCompaction(sheet->name))
+		return false;
+	sheet->loggedChanges = 0;
+
+	// The snapshot is taken here, between changes, and written while the spreadsheet carries on
+	StoredSpreadsheet toStore = sheet->state->GetSnapshot(true);
+	if (network->running()) {
+		const string name = sheet->name;
+		network->service().post([this, name, toStore]() { storage.FinishCompaction(name, toStore); });
+	}
+	else
+		storage.FinishCompaction(sheet->name, toStore);
+	return true;
+}
+
+void ServerController::DisconnectClient(shared_ptr<Client> client) {
+	QueueRequest(client->spreadsheet, false, EditRequest("disconnect", "", "", client));
+}
+
+void ServerController::LeaveSpreadsheet(shared_ptr<OpenSpreadsheet> sheet, shared_ptr<Client> client) {
+	auto found = find(sheet->clients.begin(), sheet->clients.end(), client);
+	if (found == sheet->clients.end())
+		return;
+	sheet->clients.erase(found);
+
+	// See if that was the last client connected to the spreadsheet
+	// If so, save it and keep it loaded in case someone comes back
+	if (sheet->clients.size() == 0) {
+		// Folds the log into the snapshot. Whatever this leaves unsaved is saved if it's evicted
+		sheet->compactedOnLeave = CompactSpreadsheet(sheet);
+		const size_t memory = sheet->state->GetMemoryUsage();
+
+		// The least recently left go first, which may be this one if it's over budget on its own
+		list<shared_ptr<OpenSpreadsheet>> evicted;
+		Lock();
+		sheet->idle = true;
+		sheet->memory = memory;
+		sheet->idlePosition = idleSpreadsheets.insert(idleSpreadsheets.begin(), sheet);
+		idleMemory += memory;
+		while (idleMemory > idleMemoryBudget && !idleSpreadsheets.empty()) {
+			shared_ptr<OpenSpreadsheet> oldest = idleSpreadsheets.back();
+			idleSpreadsheets.pop_back();
+			idleMemory -= oldest->memory;
+			oldest->idle = false;
+			evicted.push_back(oldest);
+		}
+		Unlock();
+
+		// Each is closed on its own strand, after the work already queued for it
+		for (shared_ptr<OpenSpreadsheet> evict : evicted)
+			evict->strand.post([this, evict]() { EvictSpreadsheet(evict); });
 		return;
 	}
-	else {
-		// Send error message to client for bad request
-		list<shared_ptr<Client>> toSend;
-		toSend.push_back(request.GetClient());
-		network->broadcast(toSend, SerializeMessage(
-			"requestError",
-			request.GetName(),
+
+	// Broadcast disconnect to other clients
+	network->broadcast(sheet->clients,
+		SerializeMessage(
+			"disconnected",
 			"",
-			0,
 			"",
-			"Request rejected"
+			client->GetID(),
+			"",
+			""
 		));
+}
+
+void ServerController::EvictSpreadsheet(shared_ptr<OpenSpreadsheet> sheet) {
+	// A client joined it since it was picked, or the server is stopping
+	if (sheet->closed || !sheet->clients.empty())
 		return;
+
+	// Changes whose records couldn't be written are only in memory, and if its last compaction didn't
+	// start nothing has saved them since. So it's saved whole before it's let go, and stays idle,
+	// first to go next time, if that fails
+	if (!sheet->unlogged.empty() || !sheet->compactedOnLeave || storage.LogFailed(sheet->name)) {
+		try {
+			storage.Checkpoint(sheet->name, sheet->state->GetSnapshot(true));
+			sheet->unlogged.clear();
+		}
+		catch (exception e) {
+			Lock();
+			if (!sheet->idle) {
+				sheet->idle = true;
+				sheet->idlePosition = idleSpreadsheets.insert(idleSpreadsheets.end(), sheet);
+				idleMemory += sheet->memory;
+			}
+			Unlock();
+			return;
+		}
 	}
-}
 
-void ServerController::DisconnectClient(shared_ptr<Client> client) {
-	// Gonna modify connections, so lock
+	// Delete from current state. A client may already have opened it again under the same name
 	Lock();
-	string ssname = client->spreadsheet;
-	clientConnections[ssname].erase(find(clientConnections[ssname].begin(), clientConnections[ssname].end(), client));
-
-	// See if that was the last client connected to the spreadsheet
-	// If so, close spreadsheet and save
-	if (clientConnections[ssname].size() == 0) {
-		// Save
-		shared_ptr<SpreadsheetState> ss = openSpreadsheets[client->spreadsheet];
-		StoredSpreadsheet toStore(ss->GetPopulatedCells(), ss->GetEditHistory());
-		storage.Save(ssname, toStore);
-		// Delete from current state
-		openSpreadsheets.erase(ssname);
-		clientConnections.erase(ssname);
+	if (sheet->idle) {
+		Unlock();
+		return;
+	}
+	// A client found it in openSpreadsheets and its join is on the way, so it stays, first to go next time
+	if (sheet->pendingJoins > 0) {
+		sheet->idle = true;
+		sheet->idlePosition = idleSpreadsheets.insert(idleSpreadsheets.end(), sheet);
+		idleMemory += sheet->memory;
+		Unlock();
+		return;
 	}
+	auto open = openSpreadsheets.find(sheet->name);
+	if (open != openSpreadsheets.end() && open->second == sheet)
+		openSpreadsheets.erase(open);
 	Unlock();
+	sheet->closed = true;
 
-	// Broadcast disconnect to other clients
-	if (clientConnections.count(ssname) > 0)
-		network->broadcast(clientConnections[client->spreadsheet],
-			SerializeMessage(
-				"disconnected",
-				"",
-				"",
-				client->GetID(),
-				"",
-				""
-			));
+	// Everything is in its log and snapshot now
+	sheet->state.reset();
 }
 
-string ServerController::SerializeMessage(string messageType, string cellName, string contents, int userID, string username, string message) const {
+string ServerController::SerializeMessage(string messageType, string cellName, string contents, int userID, string username, string message, string values) const {
 	string result = "";
 	// Generate message based on type
 	if (messageType == "cellUpdated") {
-		result += "{\"messageType\": \"cellUpdated\", \"cellName\": \"" + cellName + "\", \"contents\": \"" + contents + "\"}";
+		result += "{\"messageType\": \"cellUpdated\", \"cellName\": \"" + cellName + "\", \"contents\": \"" + contents + "\"";
+		if (values != "")
+			result += ", \"values\": " + values;
+		result += "}";
+	}
+	else if (messageType == "cellsUpdated") {
+		result += "{\"messageType\": \"cellsUpdated\", \"cells\": " + contents;
+		if (values != "")
+			result += ", \"values\": " + values;
+		result += "}";
 	}
 	else if (messageType == "cellSelected") {
 		result += "{\"messageType\": \"cellSelected\", \"cellName\": \"" + cellName + "\", \"selector\": \"" + to_string(userID) + "\", \"selectorName\": \"" + username + "\"}";
@@ -255,6 +433,33 @@ string ServerController::SerializeMessage(string messageType, string cellName, s
 	return result;
 }
 
+string ServerController::SerializeValues(const vector<pair<CellId, CellValue>>& values) const {
+	string result = "{";
+	for (const pair<CellId, CellValue>& value : values) {
+		CellValue::Kind kind = value.second.GetKind();
+		if (kind != CellValue::Kind::Number && kind != CellValue::Kind::Error)
+			continue;
+		if (result.size() > 1)
+			result += ", ";
+		result += "\"" + value.first.ToString() + "\": \"" + value.second.ToString() + "\"";
+	}
+	result += "}";
+
+	return result;
+}
+
+string ServerController::SerializeCells(const vector<pair<CellId, string>>& cells) const {
+	string result = "{";
+	for (const pair<CellId, string>& cell : cells) {
+		if (result.size() > 1)
+			result += ", ";
+		result += "\"" + cell.first.ToString() + "\": \"" + cell.second + "\"";
+	}
+	result += "}";
+
+	return result;
+}
+
 list<string> ServerController::GetSpreadsheetNames() {
 	list<string> names;
 
@@ -265,11 +470,13 @@ list<string> ServerController::GetSpreadsheetNames() {
 	}
 
 	// Add open spreadsheets
-	for (pair<string, shared_ptr<SpreadsheetState>> openSheet : openSpreadsheets) {
+	Lock();
+	for (pair<string, shared_ptr<OpenSpreadsheet>> openSheet : openSpreadsheets) {
 		// Check if names already contains the name
 		if (std::find(names.begin(), names.end(), openSheet.first) == names.end() && !openSheet.first.empty())
 			names.push_back(openSheet.first);
 	}
+	Unlock();
 
 	return names;
 }
@@ -283,29 +490,51 @@ void ServerController::Unlock() {
 }
 
 void ServerController::StopServer() {
-	// Save spreadsheet
-	for (pair<string, shared_ptr<SpreadsheetState>> ssPair : openSpreadsheets) {
-		shared_ptr<SpreadsheetState> ss = ssPair.second;
-		StoredSpreadsheet toStore(ss->GetPopulatedCells(), ss->GetEditHistory());
-		storage.Save(ssPair.first, toStore);
-	}
+	Lock();
+	list<shared_ptr<OpenSpreadsheet>> sheets;
+	for (pair<string, shared_ptr<OpenSpreadsheet>> open : openSpreadsheets)
+		sheets.push_back(open.second);
+	openSpreadsheets.clear();
+	for (shared_ptr<OpenSpreadsheet> sheet : idleSpreadsheets)
+		sheet->idle = false;
+	idleSpreadsheets.clear();
+	idleMemory = 0;
+	Unlock();
 
-	// Inform clients of disconnect
-	list<shared_ptr<Client>> toSend;
-	for (pair<string, list<shared_ptr<Client>>> Clients : clientConnections) {
-		// Send message
-		network->broadcast(Clients.second, SerializeMessage(
-			"serverError",
-			"",
-			"",
-			0,
-			"",
-			"Server closing"
-		));
+	for (shared_ptr<OpenSpreadsheet> sheet : sheets) {
+		// Close each spreadsheet on its strand, after the work already queued for it
+		auto close = [this, sheet]() {
+			if (sheet->closed)
+				return;
+			// Save spreadsheet, here rather than in the background since the server is stopping
+			if (sheet->state && storage.BeginCompaction(sheet->name))
+				storage.FinishCompaction(sheet->name, sheet->state->GetSnapshot(true));
 
-		// Delete list
-		Clients.second.clear();
-		clientConnections.erase(Clients.first);
+			// Inform clients of disconnect
+			network->broadcast(sheet->clients, SerializeMessage(
+				"serverError",
+				"",
+				"",
+				0,
+				"",
+				"Server closing"
+			));
+			sheet->clients.clear();
+			sheet->closed = true;
+		};
+
+		if (network->running()) {
+			promise<void> closed;
+			sheet->strand.post([&close, &closed]() {
+				close();
+				closed.set_value();
+			});
+			closed.get_future().wait();
+		}
+		else
+			close();
 	}
-}
 
+	// Changes of spreadsheets whose compaction couldn't start are only in their logs
+	storage.Flush();
+}
@@ -6,13 +6,24 @@
 #include "ServerConnection.h"
 #include "Storage.h"
 #include <mutex>
+#include <atomic>
+#include "MpscQueue.h"
 
 #ifndef SERVERCONTROLLER_H
 #define SERVERCONTROLLER_H
 
 
 /// <summary>
-/// Coordinates between networking/clients, spreadsheet models (SpreadsheetState), and storage
+/// Coordinates between networking/clients, spreadsheet models (SpreadsheetState), and storage.
+/// Each open spreadsheet acts on its own: everything done to it, from loading to processing
+/// requests to saving, runs on its strand in the order it arrived. Work for different
+/// spreadsheets runs on different threads at once.
+/// Network threads push requests onto a spreadsheet's queue without waiting, and its strand
+/// drains them in batches: each batch is applied under one write lock, recalculated once,
+/// saved once and broadcast as one message.
+/// A spreadsheet everyone has left stays loaded, so clients that come back join it right away.
+/// The least recently left of these are closed once together they'd take more memory than
+/// the idle memory budget
 /// </summary>
 class ServerController {
 
@@ -35,25 +46,27 @@ public:
 
 	/// <summary>
 	/// Marks a client as disconnected. 
-	/// Should be called before the Client object is deleted
+	/// Should be called before the Client object is deleted.
+	/// Returns right away, the client leaves once the requests queued before it are processed
 	/// </summary>
 	/// <param name="client">Client who disconnected</param>
 	void DisconnectClient(shared_ptr<Client>client);
 
 	/// <summary>
-	/// Processes an edit request from the client
+	/// Processes an edit request from the client.
+	/// Returns right away, the request is queued to be processed on its spreadsheet's strand
 	/// </summary>
 	/// <param name="request">EditRequest sent by client</param>
 	void ProcessClientRequest(EditRequest request);
 
 	/// <summary>
 	/// Connects a client to a spreadsheet, 
-	/// then sends all cells and selections in that spreadsheet to the client
-	/// Will use a thread lock
+	/// then sends all cells and selections in that spreadsheet to the client.
+	/// Returns right away, the spreadsheet is opened and joined on its strand once the requests
+	/// queued before the join are processed
 	/// </summary>
 	/// <param name="client">Client to connect</param>
 	/// <param name="spreadsheet">Spreadsheet name</param>
-	/// <returns>All cells in this spreadsheet, to be sent to the client</returns>
 	void ConnectClientToSpreadsheet(shared_ptr<Client>client, string spreadsheet);
 
 	/// <summary>
@@ -62,8 +75,163 @@ public:
 	/// <returns></returns>
 	std::list<std::string> GetSpreadsheetNames();
 
+	/// <summary>
+	/// Sets how much memory spreadsheets nobody is connected to may take before the least
+	/// recently left are closed. 0 closes each spreadsheet as soon as its last client leaves.
+	/// Meant to be called once, before the server starts
+	/// </summary>
+	/// <param name="bytes">Memory budget in bytes</param>
+	static void SetIdleMemoryBudget(const size_t bytes);
+
 private:
 
+	/// <summary>
+	/// A spreadsheet open on the server. Only touched on its strand, apart from being
+	/// looked up by name in openSpreadsheets
+	/// </summary>
+	struct OpenSpreadsheet {
+		/// <summary>
+		/// Creates an open spreadsheet that hasn't been loaded yet
+		/// </summary>
+		OpenSpreadsheet(boost::asio::io_service& service, const string name);
+
+		/// <summary>
+		/// Name of the spreadsheet
+		/// </summary>
+		string name;
+
+		/// <summary>
+		/// State of the spreadsheet, null until it's loaded by the first client to join
+		/// </summary>
+		shared_ptr<SpreadsheetState> state;
+
+		/// <summary>
+		/// Clients connected to the spreadsheet
+		/// </summary>
+		list<shared_ptr<Client>> clients;
+
+		/// <summary>
+		/// Runs the spreadsheet's work one piece at a time, in the order it was posted
+		/// </summary>
+		boost::asio::io_service::strand strand;
+
+		/// <summary>
+		/// Requests waiting to be processed, pushed from any thread and drained on the strand.
+		/// Like JSONerror, join and disconnect are request types of the controller's own, so
+		/// clients come and go in order with the requests around them
+		/// </summary>
+		MpscQueue<EditRequest> queue;
+
+		/// <summary>
+		/// Set while a drain of queue is posted to the strand and hasn't started yet
+		/// </summary>
+		atomic<bool> drainPosted;
+
+		/// <summary>
+		/// Size of the history when the last change was appended to the edit log, so the next
+		/// record starts from the first version after it
+		/// </summary>
+		uint32_t loggedVersions;
+
+		/// <summary>
+		/// Changes appended to the edit log since it was last compacted
+		/// </summary>
+		size_t loggedChanges;
+
+		/// <summary>
+		/// Cells moved by changes whose log record couldn't be written, logged again with the next change
+		/// </summary>
+		vector<CellId> unlogged;
+
+		/// <summary>
+		/// Set if the compaction started when its last client left, so the snapshot it writes has
+		/// every change logged until then
+		/// </summary>
+		bool compactedOnLeave;
+
+		/// <summary>
+		/// Set once the spreadsheet is taken out of openSpreadsheets and unloaded, after its last client
+		/// left and it was evicted from idleSpreadsheets. Work still queued for it goes to the spreadsheet
+		/// opened under the same name, if any
+		/// </summary>
+		bool closed;
+
+		/// <summary>
+		/// Set while the spreadsheet is in idleSpreadsheets, at idlePosition. Guarded by threadkey
+		/// </summary>
+		bool idle;
+		list<shared_ptr<OpenSpreadsheet>>::iterator idlePosition;
+
+		/// <summary>
+		/// Joins queued for the spreadsheet and not taken off its queue yet. It isn't evicted while
+		/// there are any, so the clients joining find it, and not a fresh one, until they're in.
+		/// Guarded by threadkey
+		/// </summary>
+		size_t pendingJoins;
+
+		/// <summary>
+		/// Estimated memory the spreadsheet took when it went idle, which doesn't change
+		/// until a client joins it again. Guarded by threadkey
+		/// </summary>
+		size_t memory;
+	};
+
+	/// <summary>
+	/// Queues a request for an open spreadsheet, and posts a drain of its queue to its strand
+	/// if one isn't already waiting. Requests still queued when the spreadsheet closes are queued
+	/// again for whichever spreadsheet is open under the name
+	/// </summary>
+	/// <param name="spreadsheet">Spreadsheet name</param>
+	/// <param name="open">Whether to open the spreadsheet if it isn't open</param>
+	/// <param name="request">Request to queue</param>
+	/// <returns>False if the spreadsheet isn't open and open is false, so nothing was queued</returns>
+	bool QueueRequest(const string& spreadsheet, const bool open, EditRequest request);
+
+	/// <summary>
+	/// Drains a spreadsheet's queue, processing its requests in batches between joins and
+	/// disconnects. Runs on the spreadsheet's strand
+	/// </summary>
+	void ProcessQueue(shared_ptr<OpenSpreadsheet> sheet);
+
+	/// <summary>
+	/// Starts compacting a spreadsheet's edit log into a new snapshot, which is written in the
+	/// background if the network is running. Does nothing if a compaction is still running.
+	/// Runs on the spreadsheet's strand
+	/// </summary>
+	/// <returns>False if the compaction didn't start</returns>
+	bool CompactSpreadsheet(shared_ptr<OpenSpreadsheet> sheet);
+
+	/// <summary>
+	/// Applies a batch of requests to a spreadsheet, logs the changes if there were any, broadcasts
+	/// the selections and changed cells, and sends each sender the errors for its requests.
+	/// A block of cells edited by editCells, or put back by undoing one, is sent as one cellsUpdated.
+	/// If the changes can't be logged, they're still sent, and their senders are told they weren't saved.
+	/// Runs on the spreadsheet's strand
+	/// </summary>
+	void ProcessBatch(shared_ptr<OpenSpreadsheet> sheet, vector<EditRequest>& batch);
+
+	/// <summary>
+	/// Loads a spreadsheet if needed, connects a client to it, and sends the client its cells.
+	/// Runs on the spreadsheet's strand
+	/// </summary>
+	void JoinSpreadsheet(shared_ptr<OpenSpreadsheet> sheet, shared_ptr<Client> client);
+
+	/// <summary>
+	/// Disconnects a client from a spreadsheet. If it was the last one connected, compacts the
+	/// spreadsheet and keeps it loaded as the most recently used idle spreadsheet, evicting the
+	/// least recently used ones if the idle spreadsheets are over budget.
+	/// Runs on the spreadsheet's strand
+	/// </summary>
+	void LeaveSpreadsheet(shared_ptr<OpenSpreadsheet> sheet, shared_ptr<Client> client);
+
+	/// <summary>
+	/// Closes a spreadsheet evicted from idleSpreadsheets and lets go of its state, saving it first
+	/// if some of its changes aren't in its log or snapshot. Does nothing if a client joined it since,
+	/// or it went idle again. Puts it back in idleSpreadsheets if a client is about to join it, or
+	/// it couldn't be saved. Runs on the spreadsheet's strand
+	/// </summary>
+	void EvictSpreadsheet(shared_ptr<OpenSpreadsheet> sheet);
+
 	/// <summary>
 	/// Serializes a message into JSON for sending via the Jakkpot protocol
 	/// Also adds \n to the end of the message
@@ -72,23 +240,51 @@ private:
 	/// </summary>
 	/// <param name="messageType">Jakkpot messageType</param>
 	/// <param name="cellName">Jakkpot cellName</param>
-	/// <param name="contents">Jakkpot contents</param>
+	/// <param name="contents">Jakkpot contents, or for cellsUpdated the JSON object of cells from SerializeCells</param>
 	/// <param name="userID">Stand-in for Jakkpot selector and Jakkpot user, since both just take the user ID</param>
 	/// <param name="username">Jakkpot selectorName</param>
 	/// <param name="message">Jakkpot message</param>
+	/// <param name="values">JSON object of computed cell values from SerializeValues, only used by cellUpdated and cellsUpdated</param>
 	/// <returns>Valid JSON string, terminated by \n character & ready to send to clients</returns>
-	string SerializeMessage(string messageType, string cellName, string contents, int userID, string username, string message) const;
+	string SerializeMessage(string messageType, string cellName, string contents, int userID, string username, string message, string values = "") const;
+
+	/// <summary>
+	/// Serializes computed cell values into a JSON object mapping cell names to values.
+	/// Only numbers and errors are included, since the value of a text cell is its contents
+	/// </summary>
+	/// <param name="values">Cells and their computed values</param>
+	/// <returns>JSON object, e.g. {"A1": "3", "B2": "#ERROR"}</returns>
+	string SerializeValues(const vector<pair<CellId, CellValue>>& values) const;
+
+	/// <summary>
+	/// Serializes cell contents into a JSON object mapping cell names to contents, for cellsUpdated
+	/// </summary>
+	/// <param name="cells">Cells and their contents</param>
+	/// <returns>JSON object, e.g. {"A1": "3", "B2": "=A1*2"}</returns>
+	string SerializeCells(const vector<pair<CellId, string>>& cells) const;
 	
 	/// <summary>
 	/// All spreadsheets which are currently open & being edited by users
-	/// Key is the name of the spreadsheet, value is the state of the spreadsheet
+	/// Key is the name of the spreadsheet, value is the spreadsheet and the clients connected to it.
+	/// Guarded by threadkey
+	/// </summary>
+	unordered_map<string, shared_ptr<OpenSpreadsheet>> openSpreadsheets;
+
+	/// <summary>
+	/// Open spreadsheets no client is connected to, most recently left first. Each is still
+	/// in openSpreadsheets, and is evicted from the back. Guarded by threadkey
+	/// </summary>
+	list<shared_ptr<OpenSpreadsheet>> idleSpreadsheets;
+
+	/// <summary>
+	/// Total estimated memory of idleSpreadsheets. Guarded by threadkey
 	/// </summary>
-	unordered_map<string, shared_ptr<SpreadsheetState>> openSpreadsheets;
+	size_t idleMemory;
 
 	/// <summary>
-	/// Maps each spreadsheet name to the list of clients connected to it
+	/// Most memory idleSpreadsheets may take, see SetIdleMemoryBudget
 	/// </summary>
-	unordered_map<string, list<shared_ptr<Client>>> clientConnections;
+	static size_t idleMemoryBudget;
 
 	/// <summary>
 	/// Handles connections with clients
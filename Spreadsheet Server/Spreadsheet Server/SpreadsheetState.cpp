@@ -6,23 +6,59 @@
 /// <summary>
 /// Default constructor. Initializes all fields to empty values
 /// </summary>
-SpreadsheetState::SpreadsheetState() : cells(), edits(), dependencies(), selections(), threadkey()
+SpreadsheetState::SpreadsheetState() : cells(), history(), dependencies(), selections(), threadkey()
 {
 	threadkey = make_shared<shared_mutex>();
 }
 
-SpreadsheetState::SpreadsheetState(set<Cell>& cells, list<CellEdit>& edits) : cells(), edits(edits), dependencies(), threadkey(), selections() {
+SpreadsheetState::SpreadsheetState(const CellStore& cells, const VersionLog& history) : SpreadsheetState(StoredSpreadsheet(cells, history)) {
+}
+
+SpreadsheetState::SpreadsheetState(const StoredSpreadsheet& stored) : cells(stored.cells), history(stored.history), dependencies(), threadkey(), selections() {
 	threadkey = make_shared<shared_mutex>();
-	// Edits are set by the initializer list, now we just need to map dependencies & cells
+	// Cells & history are set by the initializer list, now we just need to map dependencies
 	WriteLock();
-	for (Cell cell : cells) {
+	if (stored.derived) {
+		// Formulas were compiled and shared when saved, so each only needs adding to the table
+		unordered_set<const Formula*> shared;
+		this->cells.ForEach([this, &shared](const Cell& cell) {
+			const shared_ptr<const Formula>& formula = cell.GetFormula();
+			if (formula && shared.insert(formula.get()).second)
+				formulas.Share(formula);
+		});
+		// With the saved order in place, none of the edges below needs reordering
+		if (stored.positions)
+			dependencies.LoadPositions(*stored.positions);
+	}
+	else {
+		vector<CellId> formulaCells;
+		this->cells.ForEach([&formulaCells](const Cell& cell) {
+			if (cell.GetFormula() || cell.GetContents().compare(0, 1, "=") == 0)
+				formulaCells.push_back(cell.GetId());
+		});
+		// Cells loaded from a file are left uncompiled (see Cell::Uncompiled), and cells compiled on
+		// their own are shared by template instead, so every formula is compiled here, once
+		for (const CellId& id : formulaCells) {
+			Cell* cell = this->cells.Modify(id);
+			cell->ShareFormula(formulas.Intern(cell->GetContents(), id));
+		}
+	}
+	this->cells.ForEach([this](const Cell& cell) {
 		// Set dependencies
-		for (string var : cell.GetVariables()) {
-			dependencies.AddDependency(var, cell.GetName());
+		for (CellId var : cell.GetVariables()) {
+			dependencies.AddDependency(var, cell.GetId());
 		}
-		// Add to cell list
-		AddOrUpdateCell(cell.GetName(), cell.GetContents(), false);
+		for (const CellRange& range : cell.GetRanges()) {
+			dependencies.AddRangeDependency(range, cell.GetId());
+		}
+	});
+	if (stored.derived) {
+		this->cells.ForEach([this](const Cell& cell) {
+			aggregates.Update(cell.GetId(), cell.GetValue());
+		});
 	}
+	else
+		RecalculateAll();
 	WriteUnlock();
 }
 
@@ -30,52 +66,45 @@ SpreadsheetState::SpreadsheetState(set<Cell>& cells, list<CellEdit>& edits) : ce
 /// Deletes all ptrs in this class
 /// </summary>
 SpreadsheetState::~SpreadsheetState() {
-	cells.clear();
-	while (!edits.empty())
-		edits.pop_front();
+	cells.Clear();
+	history = VersionLog();
 	selections.clear();
 
 	// Destructors are called automatically
 }
 
-void SpreadsheetState::SelectCell(const string cell, const int ClientID) {
+void SpreadsheetState::SelectCell(const CellId cell, const int ClientID) {
 	WriteLock();
 	selections[ClientID] = cell;
 	WriteUnlock();
 }
 
-bool SpreadsheetState::ClientSelectedCell(const string cell, const int ClientID) {
+bool SpreadsheetState::ClientSelectedCell(const CellId cell, const int ClientID) {
 	ReadLock();
 	bool result = selections.count(ClientID) == 1 && selections[ClientID] == cell;
 	ReadUnlock();
 	return result;
 }
 
-bool SpreadsheetState::EditCell(const string name, const string content, const int ClientID) {
+bool SpreadsheetState::EditCell(const CellId name, const string content, const int ClientID) {
 	// Make sure the client has this cell selected
 	if (!ClientSelectedCell(name, ClientID)) {
 		return false;
 	}
 
-	// Check whether the new content is valid
-	try {
-		if (!ValidCellContents(content))
-			return false;
-
-		// Check for circular dependencies
-		if (CheckNewCellCircular(name, content, true))
-			return false;
-
-		WriteLock();
-		// Save old contents of cell
-		string oldContents = CellExists(name) ? cells[name].GetContents() : "";
+	// Check whether the new content is valid. This is the only time the content is parsed
+	shared_ptr<const Formula> compiled;
+	if (!ValidCellContents(name, content, compiled).Succeeded())
+		return false;
 
-		// No circular dependencies found, add cell
-		edits.push_front(CellEdit(name, oldContents)); // Add cellEdit
-		AddOrUpdateCell(name, content, false); // Modify cell
-		dependencies.ReplaceDependents(name, cells[name].GetVariables()); // Modify dependencies
+	WriteLock();
+	try {
+		unordered_set<CellId> changed;
+		bool result = ApplyEdit(name, content, compiled, changed);
+		if (result)
+			Recalculate(changed);
 		WriteUnlock();
-		return true;
+		return result;
 	}
 	catch (exception) {
 		WriteUnlock();
@@ -84,147 +113,530 @@ bool SpreadsheetState::EditCell(const string name, const string content, const i
 
 }
 
-const bool SpreadsheetState::CheckNewCellCircular(const string name, const string& f, const bool readLock) {
-	unordered_set<string> visited = unordered_set<string>();
-	visited.insert(name);
-	if (readLock)
-		ReadLock(); // Read lock
-	if (CheckCircularDependencies(visited, Cell(name, f).GetVariables())) {
-		if (readLock)
-			ReadUnlock(); // Read unlock
-		return true;
-	}
+bool SpreadsheetState::ApplyEdit(const CellId name, const string& content, const shared_ptr<const Formula> compiled, unordered_set<CellId>& changed) {
+	// Check for circular dependencies inside the write lock,
+	// so no other edit can sneak in between the check and this edit
+	if (CheckNewCellCircular(name, compiled ? compiled->GetVariables(name) : vector<CellId>(),
+		compiled ? compiled->GetRanges(name) : vector<CellRange>(), false))
+		return false;
 
-	// No circular depen found
+	// No circular dependencies found, add cell
+	AddOrUpdateCell(name, content, false, compiled); // Modify cell and record the edit
+	const Cell& edited = *cells.Find(name);
+	dependencies.ReplaceDependees(name, edited.GetVariables(), edited.GetRanges()); // Modify dependencies
+	changed.insert(name);
+	return true;
+}
+
+const bool SpreadsheetState::CheckNewCellCircular(const CellId name, const vector<CellId>& variables, const vector<CellRange>& ranges, const bool readLock) {
+	if (readLock)
+		ReadLock();
+	bool result = dependencies.WouldCreateCycle(name, variables, ranges);
 	if (readLock)
 		ReadUnlock();
-	return false;
-}
-
-const bool SpreadsheetState::CheckCircularDependencies(unordered_set<string>& visited, const vector<string> toVisit) {
-	for (string cell : toVisit) {
-		// See if we've already visited this cell
-		if (visited.count(cell) == 1)
-			return true;
-		// Visit this cell
-		visited.emplace(cell);
-		if (CellExists(cell) && CheckCircularDependencies(visited, cells[cell].GetVariables()))
-			return true;
-	}
-
-	return false;
+	return result;
 }
 
-bool SpreadsheetState::RevertCell(const string cell) {
+bool SpreadsheetState::RevertCell(const CellId cell) {
 	WriteLock();
+	unordered_set<CellId> changed;
+	bool result = ApplyRevert(cell, changed);
+	if (result)
+		Recalculate(changed);
+	WriteUnlock();
+	return result;
+}
+
+bool SpreadsheetState::ApplyRevert(const CellId cell, unordered_set<CellId>& changed) {
 	// Make sure cell exists & can be reverted
-	if (!CellExists(cell) || !cells[cell].CanRevert()) {
-		WriteUnlock();
+	const Cell* current = cells.Find(cell);
+	if (current == nullptr)
 		return false;
-	}
 
 	// Get cell's old state
-	string oldState = cells[cell].GetPreviousState();
+	const uint32_t version = current->GetVersion();
+	if (version == VersionLog::NoVersion)
+		return false;
+	string oldState = history.GetContents(history.Get(version).previous);
 
 	// Check for circular dependencies
-	if (CheckNewCellCircular(cell, oldState, false)) {
-		WriteUnlock();
+	shared_ptr<const Formula> compiled = formulas.Intern(oldState, cell);
+	if (CheckNewCellCircular(cell, compiled ? compiled->GetVariables(cell) : vector<CellId>(),
+		compiled ? compiled->GetRanges(cell) : vector<CellRange>(), false))
 		return false;
-	}
 
 	// No circular dependencies found, go through with revert
-	//possible error with the new
-	edits.push_front(CellEdit(cell, cells[cell].GetContents())); // Add cellEdit
-	bool result = cells[cell].Revert(); // Revert cell
-	dependencies.ReplaceDependents(cell, cells[cell].GetVariables()); // Modify dependencies
-	WriteUnlock();
+	Cell* reverting = cells.Modify(cell);
+	reverting->SetContents(oldState, history.RecordRevert(cell, version), compiled); // Revert cell and record the revert
+	dependencies.ReplaceDependees(cell, reverting->GetVariables(), reverting->GetRanges()); // Modify dependencies
+	changed.insert(cell);
 	return true;
 }
 
-tuple<bool, string> SpreadsheetState::UndoLastEdit() {
+tuple<bool, CellId, string> SpreadsheetState::UndoLastEdit() {
 	// Writelock the method so that the edit stack doesn't change
 	WriteLock();
-	if (edits.size() == 0) {
-		WriteUnlock();
-		return tuple<bool,string>(false,"No more edits to undo");
+	unordered_set<CellId> changed;
+	vector<CellId> undone;
+	tuple<bool, CellId, string> result = ApplyUndo(changed, undone);
+	if (get<0>(result))
+		Recalculate(changed);
+	WriteUnlock();
+	return result;
+}
+
+tuple<bool, CellId, string> SpreadsheetState::ApplyUndo(unordered_set<CellId>& changed, vector<CellId>& undone) {
+	const uint32_t change = history.GetLastChange();
+	if (change == VersionLog::NoVersion)
+		return tuple<bool, CellId, string>(false, CellId(), "No more edits to undo");
+
+	// A group marker puts back every cell edited in its group at once
+	if (history.IsGroup(change)) {
+		vector<CellId> targets;
+		vector<uint32_t> restored;
+		vector<string> contents;
+		vector<shared_ptr<const Formula>> compiled;
+		for (uint32_t member = history.Get(change).previous; member < change; member++) {
+			const VersionLog::Version version = history.Get(member);
+			targets.push_back(version.cell);
+			restored.push_back(version.replaced);
+			contents.push_back(history.GetContents(version.replaced));
+			compiled.push_back(formulas.Intern(contents.back(), version.cell));
+		}
+		if (!ReplaceDependencies(targets, compiled))
+			return tuple<bool, CellId, string>(false, targets[0], "Invalid cell change");
+
+		for (size_t i = 0; i < targets.size(); i++) {
+			cells.Insert(targets[i]).SetContents(contents[i], restored[i], compiled[i]);
+			changed.insert(targets[i]);
+			undone.push_back(targets[i]);
+		}
+		history.Undo();
+		return tuple<bool, CellId, string>(true, targets[0], "");
 	}
 
 	// Validate undo
-	string name = edits.front().GetName();
-	string f = edits.front().GetPriorContents();
-	if (CheckNewCellCircular(name, f, false)) {
+	CellId name = history.Get(change).cell;
+	const uint32_t restored = history.Get(change).replaced;
+	string f = history.GetContents(restored);
+	shared_ptr<const Formula> compiled = formulas.Intern(f, name);
+	if (CheckNewCellCircular(name, compiled ? compiled->GetVariables(name) : vector<CellId>(),
+		compiled ? compiled->GetRanges(name) : vector<CellRange>(), false))
+		return tuple<bool, CellId, string>(false, name, "Invalid cell change");
+
+	// Undo validated, implement it
+	Cell& cell = cells.Insert(name);
+	cell.SetContents(f, restored, compiled);
+	dependencies.ReplaceDependees(name, cell.GetVariables(), cell.GetRanges());
+	history.Undo();
+	changed.insert(name);
+	undone.push_back(name);
+	return tuple<bool, CellId, string>(true, name, "");
+}
+
+bool SpreadsheetState::EditCells(const vector<pair<CellId, string>>& edits, const int ClientID) {
+	WriteLock();
+	try {
+		unordered_set<CellId> changed;
+		vector<CellId> edited;
+		bool result = ApplyEditCells(edits, ClientID, changed, edited);
+		if (result && !changed.empty())
+			Recalculate(changed);
+		WriteUnlock();
+		return result;
+	}
+	catch (exception) {
 		WriteUnlock();
-		return tuple<bool, string>(false, "Invalid cell change");
+		return false;
 	}
+}
 
-	// Undo validated, implement it
-	cells[name].Revert();
-	dependencies.ReplaceDependents(name, cells[name].GetVariables());
-	edits.pop_front();
+bool SpreadsheetState::ApplyEditCells(const vector<pair<CellId, string>>& edits, const int ClientID, unordered_set<CellId>& changed, vector<CellId>& edited) {
+	// Every cell must be valid and appear once, and the client must have one of them selected
+	unordered_set<CellId> seen;
+	bool selected = false;
+	for (const pair<CellId, string>& edit : edits) {
+		if (!edit.first.IsValid() || !seen.insert(edit.first).second)
+			return false;
+		selected = selected || (selections.count(ClientID) == 1 && selections[ClientID] == edit.first);
+	}
+	if (!selected)
+		return false;
+
+	// Parse everything before changing anything. Cells already holding their new contents are left alone
+	vector<CellId> targets;
+	vector<shared_ptr<const Formula>> compiled;
+	vector<const string*> contents;
+	for (const pair<CellId, string>& edit : edits) {
+		shared_ptr<const Formula> formula;
+		if (!ValidCellContents(edit.first, edit.second, formula).Succeeded())
+			return false;
+		const Cell* current = cells.Find(edit.first);
+		if (current != nullptr ? current->GetContents() == edit.second : edit.second == "")
+			continue;
+		targets.push_back(edit.first);
+		compiled.push_back(formula);
+		contents.push_back(&edit.second);
+	}
+	if (targets.empty())
+		return true;
+
+	if (!ReplaceDependencies(targets, compiled))
+		return false;
+
+	// One change in the version log, so one undo puts the whole block back
+	const uint32_t first = history.Size();
+	for (size_t i = 0; i < targets.size(); i++) {
+		AddOrUpdateCell(targets[i], *contents[i], false, compiled[i]);
+		changed.insert(targets[i]);
+	}
+	edited = targets;
+	if (targets.size() > 1)
+		history.RecordGroup(first);
+	return true;
+}
+
+bool SpreadsheetState::ReplaceDependencies(const vector<CellId>& targets, const vector<shared_ptr<const Formula>>& compiled) {
+	vector<vector<CellId>> oldVariables;
+	vector<vector<CellRange>> oldRanges;
+	for (const CellId& target : targets) {
+		oldVariables.push_back(dependencies.GetDependees(target));
+		oldRanges.push_back(dependencies.GetRangeDependees(target));
+	}
+
+	// With every old dependency gone first, a cycle found while adding the new ones
+	// is one the cells would form once all of them have their new contents
+	for (const CellId& target : targets)
+		dependencies.ReplaceDependees(target, vector<CellId>(), vector<CellRange>());
+	for (size_t i = 0; i < targets.size(); i++) {
+		vector<CellId> variables = compiled[i] ? compiled[i]->GetVariables(targets[i]) : vector<CellId>();
+		vector<CellRange> ranges = compiled[i] ? compiled[i]->GetRanges(targets[i]) : vector<CellRange>();
+		if (CheckNewCellCircular(targets[i], variables, ranges, false)) {
+			for (size_t j = 0; j < targets.size(); j++)
+				dependencies.ReplaceDependees(targets[j], oldVariables[j], oldRanges[j]);
+			return false;
+		}
+		dependencies.ReplaceDependees(targets[i], variables, ranges);
+	}
+	return true;
+}
+
+vector<SpreadsheetState::RequestResult> SpreadsheetState::ApplyRequests(vector<EditRequest>& requests) {
+	vector<RequestResult> results;
+	results.reserve(requests.size());
+	unordered_set<CellId> changed;
+
+	WriteLock();
+	for (EditRequest& request : requests) {
+		const string type = request.GetType();
+		const CellId cell = request.GetCell();
+		RequestResult result = { false, cell, vector<CellId>(), "Request rejected" };
+		try {
+			if (type == "selectCell") {
+				if (cell.IsValid()) {
+					selections[request.GetClient()->GetID()] = cell;
+					result.succeeded = true;
+				}
+				else
+					result.error = "Cannot select cell " + request.GetName();
+			}
+			else if (type == "editCell" && cell.IsValid()) {
+				shared_ptr<const Formula> compiled;
+				if (selections.count(request.GetClient()->GetID()) == 1 && selections[request.GetClient()->GetID()] == cell
+					&& ValidCellContents(cell, request.GetContent(), compiled).Succeeded()
+					&& ApplyEdit(cell, request.GetContent(), compiled, changed)) {
+					result.succeeded = true;
+					result.changed.push_back(cell);
+				}
+			}
+			else if (type == "editCells") {
+				// Cells already holding their new contents aren't changed, so they aren't sent or logged
+				if (ApplyEditCells(request.GetEdits(), request.GetClient()->GetID(), changed, result.changed))
+					result.succeeded = true;
+			}
+			else if (type == "revertCell" && cell.IsValid() && ApplyRevert(cell, changed)) {
+				result.succeeded = true;
+				result.changed.push_back(cell);
+			}
+			else if (type == "undo") {
+				tuple<bool, CellId, string> undone = ApplyUndo(changed, result.changed);
+				result.succeeded = get<0>(undone);
+				result.cell = get<1>(undone);
+				result.error = get<2>(undone);
+			}
+		}
+		catch (exception) {
+			result.succeeded = false;
+		}
+		if (result.succeeded)
+			result.error = "";
+		results.push_back(result);
+	}
+
+	// Every cell changed by the batch and everything depending on them, each recomputed once
+	if (!changed.empty())
+		Recalculate(changed);
 	WriteUnlock();
+	return results;
+}
 
-	return tuple<bool, string>(true, name);
+const CellValue SpreadsheetState::ComputeValue(const Cell& cell) const {
+	const shared_ptr<const Formula>& formula = cell.GetFormula();
+	if (!formula) {
+		// Contents loaded from a file might not be a valid formula
+		const string contents = cell.GetContents();
+		if (contents.size() == 0 || contents[0] != '=')
+			return CellValue::FromContents(contents);
+		return CellValue(CellValue::Kind::Error);
+	}
+
+	try {
+		vector<double> variableValues;
+		const size_t variableCount = formula->VariableCount();
+		for (size_t i = 0; i < variableCount; i++) {
+			// Empty cells count as 0, text or errors make the whole formula an error
+			const Cell* referenced = cells.Find(formula->GetVariable(i, cell.GetId()));
+			if (referenced == nullptr) {
+				variableValues.push_back(0);
+				continue;
+			}
+			CellValue value = referenced->GetValue();
+			if (value.GetKind() == CellValue::Kind::Text || value.GetKind() == CellValue::Kind::Error)
+				return CellValue(CellValue::Kind::Error);
+			variableValues.push_back(value.GetNumber());
+		}
+		return CellValue(formula->Evaluate(variableValues, cell.GetId(), &aggregates));
+	}
+	catch (exception) {
+		// Division by zero, or an error inside an aggregated range
+		return CellValue(CellValue::Kind::Error);
+	}
 }
 
-void SpreadsheetState::AddOrUpdateCell(const string cellName, const string& content, const bool lock) {
-	if (lock)
-		WriteLock();
-	if (CellExists(cellName)) {
-		cells[cellName].SetContents(content);
+size_t SpreadsheetState::parallelThreshold = 64;
+
+void SpreadsheetState::SetParallelThreshold(const size_t cells) {
+	parallelThreshold = cells;
+}
+
+size_t SpreadsheetState::batchThreshold = 8;
+
+void SpreadsheetState::SetBatchThreshold(const size_t cells) {
+	batchThreshold = cells;
+}
+
+/// <summary>
+/// Most cells handed to a single ComputeBatch call, so big groups still spread across the pool
+/// </summary>
+static const size_t MaxBatch = 128;
+
+void SpreadsheetState::GroupByShape(const vector<Cell*>& level, vector<vector<Cell*>>& batches, vector<Cell*>& singles) const {
+	if (level.size() < batchThreshold) {
+		singles = level;
+		return;
 	}
-	else {
-		if (!CellExists(cellName))
-			cells.emplace(cellName, Cell(cellName, ""));
-		cells[cellName].SetContents(content);
+
+	// Formulas are interned by template, so cells of the same shape share one Formula
+	unordered_map<const Formula*, vector<Cell*>> groups;
+	for (Cell* cell : level) {
+		const Formula* formula = cell->GetFormula().get();
+		if (formula == nullptr || formula->HasRanges())
+			singles.push_back(cell);
+		else
+			groups[formula].push_back(cell);
+	}
+
+	for (pair<const Formula* const, vector<Cell*>>& group : groups) {
+		if (group.second.size() < batchThreshold) {
+			singles.insert(singles.end(), group.second.begin(), group.second.end());
+			continue;
+		}
+		for (size_t first = 0; first < group.second.size(); first += MaxBatch)
+			batches.push_back(vector<Cell*>(group.second.begin() + first,
+				group.second.begin() + min(group.second.size(), first + MaxBatch)));
+	}
+}
+
+void SpreadsheetState::ComputeBatch(const vector<Cell*>& batch) {
+	const size_t count = batch.size();
+	const Formula& shape = *batch[0]->GetFormula();
+	const size_t variableCount = shape.VariableCount();
+
+	// Gather inputs into one contiguous column per variable
+	vector<double> inputs(variableCount * count);
+	vector<uint8_t> failed(count, 0);
+	vector<double> results(count);
+	for (size_t lane = 0; lane < count; lane++) {
+		const CellId anchor = batch[lane]->GetId();
+		for (size_t variable = 0; variable < variableCount; variable++) {
+			// Same rules as ComputeValue: empty cells count as 0, text or errors fail the lane
+			double& input = inputs[variable * count + lane];
+			input = 0;
+			const Cell* referenced = cells.Find(shape.GetVariable(variable, anchor));
+			if (referenced == nullptr)
+				continue;
+			const CellValue& value = referenced->GetValue();
+			if (value.GetKind() == CellValue::Kind::Text || value.GetKind() == CellValue::Kind::Error)
+				failed[lane] = 1;
+			else
+				input = value.GetNumber();
+		}
+	}
+
+	shape.EvaluateBatch(inputs.data(), count, results.data(), failed.data());
+
+	for (size_t lane = 0; lane < count; lane++)
+		batch[lane]->SetValue(failed[lane] ? CellValue(CellValue::Kind::Error) : CellValue(results[lane]));
+}
+
+void SpreadsheetState::Recalculate(const unordered_set<CellId>& changed) {
+	RecalculateCells(dependencies.GetTransitiveDependents(changed));
+}
+
+void SpreadsheetState::RecalculateAll() {
+	unordered_set<CellId> all;
+	all.reserve(cells.Size());
+	cells.ForEach([&all](const Cell& cell) {
+		all.insert(cell.GetId());
+	});
+
+	RecalculateCells(all);
+	lastRecalculated.clear();
+}
+
+void SpreadsheetState::RecalculateCells(const unordered_set<CellId>& dirty) {
+	vector<CellId> circular;
+	vector<vector<CellId>> levels = dependencies.GetTopologicalLevels(dirty, circular);
+
+	lastRecalculated.clear();
+	for (const vector<CellId>& level : levels) {
+		// Resolve cells up front, so workers only ever read the store
+		vector<Cell*> levelCells;
+		levelCells.reserve(level.size());
+		for (const CellId& cell : level) {
+			Cell* found = cells.Modify(cell);
+			if (found != nullptr) {
+				levelCells.push_back(found);
+				lastRecalculated.push_back(cell);
+			}
+		}
+
+		// Runs of formulas filled down or across a sheet are evaluated together
+		vector<vector<Cell*>> batches;
+		vector<Cell*> singles;
+		GroupByShape(levelCells, batches, singles);
+
+		// Nothing in a level references anything else in it, so its cells can be computed in any order
+		if (levelCells.size() >= parallelThreshold) {
+			ThreadPool::Shared().ParallelFor(batches.size(), 1, [this, &batches](size_t i) {
+				ComputeBatch(batches[i]);
+			});
+			ThreadPool::Shared().ParallelFor(singles.size(), 16, [this, &singles](size_t i) {
+				singles[i]->SetValue(ComputeValue(*singles[i]));
+			});
+		}
+		else {
+			for (const vector<Cell*>& batch : batches)
+				ComputeBatch(batch);
+			for (Cell* cell : singles)
+				cell->SetValue(ComputeValue(*cell));
+		}
+
+		// Later levels may aggregate over this one, so the index must be current before moving on
+		for (Cell* cell : levelCells)
+			aggregates.Update(cell->GetId(), cell->GetValue());
+	}
+
+	for (const CellId& cell : circular) {
+		Cell* found = cells.Modify(cell);
+		if (found != nullptr) {
+			found->SetValue(CellValue(CellValue::Kind::Error));
+			aggregates.Update(cell, CellValue(CellValue::Kind::Error));
+		}
 	}
+}
+
+void SpreadsheetState::AddOrUpdateCell(const CellId cellName, const string& content, const bool lock, const shared_ptr<const Formula> compiled) {
+	if (lock)
+		WriteLock();
+	// Share the formula with every other cell of the same template
+	shared_ptr<const Formula> formula = compiled ? compiled : formulas.Intern(content, cellName);
+	Cell& cell = cells.Insert(cellName);
+	cell.SetContents(content, history.RecordEdit(cellName, content, cell.GetVersion()), formula);
 	if (lock)
 		WriteUnlock();
 }
 
-const bool SpreadsheetState::CellExists(const string cell) const
+const bool SpreadsheetState::CellExists(const CellId cell) const
 {
-	return cells.count(cell) == 1;
+	return cells.Contains(cell);
 }
 
-bool SpreadsheetState::ValidCellContents(const string contents)
+FormulaParseResult SpreadsheetState::ValidCellContents(const CellId cell, const string contents, shared_ptr<const Formula>& compiled)
 {
-	//if empty string, its fine
-	if (contents.size() == 0)
-		return true;
+	FormulaParseResult result = { FormulaError::None, 0 };
+	compiled = nullptr;
 
 	//if the first character is '=', we check if its a valid formula
-	if (contents[0] == '=') {
-		try
-		{
-			Formula f = Formula(contents);
-			return true;
-		}
-		catch (exception e)
-		{
-			return false;
-		}
-	}
+	//if its not a formula, any valid string is fine, including the empty string
+	if (contents.size() != 0 && contents[0] == '=')
+		compiled = formulas.Intern(contents, cell, result);
 
-	//if its not a formula, any valid string is fine
-	return true;
+	return result;
 }
 
 list<CellEdit> SpreadsheetState::GetEditHistory() {
-	ReadLock();
-	list<CellEdit> result(edits);
-	ReadUnlock();
+	StoredSpreadsheet snapshot = GetSnapshot();
+	list<CellEdit> result;
+	snapshot.history.ForEachChange([&snapshot, &result](uint32_t change) {
+		const VersionLog::Version version = snapshot.history.Get(change);
+		if (!version.cell.IsValid()) {
+			// A group is undone as one change, listed here as one edit per cell
+			for (uint32_t member = version.previous; member < change; member++) {
+				const VersionLog::Version edited = snapshot.history.Get(member);
+				result.push_back(CellEdit(edited.cell, snapshot.history.GetContents(edited.replaced)));
+			}
+			return;
+		}
+		result.push_back(CellEdit(version.cell, snapshot.history.GetContents(version.replaced)));
+	});
 	return result;
 }
 
 set<Cell> SpreadsheetState::GetPopulatedCells() {
 	set<Cell> result = set<Cell>();
 
+	// Put all cells in result list, reading the snapshot without holding the lock
+	GetSnapshot().cells.ForEach([&result](const Cell& cell) {
+		result.insert(cell);
+	});
+	return result;
+}
+
+StoredSpreadsheet SpreadsheetState::GetSnapshot(const bool withPositions) {
 	ReadLock();
-	// Put all cells in result list
-	for (pair<string, Cell> cellEntry : cells)
-		result.insert(cellEntry.second);
+	StoredSpreadsheet snapshot(cells, history);
+	// Every edit recalculates before returning, so between edits all values are current
+	snapshot.derived = true;
+	if (withPositions) {
+		vector<pair<CellId, int>> positions = dependencies.GetPositions();
+		if (!positions.empty())
+			snapshot.positions = make_shared<const vector<pair<CellId, int>>>(move(positions));
+	}
 	ReadUnlock();
-	return result;
+	return snapshot;
+}
+
+/// <summary>
+/// Rough bytes the cell store, dependency graph and aggregate index spend on a cell beyond the Cell itself
+/// </summary>
+static const size_t BytesPerCellIndexed = 96;
+
+size_t SpreadsheetState::GetMemoryUsage() {
+	ReadLock();
+	size_t bytes = cells.Size() * (sizeof(Cell) + BytesPerCellIndexed) + history.GetMemoryUsage();
+	ReadUnlock();
+	return bytes;
 }
 
 void SpreadsheetState::WriteLock() {
@@ -243,17 +655,37 @@ void SpreadsheetState::ReadUnlock() {
 	threadkey->unlock_shared();
 }
 
-const string SpreadsheetState::GetCell(const string name) {
+const string SpreadsheetState::GetCell(const CellId name) {
 	ReadLock();
 	if (CellExists(name)) {
-		string result = cells[name].GetContents();
+		string result = cells.Find(name)->GetContents();
 		ReadUnlock();
 		return result;
 	}
 	else {
 		ReadUnlock();
-		throw runtime_error(string("Cell " + name + " has no content to get"));
+		throw runtime_error(string("Cell " + name.ToString() + " has no content to get"));
+	}
+}
+
+const CellValue SpreadsheetState::GetValue(const CellId name) {
+	ReadLock();
+	const Cell* found = cells.Find(name);
+	CellValue result = found != nullptr ? found->GetValue() : CellValue();
+	ReadUnlock();
+	return result;
+}
+
+vector<pair<CellId, CellValue>> SpreadsheetState::GetRecalculatedValues() {
+	vector<pair<CellId, CellValue>> result;
+	ReadLock();
+	for (const CellId& cell : lastRecalculated) {
+		const Cell* found = cells.Find(cell);
+		if (found != nullptr)
+			result.push_back(pair<CellId, CellValue>(cell, found->GetValue()));
 	}
+	ReadUnlock();
+	return result;
 }
 
 /// <summary>
@@ -264,16 +696,5 @@ const string SpreadsheetState::GetCell(const string name) {
 /// <param name="token"></param>
 /// <returns></returns>
 bool SpreadsheetState::IsValid(string token) {
-	if (token.size() <= 1 || token.size() > 3)
-		return false;
-	//65 is ascii for 'A', 90 is ascii for 'Z'
-	if ((int)token[0] < 65 || (int)token[0] > 90)
-		return false;
-
-	for (int i = 1; i < token.size(); i++)
-		//48 is ascii for '0', 57 is ascii for '9'
-		if ((int)token[i] < 48 || (int)token[i] > 57)
-			return false;
-
-	return true;
+	return CellId::Parse(token).IsValid();
 }
\ No newline at end of file
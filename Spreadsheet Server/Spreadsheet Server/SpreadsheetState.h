@@ -4,11 +4,18 @@
 #include <set>
 
 #include "Cell.h"
+#include "CellStore.h"
+#include "CellId.h"
 #include "CellEdit.h"
 #include "EditRequest.h"
 #include <shared_mutex>
 
 #include "DependencyGraph.h"
+#include "ThreadPool.h"
+#include "AggregateIndex.h"
+#include "FormulaTable.h"
+#include "VersionLog.h"
+#include "Storage.h"
 
 using namespace std;
 
@@ -25,43 +32,114 @@ private:
 	/// <summary>
 	/// All cells in this spreadsheet
 	/// </summary>
-	unordered_map<string, Cell> cells;
+	CellStore cells;
 
 	/// <summary>
-	/// All edits made to this spreadsheet, in order of recency.
+	/// Every version of every cell, and the edits and reverts that can be undone
 	/// </summary>
-	list<CellEdit> edits;
+	VersionLog history;
 
 	/// <summary>
 	/// Stores all dependencies in this SpreadsheetState
 	/// </summary>
 	DependencyGraph dependencies;
 
+	/// <summary>
+	/// Per-column aggregates of cell values, used to evaluate SUM, AVERAGE, MIN, MAX and COUNT
+	/// </summary>
+	AggregateIndex aggregates;
+
+	/// <summary>
+	/// Compiled formulas of this spreadsheet, shared between cells with the same relative formula
+	/// </summary>
+	FormulaTable formulas;
+
 	/// <summary>
 	/// Maps clients IDs to the cell they've selected
 	/// </summary>
-	unordered_map<int, string> selections;
+	unordered_map<int, CellId> selections;
+
+	/// <summary>
+	/// Cells whose values were recomputed by the most recent edit, revert or undo,
+	/// in the order they were recomputed
+	/// </summary>
+	vector<CellId> lastRecalculated;
+
+	/// <summary>
+	/// Computes the value of a cell from its contents and the current values
+	/// of the cells it references. Formulas referencing text or errors, and
+	/// formulas dividing by zero, evaluate to an error.
+	/// Should be encased in a read or write lock, does not use one
+	/// </summary>
+	/// <param name="cell">Cell to compute</param>
+	/// <returns>The new value for the cell</returns>
+	const CellValue ComputeValue(const Cell& cell) const;
+
+	/// <summary>
+	/// Recomputes the values of changed cells and of every cell that transitively
+	/// depends on them, level by level in topological order, and records them in lastRecalculated.
+	/// A cell depending on several changed cells is only recomputed once.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="changed">Cells whose contents changed</param>
+	void Recalculate(const unordered_set<CellId>& changed);
+
+	/// <summary>
+	/// Recomputes the value of every cell, for use after loading a spreadsheet.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	void RecalculateAll();
+
+	/// <summary>
+	/// Recomputes a set of cells, one topological level at a time. Cells within a level
+	/// don't reference each other, so levels of at least parallelThreshold cells are
+	/// split across the shared ThreadPool, and same-shaped formulas within a level are
+	/// evaluated in batches. Cells that are part of a cycle (only possible
+	/// in spreadsheets loaded from a file) become errors.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="dirty">Cells to recompute</param>
+	void RecalculateCells(const unordered_set<CellId>& dirty);
+
+	/// <summary>
+	/// Smallest topological level that is recomputed in parallel
+	/// </summary>
+	static size_t parallelThreshold;
+
+	/// <summary>
+	/// Smallest group of same-shaped formulas in a level that is evaluated as one batch
+	/// </summary>
+	static size_t batchThreshold;
+
+	/// <summary>
+	/// Splits the cells of a level into batches of cells sharing one formula
+	/// template, each at least batchThreshold cells long, and
+	/// the remaining cells, which are computed one at a time
+	/// </summary>
+	/// <param name="level">Cells of one topological level</param>
+	/// <param name="batches">Receives the batches</param>
+	/// <param name="singles">Receives the remaining cells</param>
+	void GroupByShape(const vector<Cell*>& level, vector<vector<Cell*>>& batches, vector<Cell*>& singles) const;
 
 	/// <summary>
-	/// Checks cells for circular dependencies.
-	/// Should be used before implementing a cell change, by feeding
-	/// the list of variables for the new cell to toVisit.
-	/// This should be encased in a read lock
+	/// Computes and sets the values of a batch of same-shaped formulas with one call to
+	/// Formula::EvaluateBatch. Gives the same values as ComputeValue would for each cell.
+	/// Should be encased in a write lock, does not use one
 	/// </summary>
-	/// <param name="visited">Cells visited so far</param>
-	/// <param name="toVisit">Cells to visit</param>
-	/// <returns>True if circular dependency is found, else false</returns>
-	const bool CheckCircularDependencies(unordered_set<string>& visited, const vector<string> toVisit);
+	/// <param name="batch">Cells returned in one batch by GroupByShape</param>
+	void ComputeBatch(const vector<Cell*>& batch);
 
 	/// <summary>
-	/// Checks whether a hypothetical new cell would create a circular dependency
+	/// Checks whether a hypothetical new cell would create a circular dependency.
+	/// Uses the dependency graph's topological order, so most checks don't search at all
 	/// Can use a read lock, or not if already encased in one
 	/// </summary>
-	/// <param name="name">Name of cell</param>
-	/// <param name="f">New contents for cell</param>
+	/// <param name="name">Cell being changed</param>
+	/// <param name="variables">Variables of the new contents for cell</param>
+	/// <param name="ranges">Ranges of the new contents for cell</param>
 	/// <param name="readLock">Whether to use an internal read lock. Set to false if encased in a lock</param>
 	/// <returns>True if a circular dependency would be created, else false</returns>
-	const bool CheckNewCellCircular(const string name, const string& f, const bool readLock);
+	const bool CheckNewCellCircular(const CellId name, const vector<CellId>& variables, const vector<CellRange>& ranges, const bool readLock);
 
 	/// <summary>
 	/// Locks a critical section for writing
@@ -91,34 +169,117 @@ private:
 	/// </summary>
 	shared_ptr<shared_mutex> threadkey;
 
+	/// <summary>
+	/// Edits a cell whose new contents were already validated, unless that would create
+	/// a circular dependency. Leaves recomputing values to the caller.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="name">Cell to edit</param>
+	/// <param name="content">New content</param>
+	/// <param name="compiled">content compiled by ValidCellContents</param>
+	/// <param name="changed">The cell is added to this if edited</param>
+	/// <returns>True if the cell was edited</returns>
+	bool ApplyEdit(const CellId name, const string& content, const shared_ptr<const Formula> compiled, unordered_set<CellId>& changed);
+
+	/// <summary>
+	/// Reverts a cell, like RevertCell, but leaves recomputing values to the caller.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="cell">Cell to revert</param>
+	/// <param name="changed">The cell is added to this if reverted</param>
+	/// <returns>True if the cell was reverted</returns>
+	bool ApplyRevert(const CellId cell, unordered_set<CellId>& changed);
+
+	/// <summary>
+	/// Undoes the last edit, like UndoLastEdit, but leaves recomputing values to the caller.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="changed">The cells changed are added to this if the undo succeeded</param>
+	/// <param name="undone">The cells changed are appended to this if the undo succeeded</param>
+	tuple<bool, CellId, string> ApplyUndo(unordered_set<CellId>& changed, vector<CellId>& undone);
+
+	/// <summary>
+	/// Edits a block of cells, like EditCells, but leaves recomputing values to the caller.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="changed">The cells edited are added to this if the block was edited</param>
+	/// <param name="edited">Set to the cells edited, in the order given. Cells that already held their
+	/// new contents are left alone and not included, so this is empty if nothing changed</param>
+	bool ApplyEditCells(const vector<pair<CellId, string>>& edits, const int ClientID, unordered_set<CellId>& changed, vector<CellId>& edited);
+
+	/// <summary>
+	/// Replaces the dependencies of several cells at once with those of their new contents,
+	/// checking the combined change for circular dependencies: all of the old dependencies
+	/// are removed before any new one is added, so a cycle is only found if the cells would
+	/// form one once every one of them had its new contents. Leaves the graph as it was if so.
+	/// Should be encased in a write lock, does not use one
+	/// </summary>
+	/// <param name="targets">Cells getting new contents, each once</param>
+	/// <param name="compiled">New contents of each cell compiled, null if not a formula</param>
+	/// <returns>True if the dependencies were replaced, false if there would be a cycle</returns>
+	bool ReplaceDependencies(const vector<CellId>& targets, const vector<shared_ptr<const Formula>>& compiled);
+
 	/// <summary>
 	/// Adds a cell to cells if it doesn't already exist,
-	/// or updates the existing entry if it does.
+	/// or updates the existing entry if it does, recording the edit in the version log.
 	/// Uses a write lock if lock == true. Otherwise, should be encapsulated in a write lock
 	/// </summary>
 	/// <param name="lock">Whether to use a write lock</param>
-	/// <param name="cellName">Name of cell</param>
+	/// <param name="cellName">Cell to add or update</param>
 	/// <param name="content">Cell content</param>
-	void AddOrUpdateCell(const string cellName, const string& content, const bool lock);
+	/// <param name="compiled">content already compiled by formulas, or null to compile it here</param>
+	void AddOrUpdateCell(const CellId cellName, const string& content, const bool lock, const shared_ptr<const Formula> compiled = nullptr);
 
 	/// <summary>
-	/// Checks whether a cell exists in this object's map
+	/// Checks whether a cell exists in this object's store
 	/// Should be encased in a read or write lock, does not use one
 	/// </summary>
 	/// <param name="cell">Cell to check for</param>
 	/// <returns>True if cell exists, else false</returns>
-	const bool CellExists(const string cell) const;
+	const bool CellExists(const CellId cell) const;
 
 	/// <summary>
-	/// Static method that returns if the given cell contents are valid or not
+	/// Checks whether the given cell contents are valid, without throwing
+	/// Does not need a lock, the formula table has its own
 	/// </summary>
+	/// <param name="cell">Cell the contents are for</param>
 	/// <param name="contents"></param>
-	/// <returns></returns>
-	static bool ValidCellContents(const string contents);
+	/// <param name="compiled">Set to the shared compiled formula if contents are a valid formula, else null</param>
+	/// <returns>The formula parse error, or FormulaError::None if contents are valid</returns>
+	FormulaParseResult ValidCellContents(const CellId cell, const string contents, shared_ptr<const Formula>& compiled);
 
 
 
 public:
+	/// <summary>
+	/// What became of one request applied by ApplyRequests
+	/// </summary>
+	struct RequestResult
+	{
+		/// <summary>
+		/// True if the request selected a cell or changed the spreadsheet
+		/// </summary>
+		bool succeeded;
+
+		/// <summary>
+		/// Cell selected or changed. For an undo, the cell the undone change was made to,
+		/// the first one if it was a group
+		/// </summary>
+		CellId cell;
+
+		/// <summary>
+		/// Every cell the request changed: one for an edit, revert or undo, every cell of the
+		/// block for editCells or an undo of one, except those that already held their new
+		/// contents. Empty if it failed, was a selection, or changed nothing
+		/// </summary>
+		vector<CellId> changed;
+
+		/// <summary>
+		/// Why the request failed. Empty if it succeeded
+		/// </summary>
+		string error;
+	};
+
 	/// <summary>
 	/// Creates a new, blank spreadsheet
 	/// </summary>
@@ -128,12 +289,22 @@ public:
 	~SpreadsheetState();
 
 	/// <summary>
-	/// Creates a spreadsheet from a set of cells
-	/// Cell set is usually provided by the storage class, retreiving from a file
+	/// Creates a spreadsheet from a store of cells, keeping their contents and history
+	/// Cell store is usually provided by the storage class, retreiving from a file
 	/// Uses a write lock
 	/// </summary>
 	/// <param name="cells">Cells to initialize into spreadsheets</param>
-	SpreadsheetState(set<Cell>& cells, list<CellEdit>& edits);
+	/// <param name="history">Version log the cells' versions refer to</param>
+	SpreadsheetState(const CellStore& cells, const VersionLog& history);
+
+	/// <summary>
+	/// Creates a spreadsheet from a stored one, as returned by Storage::Open
+	/// If the stored cells are derived, their compiled formulas, values and dependency order
+	/// are taken as they are, so nothing is parsed or recalculated
+	/// Uses a write lock
+	/// </summary>
+	/// <param name="stored">Spreadsheet to initialize from</param>
+	SpreadsheetState(const StoredSpreadsheet& stored);
 
 	/// <summary>
 	/// Marks a cell as selected by a client
@@ -142,60 +313,107 @@ public:
 	/// <param name="cell">Cell to select</param>
 	/// <param name="ClientID">ID of client</param>
 	/// <returns></returns>
-	void SelectCell(const string cell, const int ClientID);
+	void SelectCell(const CellId cell, const int ClientID);
 
 	/// <summary>
 	/// Validates that a client has a cell selected
 	/// Uses a read lock
 	/// </summary>
-	/// <param name="cell">Cell name</param>
+	/// <param name="cell">Cell coordinates</param>
 	/// <param name="ClientID">ID of client</param>
 	/// <returns>True if the client has the cell selected, else false</returns>
-	bool ClientSelectedCell(const string cell, const int ClientID);
+	bool ClientSelectedCell(const CellId cell, const int ClientID);
 
 	/// <summary>
-	/// Edits the content of a cell and adds the edit to the edit stack
+	/// Edits the content of a cell and records the edit in the version log
 	/// Will use a write lock. Do NOT encase in any locks
 	/// </summary>
-	/// <param name="name">Cell name</param>
+	/// <param name="name">Cell coordinates</param>
 	/// <param name="content">New content</param>
 	/// <param name="ClientID">ID of client</param>
 	/// <returns>True if cell contents were edited successfully,
 	/// false if content format was invalid,
 	///  the edit would create a circular dependency,
 	/// or the client does not currently have that cell selected</returns>
-	bool EditCell(const string name, const string content, const int ClientID);
+	bool EditCell(const CellId name, const string content, const int ClientID);
+
+	/// <summary>
+	/// Edits a block of cells at once, as pasting does. Either every cell gets its new
+	/// contents or, if any contents are invalid or the block as a whole would create a
+	/// circular dependency, none do. Recorded as one change, which undo puts back whole.
+	/// Will use a write lock. Do NOT encase in any locks
+	/// </summary>
+	/// <param name="edits">Cells and their new contents, each cell once</param>
+	/// <param name="ClientID">ID of client, who must have one of the cells selected</param>
+	/// <returns>True if the block was edited, false if any cell was invalid or repeated,
+	/// any contents were invalid, the edit would create a circular dependency,
+	/// or the client does not currently have any of the cells selected</returns>
+	bool EditCells(const vector<pair<CellId, string>>& edits, const int ClientID);
 
 	/// <summary>
-	/// Reverts most recent change to a certain cell and adds the revert to the edit stack
+	/// Reverts most recent change to a certain cell and records the revert in the version log
 	/// Will use a write lock. Do NOT encase in any locks
 	/// </summary>
 	/// <param name="cell">Cell to revert</param>
 	/// <returns>True if revert successfull, 
 	/// false if revert would create a circular dependency</returns>
-	bool RevertCell(const string cell);
+	bool RevertCell(const CellId cell);
 
 	/// <summary>
-	/// Undoes the last edit to the spreadsheet
+	/// Undoes the last edit to the spreadsheet, or the last block of cells edited by EditCells
 	/// Will use a write lock. Do NOT encase in any locks
 	/// </summary>
-	/// <returns>True if edit undone, false if edit would create a circular dependency, and name of cell changed</returns>
-	tuple<bool, string> UndoLastEdit();
+	/// <returns>True if edit undone, false if edit would create a circular dependency;
+	/// the cell changed, the first one for a block; and an error message if the undo failed</returns>
+	tuple<bool, CellId, string> UndoLastEdit();
 
 	/// <summary>
-	/// Returns all edits made to this spreadsheet as a stack, with most recent at the top
-	/// Will use a read lock
+	/// Applies a batch of selectCell, editCell, editCells, revertCell and undo requests in order,
+	/// with the same checks as SelectCell, EditCell, EditCells, RevertCell and UndoLastEdit, under
+	/// one write lock. Values are recomputed once for the whole batch, so afterwards
+	/// GetRecalculatedValues returns every cell recomputed by it. Requests of any other
+	/// type are rejected.
+	/// Will use a write lock. Do NOT encase in any locks
 	/// </summary>
-	/// <returns>Stack of edits</returns>
+	/// <param name="requests">Requests to apply</param>
+	/// <returns>What became of each request, in the same order</returns>
+	vector<RequestResult> ApplyRequests(vector<EditRequest>& requests);
+
+	/// <summary>
+	/// Returns the edits and reverts that can still be undone, most recent first,
+	/// each with the contents its undo puts back
+	/// Will use a read lock, only while taking a snapshot
+	/// </summary>
+	/// <returns>List of edits</returns>
 	list<CellEdit> GetEditHistory();
 
 	/// <summary>
 	/// Gets all cells in this spreadsheet
-	/// Will use a read lock and multiple write locks
+	/// Will use a read lock, only while taking a snapshot
 	/// </summary>
 	/// <returns>Cells, as a list</returns>
 	set<Cell> GetPopulatedCells();
 
+	/// <summary>
+	/// Takes an immutable snapshot of this spreadsheet's cells and version log, for
+	/// saving it or sending it to a client that joins. Takes O(1) time, sharing
+	/// structure with this spreadsheet, so it is cheap to take after every edit.
+	/// Reading the snapshot needs no lock, and later edits don't show up in it
+	/// Will use a read lock
+	/// </summary>
+	/// <param name="withPositions">Whether to also copy the dependency graph's order, which
+	/// takes O(cells) time, so it can be saved and the spreadsheet reopened without sorting</param>
+	/// <returns>The snapshot</returns>
+	StoredSpreadsheet GetSnapshot(const bool withPositions = false);
+
+	/// <summary>
+	/// Estimates the memory this spreadsheet holds: its cells, with what the dependency
+	/// graph and aggregate index keep for them, and the versions its history keeps in memory
+	/// Will use a read lock
+	/// </summary>
+	/// <returns>Bytes used</returns>
+	size_t GetMemoryUsage();
+
 	/// <summary>
 	/// Gets the contents of a cell
 	/// Will use a read lock
@@ -203,7 +421,39 @@ public:
 	/// </summary>
 	/// <param name="name">Cell to get</param>
 	/// <returns>Current contents of the cell</returns>
-	const string GetCell(const string name);
+	const string GetCell(const CellId name);
+
+	/// <summary>
+	/// Gets the computed value of a cell
+	/// Will use a read lock
+	/// </summary>
+	/// <param name="name">Cell to get</param>
+	/// <returns>Value of the cell, empty if the cell has no content</returns>
+	const CellValue GetValue(const CellId name);
+
+	/// <summary>
+	/// Gets the values recomputed by the most recent successful edit, revert, undo or batch of them:
+	/// the changed cells followed by all of their transitive dependents, in topological order.
+	/// Callers must not run other edits on this spreadsheet in between.
+	/// Will use a read lock
+	/// </summary>
+	/// <returns>Recomputed cells and their new values</returns>
+	vector<pair<CellId, CellValue>> GetRecalculatedValues();
+
+	/// <summary>
+	/// Sets the smallest topological level that is recomputed in parallel.
+	/// Smaller levels are recomputed on the thread making the edit, since
+	/// handing them to the pool costs more than it saves
+	/// </summary>
+	/// <param name="cells">Minimum level size, SIZE_MAX to always recompute serially</param>
+	static void SetParallelThreshold(const size_t cells);
+
+	/// <summary>
+	/// Sets the smallest group of same-shaped formulas in a level that is evaluated
+	/// as a batch by vectorized code, rather than one formula at a time
+	/// </summary>
+	/// <param name="cells">Minimum group size, SIZE_MAX to never batch</param>
+	static void SetBatchThreshold(const size_t cells);
 
 	/// <summary>
 	/// Returns true if and only if this is a valid cell name
@@ -1,6 +1,9 @@
 // Server2.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 
+// Benchmark.cpp provides main in benchmark builds
+#ifndef SPREADSHEET_BENCHMARK
+
 #include <iostream>
 #include "ServerController.h"
 
@@ -16,7 +19,17 @@ void HandleExit() {
 	srv.StopServer();
 }
 
-int main(int, char**) {
+int main(int argc, char** argv) {
+	// Optional argument: when changes are forced to disk, none, batched (the default) or edit
+	if (argc > 1 && string(argv[1]) == "none")
+		Storage::SetDurability(Storage::Durability::None);
+	else if (argc > 1 && string(argv[1]) == "edit")
+		Storage::SetDurability(Storage::Durability::PerEdit);
+
+	// Optional second argument: megabytes spreadsheets nobody is connected to may keep loaded, 256 by default
+	if (argc > 2)
+		ServerController::SetIdleMemoryBudget((size_t)stoul(argv[2]) << 20);
+
 	cout << "Server starting on port 1100" << endl;
 	cout << "Press enter to stop server" << endl;
 
@@ -31,3 +44,4 @@ int main(int, char**) {
 
 	return 0;
 }
+#endif
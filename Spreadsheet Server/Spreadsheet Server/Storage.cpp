@@ -2,8 +2,20 @@
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <sstream>
+#include <algorithm>
 #include <experimental/filesystem>
 #include <boost/filesystem.hpp>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace fs = std::experimental::filesystem;
 //namespace fs = boost::filesystem;
@@ -11,143 +23,1102 @@ namespace fs = std::experimental::filesystem;
 /// <summary>
 /// The constructor for a StoredSpreadsheet()
 /// </summary>
-/// <param name="cells">The set of cells in the stored spreadsheet</param>
-/// <param name="edits">The list of edits in the stored spreadsheet</param>
-StoredSpreadsheet::StoredSpreadsheet(set<Cell> cells, list<CellEdit> edits) : cells(cells), edits(edits)
+/// <param name="cells">The cells in the stored spreadsheet</param>
+/// <param name="history">The version log the cells' versions refer to</param>
+StoredSpreadsheet::StoredSpreadsheet(const CellStore& cells, const VersionLog& history) : cells(cells), history(history), derived(false), positions()
 {}
 
-StoredSpreadsheet::StoredSpreadsheet() : cells(), edits() {
+StoredSpreadsheet::StoredSpreadsheet() : cells(), history(), derived(false), positions() {
 }
 
+Storage::Durability Storage::durability = Storage::Durability::Batched;
+
+const chrono::milliseconds Storage::CommitWindow(2);
+
 /// <summary>
-/// This method opens a spreadsheet for a new client by opening the 
-/// file pertaining to said spreadsheet. Once opened, the contents of 
-/// the file will be parsed into Cells and CellEdits to then be added 
-/// to a StoredSpreadsheet object.
+/// Forces what was written to an open file to disk
 /// </summary>
-/// <param name="filename">The name of the file to be opened</param>
-/// <returns>Returns the StoredSpreadsheet object containing the cells and cell edits of some spreadsheet</returns>
-StoredSpreadsheet Storage::Open(string filename)
+/// <returns>False if that failed</returns>
+static bool SyncFile(FILE* file)
 {
-	try
+	if (fflush(file) != 0)
+		return false;
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+/// <summary>
+/// Writes a version number to a file, -1 for NoVersion
+/// </summary>
+static string VersionToString(const uint32_t version)
+{
+	return version == VersionLog::NoVersion ? "-1" : to_string(version);
+}
+
+/// <summary>
+/// Reads a version number written by VersionToString, throwing
+/// unless it's NoVersion or a version below limit
+/// </summary>
+static uint32_t ParseVersion(const string& text, const uint32_t limit)
+{
+	long long version = stoll(text);
+	if (version == -1)
+		return VersionLog::NoVersion;
+	if (version < 0 || version >= limit)
+		throw out_of_range("Version " + text + " is not in the log");
+	return (uint32_t)version;
+}
+
+/// <summary>
+/// Writes one version of a log as a VERSION entry of an edit log. The contents come
+/// after their length, so they may hold line breaks
+/// </summary>
+static void WriteVersion(ostream& file, const VersionLog& history, const uint32_t i)
+{
+	const VersionLog::Version version = history.Get(i);
+	const string contents = history.GetContents(i);
+	file << "VERSION";
+	file << "\n";
+	file << (version.cell.IsValid() ? version.cell.ToString() : ""); // Empty for a group marker
+	file << "\n";
+	file << VersionToString(version.previous);
+	file << "\n";
+	file << VersionToString(version.replaced);
+	file << "\n";
+	file << VersionToString(version.undoPrevious);
+	file << "\n";
+	file << contents.size();
+	file << "\n";
+	file << contents;
+	file << "\n";
+}
+
+/// <summary>
+/// Start of a binary snapshot, written by Storage::Save. After it come the offsets of the
+/// chunks spilled to the history file, a SnapshotVersion for every version not spilled, a
+/// SnapshotCell for every cell, the pool: the contents of every version back to back, and
+/// last the derived section, if any (see SnapshotDerived). Every record has a fixed size, so
+/// the file is read in place once mapped. Numbers are in the byte order of the machine that
+/// wrote them, which shows in format if it differs. Format 1 snapshots end at poolSize
+/// </summary>
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t format;
+	uint32_t versions;
+	uint32_t lastChange;
+	uint32_t spilled;
+	uint32_t cells;
+	uint32_t reserved;
+	uint64_t poolSize;
+	uint64_t derivedSize;
+	uint64_t checksum;
+};
+
+/// <summary>
+/// A version in a binary snapshot. Column and row are UINT32_MAX for a group marker
+/// </summary>
+struct SnapshotVersion
+{
+	uint32_t column;
+	uint32_t row;
+	uint32_t previous;
+	uint32_t replaced;
+	uint32_t undoPrevious;
+	uint32_t length;
+	uint64_t offset;
+};
+
+/// <summary>
+/// A cell in a binary snapshot and the version it's at
+/// </summary>
+struct SnapshotCell
+{
+	uint32_t column;
+	uint32_t row;
+	uint32_t version;
+	uint32_t reserved;
+};
+
+/// <summary>
+/// Start of the derived section of a binary snapshot, which holds what's worked out from the
+/// cells' contents, so opening the spreadsheet needs no parsing or recalculation. After it
+/// come the SnapshotFormula records, the instructions, variables and ranges they take slices
+/// of, a SnapshotValue for every cell in the order of the SnapshotCell records, the dependency
+/// graph's order, and last the text of every formula back to back. Nothing in it is used
+/// unless its checksum in the header matches
+/// </summary>
+struct SnapshotDerived
+{
+	uint32_t formulas;
+	uint32_t instructions;
+	uint32_t variables;
+	uint32_t ranges;
+	uint32_t positions;
+	uint32_t reserved;
+	uint64_t textSize;
+};
+
+/// <summary>
+/// A compiled formula in a binary snapshot, shared by every cell it was shared by when saved
+/// </summary>
+struct SnapshotFormula
+{
+	uint32_t firstInstruction;
+	uint32_t instructions;
+	uint32_t firstVariable;
+	uint32_t variables;
+	uint32_t firstRange;
+	uint32_t ranges;
+	uint32_t maxStackDepth;
+	uint32_t temporaryCount;
+	uint64_t textOffset;
+	uint32_t textLength;
+	uint32_t reserved;
+};
+
+/// <summary>
+/// An instruction of a formula in a binary snapshot
+/// </summary>
+struct SnapshotInstruction
+{
+	uint8_t op;
+	uint8_t reserved[3];
+	uint32_t variable;
+	double value;
+};
+
+/// <summary>
+/// A reference relative to the cell holding a formula. Ranges are two of these, first corner then second
+/// </summary>
+struct SnapshotOffset
+{
+	int32_t column;
+	int32_t row;
+};
+
+/// <summary>
+/// A cell's formula, the index of a SnapshotFormula or NoFormula, and its value
+/// </summary>
+struct SnapshotValue
+{
+	uint32_t formula;
+	uint32_t kind;
+	double number;
+};
+
+/// <summary>
+/// A cell's position in the dependency graph's topological order
+/// </summary>
+struct SnapshotPosition
+{
+	uint32_t column;
+	uint32_t row;
+	int32_t position;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 56 && sizeof(SnapshotVersion) == 32 && sizeof(SnapshotCell) == 16
+	&& sizeof(SnapshotDerived) == 32 && sizeof(SnapshotFormula) == 48 && sizeof(SnapshotInstruction) == 16
+	&& sizeof(SnapshotOffset) == 8 && sizeof(SnapshotValue) == 16 && sizeof(SnapshotPosition) == 16,
+	"Snapshot records are written as raw bytes");
+
+/// <summary>
+/// Size of the header of a format 1 snapshot, which had no derived section
+/// </summary>
+static const size_t SnapshotHeaderFormat1 = 40;
+
+/// <summary>
+/// SnapshotValue::formula of a cell that isn't a formula
+/// </summary>
+static const uint32_t NoFormula = UINT32_MAX;
+
+/// <summary>
+/// First bytes of a binary snapshot. Text snapshots start with VERSION_LOG or CELL instead
+/// </summary>
+static const char SnapshotMagic[8] = { 'S', 'P', 'R', 'D', 'S', 'N', 'A', 'P' };
+
+/// <summary>
+/// Format of binary snapshot written, raised whenever the layout changes
+/// </summary>
+static const uint32_t SnapshotFormat = 2;
+
+/// <summary>
+/// Gets the cell at a column and row read from a binary snapshot, invalid if there is none
+/// </summary>
+static CellId SnapshotCellId(const uint32_t column, const uint32_t row)
+{
+	if (column >= (uint32_t)CellId::Columns || row >= (uint32_t)CellId::Rows)
+		return CellId();
+	return CellId((int)column, (int)row);
+}
+
+/// <summary>
+/// Checks a version number read from a binary snapshot, throwing
+/// unless it's NoVersion or a version below limit
+/// </summary>
+static uint32_t CheckVersion(const uint32_t version, const uint32_t limit)
+{
+	if (version != VersionLog::NoVersion && version >= limit)
+		throw out_of_range("Version " + to_string(version) + " is not in the log");
+	return version;
+}
+
+/// <summary>
+/// Checksum of a snapshot's derived section, 64 bit FNV-1a
+/// </summary>
+static uint64_t SnapshotChecksum(const char* data, const uint64_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (uint64_t i = 0; i < size; i++)
 	{
-		ifstream file("spreadsheets/" + filename + ".sprd");
+		hash ^= (uint8_t)data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
 
-		string line;
+/// <summary>
+/// Reads the derived section of a binary snapshot (see SnapshotDerived), rebuilding its
+/// formulas without parsing them. Every formula's program is checked as Formula::Load does,
+/// and every index against what it indexes, so the cells can take it all as it is
+/// </summary>
+/// <param name="data">The derived section</param>
+/// <param name="size">Size of the derived section in bytes</param>
+/// <param name="checksum">Checksum of the section saved in the header</param>
+/// <param name="cells">Number of cells in the snapshot</param>
+/// <param name="formulas">Set to the formulas, by index</param>
+/// <param name="values">Set to the first cell's SnapshotValue</param>
+/// <param name="positions">Set to the dependency graph's order, or null if none was saved</param>
+/// <returns>False if the section can't be used, so the cells must be compiled and computed again</returns>
+static bool OpenDerived(const char* data, const uint64_t size, const uint64_t checksum, const uint32_t cells,
+	vector<shared_ptr<const Formula>>& formulas, const char*& values, shared_ptr<const vector<pair<CellId, int>>>& positions)
+{
+	SnapshotDerived header;
+	if (size < sizeof(header) || SnapshotChecksum(data, size) != checksum)
+		return false;
+	memcpy(&header, data, sizeof(header));
 
-		set<Cell> ssCells;
-		list<CellEdit> ssEdits;
+	const uint64_t formulasAt = sizeof(header);
+	const uint64_t instructionsAt = formulasAt + (uint64_t)header.formulas * sizeof(SnapshotFormula);
+	const uint64_t variablesAt = instructionsAt + (uint64_t)header.instructions * sizeof(SnapshotInstruction);
+	const uint64_t rangesAt = variablesAt + (uint64_t)header.variables * sizeof(SnapshotOffset);
+	const uint64_t valuesAt = rangesAt + (uint64_t)header.ranges * 2 * sizeof(SnapshotOffset);
+	const uint64_t positionsAt = valuesAt + (uint64_t)cells * sizeof(SnapshotValue);
+	const uint64_t textAt = positionsAt + (uint64_t)header.positions * sizeof(SnapshotPosition);
+	if (textAt + header.textSize != size)
+		return false;
 
-		//if the file isn't good, just make a new spreadsheet
-		if (!file.good())
-			throw exception();
+	auto offsetAt = [data](const uint64_t at) {
+		SnapshotOffset saved;
+		memcpy(&saved, data + at, sizeof(saved));
+		return CellOffset{ saved.column, saved.row };
+	};
+	formulas.reserve(header.formulas);
+	for (uint32_t i = 0; i < header.formulas; i++)
+	{
+		SnapshotFormula record;
+		memcpy(&record, data + formulasAt + (uint64_t)i * sizeof(record), sizeof(record));
+		// A program's stack and temporaries never outgrow its length
+		if ((uint64_t)record.firstInstruction + record.instructions > header.instructions
+			|| (uint64_t)record.firstVariable + record.variables > header.variables
+			|| (uint64_t)record.firstRange + record.ranges > header.ranges
+			|| record.textOffset > header.textSize || record.textLength > header.textSize - record.textOffset
+			|| record.maxStackDepth > record.instructions || record.temporaryCount > record.instructions)
+			return false;
 
-		while (getline(file, line)) // while there are lines in the file
+		vector<Instruction> program(record.instructions);
+		for (uint32_t j = 0; j < record.instructions; j++)
 		{
-			if (line == "CELL")
-			{
-				list<string> previousList;
+			SnapshotInstruction saved;
+			memcpy(&saved, data + instructionsAt + (uint64_t)(record.firstInstruction + j) * sizeof(saved), sizeof(saved));
+			program[j] = Instruction{ (OpCode)saved.op, saved.variable, saved.value };
+		}
+		vector<CellOffset> variables(record.variables);
+		for (uint32_t j = 0; j < record.variables; j++)
+			variables[j] = offsetAt(variablesAt + (uint64_t)(record.firstVariable + j) * sizeof(SnapshotOffset));
+		vector<pair<CellOffset, CellOffset>> ranges(record.ranges);
+		for (uint32_t j = 0; j < record.ranges; j++)
+		{
+			const uint64_t at = rangesAt + (uint64_t)(record.firstRange + j) * 2 * sizeof(SnapshotOffset);
+			ranges[j] = pair<CellOffset, CellOffset>(offsetAt(at), offsetAt(at + sizeof(SnapshotOffset)));
+		}
 
-				string name;
-				string content;
-				string prevContent;
-				int loop;
+		shared_ptr<const Formula> formula = Formula::Load(move(program), move(variables), move(ranges),
+			string(data + textAt + record.textOffset, record.textLength), record.maxStackDepth, record.temporaryCount);
+		if (!formula)
+			return false;
+		formulas.push_back(formula);
+	}
 
-				// put cell fields into variables
-				getline(file, line);
-				name = line;
-				getline(file, line);
-				content = line;
-				getline(file, line);
-				loop = stoi(line);     // created size variable in save method to know how long to run loop
+	for (uint32_t i = 0; i < cells; i++)
+	{
+		SnapshotValue value;
+		memcpy(&value, data + valuesAt + (uint64_t)i * sizeof(value), sizeof(value));
+		if ((value.formula != NoFormula && value.formula >= formulas.size()) || value.kind > (uint32_t)CellValue::Kind::Error)
+			return false;
+	}
+	values = data + valuesAt;
+
+	if (header.positions != 0)
+	{
+		shared_ptr<vector<pair<CellId, int>>> order = make_shared<vector<pair<CellId, int>>>();
+		order->reserve(header.positions);
+		for (uint32_t i = 0; i < header.positions; i++)
+		{
+			SnapshotPosition position;
+			memcpy(&position, data + positionsAt + (uint64_t)i * sizeof(position), sizeof(position));
+			CellId id = SnapshotCellId(position.column, position.row);
+			if (id.IsValid())
+				order->push_back(pair<CellId, int>(id, position.position));
+		}
+		positions = order;
+	}
+	return true;
+}
+
+/// <summary>
+/// Reads a binary snapshot in place, usually from the mapped file. Contents are copied
+/// straight into history's text blocks. Throws if the snapshot is cut short or refers to
+/// anything that isn't in it. history must already have its history file.
+/// If the snapshot has a derived section that checks out, cells get their compiled
+/// formulas and values from it, and formulas are left uncompiled otherwise
+/// </summary>
+/// <param name="data">The snapshot</param>
+/// <param name="size">Size of the snapshot in bytes</param>
+/// <param name="positions">Set to the dependency graph's order, if it was saved</param>
+/// <returns>True if the cells were loaded with their formulas and values</returns>
+static bool OpenSnapshot(const char* data, const size_t size, CellStore& ssCells, VersionLog& history,
+	shared_ptr<const vector<pair<CellId, int>>>& positions)
+{
+	SnapshotHeader header = {};
+	if (size < SnapshotHeaderFormat1)
+		throw runtime_error("Snapshot is cut short");
+	memcpy(&header, data, SnapshotHeaderFormat1);
+	if (header.format != 1 && header.format != SnapshotFormat)
+		throw runtime_error("Unknown snapshot format " + to_string(header.format));
+	const uint64_t headerSize = header.format == 1 ? SnapshotHeaderFormat1 : sizeof(header);
+	if (size < headerSize)
+		throw runtime_error("Snapshot is cut short");
+	memcpy(&header, data, headerSize);
+	if (header.spilled > header.versions / VersionLog::ChunkVersions)
+		throw runtime_error("Snapshot spills more versions than it has");
+
+	// Every section has a fixed size, known from the header
+	const uint32_t first = header.spilled * VersionLog::ChunkVersions;
+	const uint64_t offsetsAt = headerSize;
+	const uint64_t versionsAt = offsetsAt + (uint64_t)header.spilled * sizeof(uint64_t);
+	const uint64_t cellsAt = versionsAt + (uint64_t)(header.versions - first) * sizeof(SnapshotVersion);
+	const uint64_t poolAt = cellsAt + (uint64_t)header.cells * sizeof(SnapshotCell);
+	const uint64_t derivedAt = poolAt + header.poolSize;
+	if (derivedAt + header.derivedSize != size)
+		throw runtime_error("Snapshot is cut short");
+	const char* pool = data + poolAt;
+
+	// A derived section that doesn't check out is only a cache lost, the cells are rebuilt from their contents
+	vector<shared_ptr<const Formula>> formulas;
+	const char* values = nullptr;
+	const bool derived = header.derivedSize != 0
+		&& OpenDerived(data + derivedAt, header.derivedSize, header.checksum, header.cells, formulas, values, positions);
+
+	for (uint32_t i = 0; i < header.spilled; i++)
+	{
+		uint64_t offset;
+		memcpy(&offset, data + offsetsAt + i * sizeof(uint64_t), sizeof(offset));
+		history.LoadSpilled(offset);
+	}
+
+	// A version only ever refers to versions appended before it
+	for (uint32_t i = first; i < header.versions; i++)
+	{
+		SnapshotVersion version;
+		memcpy(&version, data + versionsAt + (uint64_t)(i - first) * sizeof(version), sizeof(version));
+		if (version.offset > header.poolSize || version.length > header.poolSize - version.offset)
+			throw out_of_range("Contents of version " + to_string(i) + " are not in the snapshot");
+		history.Load(SnapshotCellId(version.column, version.row), pool + version.offset, version.length,
+			CheckVersion(version.previous, i), CheckVersion(version.replaced, i), CheckVersion(version.undoPrevious, i));
+	}
+	history.SetLastChange(CheckVersion(header.lastChange, header.versions));
+
+	for (uint32_t i = 0; i < header.cells; i++)
+	{
+		SnapshotCell cell;
+		memcpy(&cell, data + cellsAt + (uint64_t)i * sizeof(cell), sizeof(cell));
+		const uint32_t version = CheckVersion(cell.version, header.versions);
+		CellId id = SnapshotCellId(cell.column, cell.row);
+		if (!id.IsValid())
+			continue;
+		if (!derived)
+		{
+			ssCells.Insert(id) = Cell::Uncompiled(id, history.GetContents(version), version);
+			continue;
+		}
+
+		// A formula cell's contents are its formula's, so they aren't read at all
+		SnapshotValue value;
+		memcpy(&value, values + (uint64_t)i * sizeof(value), sizeof(value));
+		Cell& loaded = ssCells.Insert(id);
+		if (value.formula != NoFormula)
+		{
+			loaded = Cell::Uncompiled(id, "", version);
+			loaded.ShareFormula(formulas[value.formula]);
+		}
+		else
+			loaded = Cell::Uncompiled(id, history.GetContents(version), version);
+		const CellValue::Kind kind = (CellValue::Kind)value.kind;
+		loaded.SetValue(kind == CellValue::Kind::Number ? CellValue(value.number) : CellValue(kind));
+	}
+	return derived;
+}
+
+/// <summary>
+/// Builds the derived section of a binary snapshot (see SnapshotDerived) as cells are saved
+/// </summary>
+class DerivedSection
+{
+private:
+	vector<SnapshotFormula> formulas;
+	vector<SnapshotInstruction> instructions;
+	vector<SnapshotOffset> variables;
+	vector<SnapshotOffset> ranges;
+	vector<SnapshotValue> values;
+	vector<SnapshotPosition> positions;
+	string text;
+
+	/// <summary>
+	/// Index of each formula saved, so a formula shared by many cells is saved once
+	/// </summary>
+	unordered_map<const Formula*, uint32_t> saved;
+
+	static SnapshotOffset ToSnapshot(const CellOffset& offset)
+	{
+		SnapshotOffset record = { offset.column, offset.row };
+		return record;
+	}
+
+	uint32_t AddFormula(const Formula& formula)
+	{
+		auto found = saved.find(&formula);
+		if (found != saved.end())
+			return found->second;
+
+		SnapshotFormula record = {};
+		record.firstInstruction = (uint32_t)instructions.size();
+		record.instructions = (uint32_t)formula.GetProgram().size();
+		for (const Instruction& instruction : formula.GetProgram())
+		{
+			SnapshotInstruction step = {};
+			step.op = (uint8_t)instruction.op;
+			step.variable = instruction.variable;
+			step.value = instruction.value;
+			instructions.push_back(step);
+		}
+		record.firstVariable = (uint32_t)variables.size();
+		record.variables = (uint32_t)formula.GetOffsets().size();
+		for (const CellOffset& offset : formula.GetOffsets())
+			variables.push_back(ToSnapshot(offset));
+		record.firstRange = (uint32_t)(ranges.size() / 2);
+		record.ranges = (uint32_t)formula.GetRangeOffsets().size();
+		for (const pair<CellOffset, CellOffset>& range : formula.GetRangeOffsets())
+		{
+			ranges.push_back(ToSnapshot(range.first));
+			ranges.push_back(ToSnapshot(range.second));
+		}
+		record.maxStackDepth = (uint32_t)formula.GetMaxStackDepth();
+		record.temporaryCount = (uint32_t)formula.GetTemporaryCount();
+		record.textOffset = text.size();
+		record.textLength = (uint32_t)formula.GetTemplate().size();
+		text += formula.GetTemplate();
+
+		const uint32_t index = (uint32_t)formulas.size();
+		formulas.push_back(record);
+		saved[&formula] = index;
+		return index;
+	}
+
+	template <typename T>
+	static void Append(string& section, const vector<T>& records)
+	{
+		section.append((const char*)records.data(), records.size() * sizeof(T));
+	}
+
+public:
+	/// <summary>
+	/// Adds a cell's formula and value, in the same order as its SnapshotCell
+	/// </summary>
+	void AddCell(const Cell& cell)
+	{
+		SnapshotValue value = {};
+		value.formula = cell.GetFormula() ? AddFormula(*cell.GetFormula()) : NoFormula;
+		value.kind = (uint32_t)cell.GetValue().GetKind();
+		value.number = cell.GetValue().GetNumber();
+		values.push_back(value);
+	}
+
+	/// <summary>
+	/// Adds the dependency graph's order
+	/// </summary>
+	void AddPositions(const vector<pair<CellId, int>>& order)
+	{
+		for (const pair<CellId, int>& position : order)
+		{
+			SnapshotPosition record = {};
+			record.column = (uint32_t)position.first.Column();
+			record.row = (uint32_t)position.first.Row();
+			record.position = position.second;
+			positions.push_back(record);
+		}
+	}
+
+	/// <summary>
+	/// Lays out the section as it's written
+	/// </summary>
+	string Write() const
+	{
+		SnapshotDerived header = {};
+		header.formulas = (uint32_t)formulas.size();
+		header.instructions = (uint32_t)instructions.size();
+		header.variables = (uint32_t)variables.size();
+		header.ranges = (uint32_t)(ranges.size() / 2);
+		header.positions = (uint32_t)positions.size();
+		header.textSize = text.size();
+
+		string section((const char*)&header, sizeof(header));
+		Append(section, formulas);
+		Append(section, instructions);
+		Append(section, variables);
+		Append(section, ranges);
+		Append(section, values);
+		Append(section, positions);
+		section += text;
+		return section;
+	}
+};
+
+/// <summary>
+/// Replays an edit log written by Storage::Append onto a spreadsheet. Stops at the first
+/// record that's incomplete or doesn't follow on from the history, since the log can't be
+/// trusted past it. Versions the history already has are skipped
+/// </summary>
+/// <returns>False if the log doesn't exist</returns>
+static bool ReplayLog(const string path, CellStore& ssCells, VersionLog& history)
+{
+	ifstream file(path, ios::binary);
+	if (!file.good())
+		return false;
 
-				for (int i = 0; i < loop; i++)
+	string line;
+	while (getline(file, line) && line == "CHANGE")
+	{
+		try
+		{
+			// Read the whole record before applying any of it
+			string first, count, lastChange;
+			getline(file, first);
+			getline(file, count);
+			getline(file, lastChange);
+			const uint32_t from = (uint32_t)stoul(first);
+			const uint32_t to = (uint32_t)stoul(count);
+			if (from > history.Size() || to < from)
+				return true;
+
+			vector<string> versions;
+			for (uint32_t i = from; i < to; i++)
+			{
+				getline(file, line); // VERSION
+				for (int field = 0; field < 4; field++)
 				{
 					getline(file, line);
-					prevContent = line;
-					previousList.push_back(prevContent);
+					versions.push_back(line);
 				}
 
-				// put variables into fields of new Cell to be added to ss
-				Cell cell(name, content, previousList);
-				ssCells.insert(cell);
+				// Contents come after their length, and may hold line breaks
+				getline(file, line);
+				string contents(stoul(line), '\0');
+				if (!contents.empty())
+					file.read(&contents[0], contents.size());
+				getline(file, line);
+				if (!file || !line.empty())
+					return true;
+				versions.push_back(contents);
 			}
-			else if (line == "CELL_EDIT")
+
+			getline(file, line);
+			const size_t cellCount = stoul(line);
+			vector<pair<string, string>> cells;
+			for (size_t i = 0; i < cellCount; i++)
 			{
-				string name;
-				string priorState;
+				string name, version;
+				getline(file, line); // CELL_VERSION
+				getline(file, name);
+				getline(file, version);
+				cells.push_back(pair<string, string>(name, version));
+			}
 
+			if (!getline(file, line) || line != "END")
+				return true;
+
+			// A version only ever refers to versions appended before it
+			for (uint32_t i = max(from, history.Size()); i < to; i++)
+			{
+				const string* fields = &versions[(i - from) * 5];
+				history.Load(CellId::Parse(fields[0]), fields[4], ParseVersion(fields[1], i),
+					ParseVersion(fields[2], i), ParseVersion(fields[3], i));
+			}
+			history.SetLastChange(ParseVersion(lastChange, to));
+			for (const pair<string, string>& cell : cells)
+			{
+				const uint32_t version = ParseVersion(cell.second, to);
+				CellId id = CellId::Parse(cell.first);
+				if (id.IsValid())
+					ssCells.Insert(id) = Cell::Uncompiled(id, history.GetContents(version), version);
+			}
+		}
+		catch (exception e)
+		{
+			return true;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Reads a file in the text format Storage::Save wrote before binary
+/// snapshots, after its VERSION_LOG line. history must already have its history file
+/// </summary>
+static void OpenVersionLog(ifstream& file, CellStore& ssCells, VersionLog& history)
+{
+	string line;
+	getline(file, line);
+	const uint32_t count = (uint32_t)stoul(line);
+	getline(file, line);
+	const string lastChange = line;
+
+	// Versions spilled to the history file stay there until they're needed
+	uint32_t first = 0;
+	getline(file, line);
+	if (line == "SPILLED")
+	{
+		getline(file, line);
+		const uint32_t spilled = (uint32_t)stoul(line);
+		for (uint32_t i = 0; i < spilled; i++)
+		{
+			getline(file, line);
+			history.LoadSpilled(stoull(line));
+		}
+		first = spilled * VersionLog::ChunkVersions;
+		getline(file, line);
+	}
+
+	for (uint32_t i = first; i < count; i++)
+	{
+		string name, previous, replaced, undoPrevious, content;
+		if (i != first)
+			getline(file, line); // VERSION
+		getline(file, name);
+		getline(file, previous);
+		getline(file, replaced);
+		getline(file, undoPrevious);
+		getline(file, content);
+
+		// A version only ever refers to versions appended before it
+		history.Load(CellId::Parse(name), content, ParseVersion(previous, i),
+			ParseVersion(replaced, i), ParseVersion(undoPrevious, i));
+	}
+	history.SetLastChange(ParseVersion(lastChange, count));
+
+	// With no versions to read, line already holds the first line after them
+	if (first != count)
+		getline(file, line);
+	for (; file; getline(file, line))
+	{
+		if (line != "CELL_VERSION")
+			continue;
+		string name;
+		getline(file, name);
+		getline(file, line);
+		uint32_t version = ParseVersion(line, count);
+
+		CellId id = CellId::Parse(name);
+		if (id.IsValid())
+			ssCells.Insert(id) = Cell::Uncompiled(id, history.GetContents(version), version);
+	}
+}
+
+/// <summary>
+/// Reads a file saved before the version log existed, where every cell lists its
+/// previous contents and edits are listed separately, most recent first. first is
+/// the file's first line, already read. Each cell's previous contents become a
+/// chain of versions, and each edit a change whose undo puts back its prior contents
+/// </summary>
+static void OpenLegacy(ifstream& file, const string& first, CellStore& ssCells, VersionLog& history)
+{
+	string line = first;
+	vector<pair<CellId, string>> ssEdits;
+
+	do
+	{
+		if (line == "CELL")
+		{
+			list<string> previousList;
+
+			string name;
+			string content;
+			string prevContent;
+			int loop;
+
+			// put cell fields into variables
+			getline(file, line);
+			name = line;
+			getline(file, line);
+			content = line;
+			getline(file, line);
+			loop = stoi(line);     // created size variable in save method to know how long to run loop
+
+			for (int i = 0; i < loop; i++)
+			{
 				getline(file, line);
-				name = line;
-				getline(file, line);
-				priorState = line;
+				prevContent = line;
+				previousList.push_back(prevContent);
+			}
+
+			CellId id = CellId::Parse(name);
+			if (!id.IsValid())
+				continue;
+
+			// Previous contents are most recent first. The oldest is normally the
+			// empty cell every cell starts as, which NoVersion already stands for
+			if (!previousList.empty() && previousList.back() == "")
+				previousList.pop_back();
+			uint32_t version = VersionLog::NoVersion;
+			for (auto prior = previousList.rbegin(); prior != previousList.rend(); ++prior)
+				version = history.Load(id, *prior, version, version, VersionLog::NoVersion);
+			version = history.Load(id, content, version, version, VersionLog::NoVersion);
+
+			ssCells.Insert(id) = Cell::Uncompiled(id, content, version);
+		}
+		else if (line == "CELL_EDIT")
+		{
+			string name;
+			string priorState;
+
+			getline(file, line);
+			name = line;
+			getline(file, line);
+			priorState = line;
 
-				// put variables into fields of new CellEdit
-				CellEdit edit(name, priorState);
-				ssEdits.push_back(edit);
+			ssEdits.push_back(pair<CellId, string>(CellId::Parse(name), priorState));
+		}
+	} while (getline(file, line));
+
+	// Edits are saved most recent first, so the oldest goes in first
+	uint32_t lastChange = VersionLog::NoVersion;
+	for (auto edit = ssEdits.rbegin(); edit != ssEdits.rend(); ++edit)
+	{
+		uint32_t prior = VersionLog::NoVersion;
+		if (edit->second != "")
+			prior = history.Load(edit->first, edit->second, VersionLog::NoVersion, VersionLog::NoVersion, VersionLog::NoVersion);
+		lastChange = history.Load(edit->first, edit->second, prior, prior, lastChange);
+	}
+	history.SetLastChange(lastChange);
+}
+
+Storage::Storage() : pending(), queued(0), written(0), failed(), stopping(false), compacting()
+{
+	worker = thread(&Storage::WriteRecords, this);
+}
+
+Storage::~Storage()
+{
+	{
+		lock_guard<mutex> guard(writeLock);
+		stopping = true;
+	}
+	queuedRecords.notify_all();
+	worker.join();
+}
+
+void Storage::SetDurability(const Durability policy)
+{
+	durability = policy;
+}
+
+void Storage::WriteRecords()
+{
+	unique_lock<mutex> guard(writeLock);
+	while (true)
+	{
+		queuedRecords.wait(guard, [this]() { return stopping || !pending.empty(); });
+		if (pending.empty())
+			return;
+
+		// Give other spreadsheets a moment to queue records, so they share the write and fsync
+		if (durability == Durability::Batched && !stopping)
+			queuedRecords.wait_for(guard, CommitWindow, [this]() { return stopping; });
+
+		deque<pair<string, string>> writing;
+		writing.swap(pending);
+		const uint64_t last = queued;
+		// Records queued before their log broke are dropped rather than written past the gap
+		unordered_set<string> failedPaths;
+		for (const pair<string, string>& record : writing)
+			if (brokenLogs.count(record.first) == 1)
+				failedPaths.insert(record.first);
+		guard.unlock();
+
+		// Each log's records in the order they were queued, written in one go
+		vector<string> paths;
+		unordered_map<string, string> records;
+		for (const pair<string, string>& record : writing)
+		{
+			if (failedPaths.count(record.first) == 1)
+				continue;
+			auto found = records.find(record.first);
+			if (found == records.end())
+			{
+				paths.push_back(record.first);
+				records[record.first] = record.second;
+			}
+			else
+				found->second += record.second;
+		}
+		for (const string& path : paths)
+		{
+			const string& text = records[path];
+			FILE* file = fopen(path.c_str(), "ab");
+			bool good = file != nullptr && fwrite(text.data(), 1, text.size(), file) == text.size();
+			if (good)
+				good = durability == Durability::None ? fflush(file) == 0 : SyncFile(file);
+			if (file != nullptr)
+				good = fclose(file) == 0 && good;
+			if (!good)
+			{
+				failedPaths.insert(path);
+				cout << "Could not write " << path << endl;
 			}
 		}
 
-		file.close();
+		guard.lock();
+		if (!failedPaths.empty())
+		{
+			uint64_t ticket = last - writing.size();
+			for (const pair<string, string>& record : writing)
+			{
+				ticket++;
+				if (failedPaths.count(record.first) == 0)
+					continue;
+				brokenLogs[record.first] = ticket;
+				// Only Appends waiting on their records look at single failures
+				if (durability == Durability::PerEdit)
+					failed.insert(ticket);
+			}
+		}
+		written = last;
+		writtenRecords.notify_all();
+	}
+}
 
-		StoredSpreadsheet ss(ssCells, ssEdits);
+void Storage::Flush()
+{
+	unique_lock<mutex> guard(writeLock);
+	const uint64_t target = queued;
+	writtenRecords.wait(guard, [this, target]() { return written >= target; });
+}
 
-		return ss;
+/// <summary>
+/// This method opens a spreadsheet for a new client by opening the 
+/// file pertaining to said spreadsheet. Once opened, the contents of 
+/// the file will be parsed into Cells and a VersionLog to then be added 
+/// to a StoredSpreadsheet object.
+/// </summary>
+/// <param name="filename">The name of the file to be opened</param>
+/// <returns>Returns the StoredSpreadsheet object containing the cells and history of some spreadsheet</returns>
+StoredSpreadsheet Storage::Open(string filename)
+{
+	// Changes made while it was last open may still be queued
+	Flush();
+
+	// A compaction of the spreadsheet from when it was last open may still be writing its snapshot
+	WaitForCompaction(filename);
+
+	const string path = "spreadsheets/" + filename;
+	CellStore ssCells;
+	VersionLog history;
+	bool derived = false;
+	shared_ptr<const vector<pair<CellId, int>>> positions;
+	try
+	{
+		history.SpillTo(make_shared<HistoryFile>(path + ".hist"));
+
+		// A binary snapshot starts with its magic, anything else is one of the older text formats
+		char magic[sizeof(SnapshotMagic)] = {};
+		ifstream start(path + ".sprd", ios::binary);
+		const bool binary = start.read(magic, sizeof(magic)) && memcmp(magic, SnapshotMagic, sizeof(magic)) == 0;
+		start.close();
+
+		if (binary)
+		{
+			boost::interprocess::file_mapping mapping((path + ".sprd").c_str(), boost::interprocess::read_only);
+			boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+			derived = OpenSnapshot((const char*)region.get_address(), region.get_size(), ssCells, history, positions);
+		}
+		else
+		{
+			ifstream file(path + ".sprd");
+
+			string line;
+
+			//if the file isn't good, just start from an empty spreadsheet
+			if (file.good() && getline(file, line))
+			{
+				if (line == "VERSION_LOG")
+					OpenVersionLog(file, ssCells, history);
+				else
+					OpenLegacy(file, line, ssCells, history);
+			}
+
+			file.close();
+		}
 	}
 	catch (exception e)
 	{
 		StoredSpreadsheet ss;
 		return ss;
 	}
+
+	// The log moved aside by an unfinished compaction is older than the current one
+	bool replayed = ReplayLog(path + ".wal.old", ssCells, history);
+	replayed = ReplayLog(path + ".wal", ssCells, history) || replayed;
+
+	StoredSpreadsheet ss(ssCells, history);
+	// Cells changed by the logs weren't compiled or computed, and others may depend on them
+	if (derived && !replayed)
+	{
+		ss.derived = true;
+		ss.positions = positions;
+	}
+
+	// A log cut short by a crash can't be appended to, so the logs are compacted now
+	if (replayed)
+	{
+		try
+		{
+			Save(filename, ss);
+			fs::remove(path + ".wal.old");
+			fs::remove(path + ".wal");
+		}
+		catch (exception e)
+		{
+			/*the logs are replayed again next time*/
+		}
+	}
+
+	return ss;
 }
 
 
 /// <summary>
-/// Saves a spreadsheet by taking all of the cells and cell 
-/// edits in a spreadsheet and converting them to text and 
-/// saving the text to a file. The file will have the '.sprd'
-/// extension.
+/// Saves a spreadsheet by taking its version log and the version
+/// each cell is at and writing them to a binary snapshot (see
+/// SnapshotHeader), with the cells' compiled formulas and values
+/// if they're derived. The file will have the '.sprd' extension.
 /// </summary>
 /// <param name="spreadsheetName">The name of the spreadsheet to be saved</param>
-/// <param name="ss">The stored spreadsheet that contains the list of cells and edits of a certain spreadsheet</param>
+/// <param name="ss">The stored spreadsheet that contains the cells and history of a certain spreadsheet</param>
 void Storage::Save(const string spreadsheetName, const StoredSpreadsheet& ss)
 {
 	try
 	{
-		string filename = spreadsheetName + ".sprd";
-		ofstream file("spreadsheets/" + filename, ofstream::out);
+		string filename = "spreadsheets/" + spreadsheetName + ".sprd";
+		// Written beside the old snapshot, which is only replaced once this is complete
+		ofstream file(filename + ".tmp", ofstream::out | ofstream::binary);
 		//ofstream file(filename, ofstream::out);
 
-		for (Cell cell : ss.cells)
-		{
-			file << "CELL";
-			file << "\n";
-			file << cell.GetName();
-			file << "\n";
-			file << cell.GetContents();
-			file << "\n";
-			file << cell.GetPreviousStates().size();
-			file << "\n";
-			// parse list of previous contents into file
-			for (string f : cell.GetPreviousStates())
-			{
-				file << f;
-				file << "\n";
-			}
-			file << "\n";
+		const VersionLog& history = ss.history;
+
+		// Spilled versions are already in this spreadsheet's history file, only where they are
+		// is saved. A log spilled to some other file has all its versions written out instead
+		const shared_ptr<HistoryFile>& historyFile = history.GetHistoryFile();
+		const uint32_t spilled = historyFile && historyFile->GetPath() == "spreadsheets/" + spreadsheetName + ".hist" ? history.SpilledChunks() : 0;
+		vector<uint64_t> offsets;
+		for (uint32_t i = 0; i < spilled; i++)
+			offsets.push_back(history.GetSpilledOffset(i));
+
+		vector<SnapshotVersion> versions;
+		string pool;
+		for (uint32_t i = spilled * VersionLog::ChunkVersions; i < history.Size(); i++)
+		{
+			const VersionLog::Version version = history.Get(i);
+			const string contents = history.GetContents(i);
+			SnapshotVersion record = {};
+			record.column = version.cell.IsValid() ? (uint32_t)version.cell.Column() : UINT32_MAX;
+			record.row = version.cell.IsValid() ? (uint32_t)version.cell.Row() : UINT32_MAX;
+			record.previous = version.previous;
+			record.replaced = version.replaced;
+			record.undoPrevious = version.undoPrevious;
+			record.length = (uint32_t)contents.size();
+			record.offset = pool.size();
+			pool += contents;
+			versions.push_back(record);
 		}
 
-		for (CellEdit edit : ss.edits)
+		// Formulas and values are only saved when they're current, each shared formula once
+		vector<SnapshotCell> cells;
+		DerivedSection derived;
+		ss.cells.ForEach([&cells, &derived, &ss](const Cell& cell)
+		{
+			SnapshotCell record = {};
+			record.column = (uint32_t)cell.GetId().Column();
+			record.row = (uint32_t)cell.GetId().Row();
+			record.version = cell.GetVersion();
+			cells.push_back(record);
+			if (ss.derived)
+				derived.AddCell(cell);
+		});
+		string derivedSection;
+		if (ss.derived)
 		{
-			file << "CELL_EDIT";
-			file << "\n";
-			file << edit.GetName();
-			file << "\n";
-			file << edit.GetPriorContents();
-			file << "\n";
+			if (ss.positions)
+				derived.AddPositions(*ss.positions);
+			derivedSection = derived.Write();
 		}
 
+		SnapshotHeader header = {};
+		memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+		header.format = SnapshotFormat;
+		header.versions = history.Size();
+		header.lastChange = history.GetLastChange();
+		header.spilled = spilled;
+		header.cells = (uint32_t)cells.size();
+		header.poolSize = pool.size();
+		header.derivedSize = derivedSection.size();
+		header.checksum = SnapshotChecksum(derivedSection.data(), derivedSection.size());
+
+		file.write((const char*)&header, sizeof(header));
+		file.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+		file.write((const char*)versions.data(), versions.size() * sizeof(SnapshotVersion));
+		file.write((const char*)cells.data(), cells.size() * sizeof(SnapshotCell));
+		file.write(pool.data(), pool.size());
+		file.write(derivedSection.data(), derivedSection.size());
+
 		file.close();
+		if (!file)
+			throw runtime_error("Writing " + filename + " failed");
+
+		// The logs the snapshot replaces are deleted once it's in place, so it has to be on disk first
+		if (durability != Durability::None)
+		{
+			FILE* snapshot = fopen((filename + ".tmp").c_str(), "ab");
+			const bool synced = snapshot != nullptr && SyncFile(snapshot);
+			if (snapshot != nullptr)
+				fclose(snapshot);
+			if (!synced)
+				throw runtime_error("Syncing " + filename + " failed");
+		}
+		fs::rename(filename + ".tmp", filename);
 	}
 	catch (exception e)
 	{
@@ -155,11 +1126,136 @@ void Storage::Save(const string spreadsheetName, const StoredSpreadsheet& ss)
 	}
 }
 
+/// <summary>
+/// Appends a record of a change to a spreadsheet's edit log: the versions it
+/// added, the undo cursor after it, and the version each cell it moved is now at
+/// </summary>
+/// <param name="spreadsheetName">The name of the spreadsheet changed</param>
+/// <param name="ss">The spreadsheet after the change</param>
+/// <param name="firstVersion">The first version the change added</param>
+/// <param name="cells">The cells the change moved to another version</param>
+void Storage::Append(const string spreadsheetName, const StoredSpreadsheet& ss, const uint32_t firstVersion, const vector<CellId>& cells)
+{
+	// Built whole, then written at once
+	const VersionLog& history = ss.history;
+	ostringstream record;
+	record << "CHANGE\n" << firstVersion << "\n" << history.Size() << "\n" << VersionToString(history.GetLastChange()) << "\n";
+	for (uint32_t i = firstVersion; i < history.Size(); i++)
+		WriteVersion(record, history, i);
+	record << cells.size() << "\n";
+	for (const CellId& cell : cells)
+	{
+		const Cell* found = ss.cells.Find(cell);
+		record << "CELL_VERSION\n" << cell.ToString() << "\n" << VersionToString(found != nullptr ? found->GetVersion() : VersionLog::NoVersion) << "\n";
+	}
+	record << "END\n";
+
+	const string filename = "spreadsheets/" + spreadsheetName + ".wal";
+	unique_lock<mutex> guard(writeLock);
+	if (brokenLogs.count(filename) == 1)
+		throw runtime_error("Could not append to " + filename);
+	pending.push_back(pair<string, string>(filename, record.str()));
+	const uint64_t ticket = ++queued;
+	queuedRecords.notify_one();
+	if (durability != Durability::PerEdit)
+		return;
+
+	writtenRecords.wait(guard, [this, ticket]() { return written >= ticket; });
+	if (failed.erase(ticket) == 1)
+		throw runtime_error("Could not append to " + filename);
+}
+
+bool Storage::BeginCompaction(const string spreadsheetName)
+{
+	lock_guard<mutex> guard(lock);
+	const string log = "spreadsheets/" + spreadsheetName + ".wal";
+	// A log left over from a compaction that failed is only cleared by opening the spreadsheet again
+	if (compacting.count(spreadsheetName) == 1 || fs::exists(log + ".old"))
+		return false;
+	// Every record queued so far is of a change the snapshot taken now will have
+	uint64_t started;
+	{
+		lock_guard<mutex> writeGuard(writeLock);
+		started = queued;
+	}
+	try
+	{
+		if (fs::exists(log))
+			fs::rename(log, log + ".old");
+	}
+	catch (exception e)
+	{
+		return false;
+	}
+	compacting[spreadsheetName] = started;
+	return true;
+}
+
+void Storage::FinishCompaction(const string spreadsheetName, const StoredSpreadsheet& ss)
+{
+	const string log = "spreadsheets/" + spreadsheetName + ".wal";
+	try
+	{
+		Save(spreadsheetName, ss);
+		fs::remove(log + ".old");
+
+		// A log that broke on a record the snapshot has can be started over. Records are only
+		// dropped while it's broken, so the new log holds nothing the snapshot doesn't
+		uint64_t started;
+		{
+			lock_guard<mutex> guard(lock);
+			started = compacting[spreadsheetName];
+		}
+		lock_guard<mutex> writeGuard(writeLock);
+		auto broken = brokenLogs.find(log);
+		if (broken != brokenLogs.end() && broken->second <= started)
+		{
+			fs::remove(log);
+			brokenLogs.erase(broken);
+		}
+	}
+	catch (exception e)
+	{
+		/*the moved log is replayed when the spreadsheet opens*/
+	}
+
+	lock_guard<mutex> guard(lock);
+	compacting.erase(spreadsheetName);
+	compacted.notify_all();
+}
+
+bool Storage::LogFailed(const string spreadsheetName)
+{
+	Flush();
+	WaitForCompaction(spreadsheetName);
+	lock_guard<mutex> guard(writeLock);
+	return brokenLogs.count("spreadsheets/" + spreadsheetName + ".wal") == 1;
+}
+
+void Storage::Checkpoint(const string spreadsheetName, const StoredSpreadsheet& ss)
+{
+	Flush();
+	WaitForCompaction(spreadsheetName);
+	Save(spreadsheetName, ss);
+
+	const string log = "spreadsheets/" + spreadsheetName + ".wal";
+	lock_guard<mutex> guard(writeLock);
+	fs::remove(log + ".old");
+	fs::remove(log);
+	brokenLogs.erase(log);
+}
+
+void Storage::WaitForCompaction(const string spreadsheetName)
+{
+	unique_lock<mutex> guard(lock);
+	compacted.wait(guard, [this, &spreadsheetName]() { return compacting.count(spreadsheetName) == 0; });
+}
+
 /// <summary>
 /// Search through filesystem and return list of all files
-/// with the .sprd extension.
+/// with the .sprd or .wal extension.
 /// </summary>
-/// <returns>List of files that contain .sprd extension</returns>
+/// <returns>List of spreadsheets that have a .sprd or .wal file</returns>
 list<string> Storage::GetSavedSpreadsheetNames()
 {
 	list<string> files;
@@ -170,14 +1266,12 @@ list<string> Storage::GetSavedSpreadsheetNames()
 	{
 		for (auto const& entry : fs::recursive_directory_iterator("spreadsheets"))
 		{
-			if (entry.path().extension() == ".sprd") {
+			// A spreadsheet that hasn't been compacted yet only has a log
+			if (entry.path().extension() == ".sprd" || entry.path().extension() == ".wal") {
 				k = entry.path().filename().string().find('.');
-				if (k > 0) {
-					string s = entry.path().filename().string().substr(0, k);
+				string s = k > 0 ? entry.path().filename().string().substr(0, k) : entry.path().filename().string();
+				if (find(files.begin(), files.end(), s) == files.end())
 					files.push_back(s);
-				}
-				else
-					files.push_back(entry.path().filename().string());
 			}
 
 		}
@@ -3,8 +3,17 @@
 #include <list>
 #include <map>
 #include <stack>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <chrono>
+#include <unordered_set>
+#include <unordered_map>
 #include "Cell.h"
-#include "SpreadsheetState.h"
+#include "CellStore.h"
+#include "VersionLog.h"
 
 using namespace std;
 
@@ -13,41 +22,201 @@ using namespace std;
 #define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
 
 /// <summary>
-/// Simple wrapper struct for the list of Cells and stack of CellEdits 
-/// necessary to represent a spreadsheet
+/// Simple wrapper struct for the store of Cells and the version log
+/// necessary to represent a spreadsheet.
+/// Both share structure with the spreadsheet they came from, so copying
+/// one is O(1), and it never changes once made
 /// </summary>
 struct StoredSpreadsheet {
 public:
 	/// <summary>
 	/// Cells in the spreadsheet
 	/// </summary>
-	set<Cell> cells;
+	CellStore cells;
 	/// <summary>
-	/// Edit history
+	/// Every version of every cell, and the changes that can be undone
 	/// </summary>
-	list<CellEdit> edits;
+	VersionLog history;
+	/// <summary>
+	/// Whether every formula cell holds its compiled formula and every cell its current
+	/// value, so a spreadsheet made from this needs no parsing or recalculation.
+	/// False for cells read from text, or changed by replaying an edit log
+	/// </summary>
+	bool derived;
+	/// <summary>
+	/// Each cell's position in the dependency graph's topological order, or null if
+	/// it wasn't taken. Only used when derived is set
+	/// </summary>
+	shared_ptr<const vector<pair<CellId, int>>> positions;
 
 	/// <summary>
-	/// Creates a new StoredSpreadsheet from cells & edits
+	/// Creates a new StoredSpreadsheet from cells & history
 	/// </summary>
 	/// <param name="cells">Non-empty cells in the spreadsheet</param>
-	/// <param name="edits">Edit history; most recent edit at the top</param>
-	StoredSpreadsheet(set<Cell> cells, list<CellEdit> edits);
+	/// <param name="history">Version log the cells' versions refer to</param>
+	StoredSpreadsheet(const CellStore& cells, const VersionLog& history);
 
 	/// <summary>
-	/// Default constructor, creates this with empty cell & edit lists
+	/// Default constructor, creates this with no cells and an empty history
 	/// </summary>
 	StoredSpreadsheet();
 };
 
+/// <summary>
+/// Saves spreadsheets to the spreadsheets folder. Each spreadsheet is a binary snapshot,
+/// <name>.sprd, and an edit log, <name>.wal, of the changes made since.
+///
+/// Rather than writing the whole spreadsheet after every change, each change appends
+/// a record to the log holding only the versions it added, the cells it moved to other
+/// versions, and the undo cursor. Every record states where things ended up rather than
+/// what was done, so replaying one the snapshot already has changes nothing, as long as
+/// the records after it are replayed too.
+///
+/// Now and then the log is compacted into a new snapshot. The log is first moved aside to
+/// <name>.wal.old, so changes made while the snapshot is written go to a fresh log, then
+/// the snapshot replaces the old one and the old log is deleted. Opening a spreadsheet
+/// reads the snapshot and replays whichever logs are there, oldest first.
+///
+/// Records are written by a thread of the storage's own, so no spreadsheet waits on the
+/// disk unless it asks to. Records from every spreadsheet that queue up while a write is
+/// under way, or within CommitWindow of each other, are written together: one write and
+/// at most one fsync per file (group commit). How durable records are is set by SetDurability
+/// </summary>
 class Storage
 {
 public:
+	/// <summary>
+	/// When logged changes are forced to disk
+	/// </summary>
+	enum class Durability
+	{
+		/// <summary>
+		/// Never: records are written, and the OS saves them when it likes
+		/// </summary>
+		None,
+		/// <summary>
+		/// Once per group of records, after waiting CommitWindow for more to arrive. Append
+		/// doesn't wait, so a crash may lose the changes of the last window, and a failed
+		/// write only shows in the next Append to the same log
+		/// </summary>
+		Batched,
+		/// <summary>
+		/// Before Append returns, so a change is on disk before anyone is told about it.
+		/// Records waiting together still share an fsync
+		/// </summary>
+		PerEdit
+	};
+
+	/// <summary>
+	/// How long the storage thread waits for more records before writing, when Batched
+	/// </summary>
+	static const chrono::milliseconds CommitWindow;
+
+private:
+	/// <summary>
+	/// Durability of every storage, Batched by default
+	/// </summary>
+	static Durability durability;
+
+	/// <summary>
+	/// Records waiting to be written, each with the path of the log it goes in
+	/// </summary>
+	deque<pair<string, string>> pending;
+
+	/// <summary>
+	/// Number of records queued so far, and of those written (and synced, if durability
+	/// asks for it). Records are written in the order they're queued
+	/// </summary>
+	uint64_t queued;
+	uint64_t written;
+
+	/// <summary>
+	/// Records whose write failed, kept only for Appends waiting on them
+	/// </summary>
+	unordered_set<uint64_t> failed;
+
+	/// <summary>
+	/// Logs a record couldn't be written to, each with the last such record. Nothing more is
+	/// written to them, since replaying stops at the gap, until a compaction covering that
+	/// record succeeds
+	/// </summary>
+	unordered_map<string, uint64_t> brokenLogs;
+
+	/// <summary>
+	/// Set when the storage is destroyed, once everything queued is written the thread stops
+	/// </summary>
+	bool stopping;
+
+	/// <summary>
+	/// Guards pending, queued, written, failed, brokenLogs and stopping. The storage thread waits on
+	/// queuedRecords, and callers waiting for their records on writtenRecords
+	/// </summary>
+	mutex writeLock;
+	condition_variable queuedRecords;
+	condition_variable writtenRecords;
+
+	/// <summary>
+	/// Spreadsheets with a compaction started and not yet finished, each with the number
+	/// of records queued when it began
+	/// </summary>
+	unordered_map<string, uint64_t> compacting;
+
+	/// <summary>
+	/// Notified whenever a compaction finishes
+	/// </summary>
+	condition_variable compacted;
+
+	mutex lock;
+
+	/// <summary>
+	/// Writes queued records until the storage is destroyed
+	/// </summary>
+	thread worker;
+
+	/// <summary>
+	/// Body of the storage thread
+	/// </summary>
+	void WriteRecords();
+
+	/// <summary>
+	/// Waits until no compaction of a spreadsheet is running
+	/// </summary>
+	void WaitForCompaction(const string spreadsheetName);
+
+public:
+	/// <summary>
+	/// Creates a storage and starts its thread
+	/// </summary>
+	Storage();
+
+	/// <summary>
+	/// Writes whatever is still queued, then stops the storage thread
+	/// </summary>
+	~Storage();
+
+	Storage(const Storage& other) = delete;
+	Storage& operator= (const Storage& other) = delete;
+
+	/// <summary>
+	/// Sets when logged changes are forced to disk, for every storage.
+	/// Meant to be called once, before anything is saved
+	/// </summary>
+	static void SetDurability(const Durability policy);
+
 	/// <summary>
 	/// This method opens a spreadsheet for a new client by opening the 
 	/// file pertaining to said spreadsheet. Once opened, the contents of 
-	/// the file will be parsed into Cells and CellEdits to then be added 
-	/// to a StoredSpreadsheet object.
+	/// the file will be parsed into Cells and a VersionLog to then be added 
+	/// to a StoredSpreadsheet object. A binary snapshot is mapped into memory
+	/// and read in place, along with the compiled formulas, values and dependency
+	/// order saved with it, which are only used if their checksum matches. Text
+	/// files from before binary snapshots, and files saved before the version
+	/// log existed, with CELL and CELL_EDIT entries, are converted
+	/// as they are read, and replaced by a binary snapshot the next time it's saved.
+	/// The spreadsheet's edit logs are then replayed on top, up to the first
+	/// record left incomplete by a crash, and compacted into a new snapshot.
+	/// Waits for a compaction of the spreadsheet that's still running, and for changes
+	/// still queued, to be written first.
 	/// </summary>
 	/// <param name="filename">The name of the file to be opened</param>
 	/// <returns>Returns the StoredSpreadsheet object containing the cells and cell edits of some spreadsheet</returns>
@@ -55,12 +224,64 @@ public:
 	StoredSpreadsheet Open(string spreadsheetName);
 
 	/// <summary>
-	/// Saves a spreadsheet to file
+	/// Saves a whole spreadsheet to file as its binary snapshot, with what's derived from its contents
+	/// if ss.derived is set, so opening it takes no recalculation. The old snapshot is only replaced
+	/// once the new one is written, and synced unless durability is None. Its edit logs are left alone, replaying them on top is harmless
 	/// </summary>
 	/// <param name="spreadsheetName">Filename</param>
 	/// <param name="ss">Spreadsheet data</param>
 	void Save(const string spreadsheetName, const StoredSpreadsheet& ss);
 
+	/// <summary>
+	/// Queues a change to be appended to a spreadsheet's edit log by the storage thread.
+	/// Changes to a spreadsheet are written in the order they're queued. With PerEdit
+	/// durability, waits until the change is synced, and throws if writing it failed.
+	/// Throws without queuing anything while an earlier record to the log is missing
+	/// </summary>
+	/// <param name="spreadsheetName">Filename</param>
+	/// <param name="ss">Spreadsheet after the change</param>
+	/// <param name="firstVersion">First version the change added, the history's size when the last change was logged</param>
+	/// <param name="cells">Cells the change moved to another version</param>
+	void Append(const string spreadsheetName, const StoredSpreadsheet& ss, const uint32_t firstVersion, const vector<CellId>& cells);
+
+	/// <summary>
+	/// Waits until every change queued so far is written, and synced unless durability is None
+	/// </summary>
+	void Flush();
+
+	/// <summary>
+	/// Starts compacting a spreadsheet by moving its edit log aside, so later changes go to a new
+	/// one. Must be called between changes, and followed by FinishCompaction with the spreadsheet
+	/// as it is now. Only one compaction of a spreadsheet runs at a time
+	/// </summary>
+	/// <param name="spreadsheetName">Filename</param>
+	/// <returns>False if a compaction of the spreadsheet is still running, so this one didn't start</returns>
+	bool BeginCompaction(const string spreadsheetName);
+
+	/// <summary>
+	/// Saves the snapshot of a compaction started by BeginCompaction and deletes the log
+	/// moved aside. Takes as long as Save, so is meant to run away from the spreadsheet's
+	/// thread. If it fails the moved log is kept, and is replayed when the spreadsheet opens
+	/// </summary>
+	/// <param name="spreadsheetName">Filename</param>
+	/// <param name="ss">Spreadsheet as it was when the compaction began</param>
+	void FinishCompaction(const string spreadsheetName, const StoredSpreadsheet& ss);
+
+	/// <summary>
+	/// Waits for a spreadsheet's queued records and compaction, then tells whether its edit log
+	/// is missing a record, so its snapshot and logs don't have all its changes
+	/// </summary>
+	/// <param name="spreadsheetName">Filename</param>
+	bool LogFailed(const string spreadsheetName);
+
+	/// <summary>
+	/// Saves a whole spreadsheet like Save, once its queued records and compaction are done,
+	/// then deletes its edit logs, which the snapshot has everything of. Throws if saving fails
+	/// </summary>
+	/// <param name="spreadsheetName">Filename</param>
+	/// <param name="ss">Spreadsheet as it is now, with no changes to it still to come</param>
+	void Checkpoint(const string spreadsheetName, const StoredSpreadsheet& ss);
+
 	/// <summary>
 	/// Gets all spreadsheets on file
 	/// </summary>
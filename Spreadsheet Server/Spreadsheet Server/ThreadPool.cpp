@@ -0,0 +1,112 @@
+#include "ThreadPool.h"
+
+// See ThreadPool.h for documentation
+
+ThreadPool::ThreadPool(const size_t threads) : queues(), workers(), queued(0), stopping(false) {
+	size_t count = threads;
+	if (count == 0)
+		count = thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() - 1 : 1;
+
+	// The last queue belongs to whichever thread calls ParallelFor
+	for (size_t i = 0; i <= count; i++)
+		queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+	for (size_t i = 0; i < count; i++)
+		workers.push_back(thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (thread& worker : workers)
+		worker.join();
+}
+
+ThreadPool& ThreadPool::Shared() {
+	static ThreadPool pool(0);
+	return pool;
+}
+
+const size_t ThreadPool::Concurrency() const {
+	return workers.size() + 1;
+}
+
+bool ThreadPool::RunTask(const size_t home) {
+	function<void()> task;
+
+	// Newest task from our own queue keeps its data warm in cache
+	{
+		lock_guard<mutex> guard(queues[home]->lock);
+		if (queues[home]->tasks.size() != 0) {
+			task = move(queues[home]->tasks.back());
+			queues[home]->tasks.pop_back();
+		}
+	}
+
+	// Otherwise steal the oldest task from someone else
+	for (size_t offset = 1; !task && offset < queues.size(); offset++) {
+		WorkQueue& victim = *queues[(home + offset) % queues.size()];
+		lock_guard<mutex> guard(victim.lock);
+		if (victim.tasks.size() != 0) {
+			task = move(victim.tasks.front());
+			victim.tasks.pop_front();
+		}
+	}
+
+	if (!task)
+		return false;
+	queued--;
+	task();
+	return true;
+}
+
+void ThreadPool::WorkerLoop(const size_t home) {
+	while (true) {
+		if (RunTask(home))
+			continue;
+
+		unique_lock<mutex> guard(sleepLock);
+		wake.wait(guard, [this] { return stopping || queued > 0; });
+		if (stopping)
+			return;
+	}
+}
+
+void ThreadPool::ParallelFor(const size_t count, const size_t grain, const function<void(size_t)>& body) {
+	if (count == 0)
+		return;
+	size_t step = grain == 0 ? 1 : grain;
+	size_t chunks = (count + step - 1) / step;
+	if (chunks == 1 || workers.size() == 0) {
+		for (size_t i = 0; i < count; i++)
+			body(i);
+		return;
+	}
+
+	// Deal chunks out across every queue so workers start without stealing
+	shared_ptr<atomic<size_t>> remaining = make_shared<atomic<size_t>>(chunks);
+	for (size_t chunk = 0; chunk < chunks; chunk++) {
+		size_t begin = chunk * step;
+		size_t end = begin + step < count ? begin + step : count;
+		WorkQueue& target = *queues[chunk % queues.size()];
+		lock_guard<mutex> guard(target.lock);
+		target.tasks.push_back([&body, begin, end, remaining]() {
+			for (size_t i = begin; i < end; i++)
+				body(i);
+			(*remaining)--;
+		});
+		queued++;
+	}
+	{
+		lock_guard<mutex> guard(sleepLock);
+	}
+	wake.notify_all();
+
+	// Help out until every chunk has finished
+	size_t home = queues.size() - 1;
+	while (*remaining > 0)
+		if (!RunTask(home))
+			this_thread::yield();
+}
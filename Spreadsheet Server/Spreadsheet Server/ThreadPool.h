@@ -0,0 +1,108 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#ifndef ThreadPool_H
+#define ThreadPool_H
+
+using namespace std;
+
+/// <summary>
+/// A fixed set of worker threads for splitting CPU-heavy work, such as
+/// recalculating a large spreadsheet, across cores.
+/// Each worker owns a deque of tasks: it runs its own tasks newest first and,
+/// once it runs dry, steals the oldest tasks from other workers
+/// </summary>
+class ThreadPool
+{
+private:
+	/// <summary>
+	/// Tasks owned by one worker
+	/// </summary>
+	struct WorkQueue {
+		mutex lock;
+		deque<function<void()>> tasks;
+	};
+
+	/// <summary>
+	/// One queue per worker, plus one for threads calling ParallelFor
+	/// </summary>
+	vector<unique_ptr<WorkQueue>> queues;
+
+	/// <summary>
+	/// Worker threads
+	/// </summary>
+	vector<thread> workers;
+
+	/// <summary>
+	/// Number of queued tasks that haven't been started yet
+	/// </summary>
+	atomic<size_t> queued;
+
+	/// <summary>
+	/// Set when the pool is being destroyed
+	/// </summary>
+	bool stopping;
+
+	/// <summary>
+	/// Used by idle workers to sleep until tasks are queued
+	/// </summary>
+	mutex sleepLock;
+	condition_variable wake;
+
+	/// <summary>
+	/// Runs one task, taking it from the back of queue home if possible,
+	/// otherwise stealing from the front of another queue
+	/// </summary>
+	/// <param name="home">Index of the calling thread's queue</param>
+	/// <returns>True if a task was run, false if every queue was empty</returns>
+	bool RunTask(const size_t home);
+
+	/// <summary>
+	/// Main loop of a worker thread
+	/// </summary>
+	/// <param name="home">Index of this worker's queue</param>
+	void WorkerLoop(const size_t home);
+
+public:
+	/// <summary>
+	/// Creates a pool and starts its workers
+	/// </summary>
+	/// <param name="threads">Number of worker threads, 0 to use one per core</param>
+	ThreadPool(const size_t threads);
+
+	/// <summary>
+	/// Stops and joins all workers. Tasks still queued are dropped
+	/// </summary>
+	~ThreadPool();
+
+	/// <summary>
+	/// Gets the pool shared by the whole server, sized to the machine
+	/// </summary>
+	/// <returns>The shared pool</returns>
+	static ThreadPool& Shared();
+
+	/// <summary>
+	/// Number of threads that run work, counting the thread calling ParallelFor
+	/// </summary>
+	/// <returns>Worker count + 1</returns>
+	const size_t Concurrency() const;
+
+	/// <summary>
+	/// Runs body(i) for every i in [0, count), spread across the pool in chunks of
+	/// grain indices. The calling thread helps run chunks and returns once all
+	/// of them are done. body must not throw
+	/// </summary>
+	/// <param name="count">Number of indices</param>
+	/// <param name="grain">Indices per task</param>
+	/// <param name="body">Work to do for each index</param>
+	void ParallelFor(const size_t count, const size_t grain, const function<void(size_t)>& body);
+};
+
+#endif
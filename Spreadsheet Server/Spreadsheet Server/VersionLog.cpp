@@ -0,0 +1,361 @@
+#include "VersionLog.h"
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+
+// See VersionLog.h for documentation
+
+static_assert(is_trivially_copyable<VersionLog::Version>::value, "Versions are spilled as raw bytes");
+
+/// <summary>
+/// Smallest text block. Contents longer than this get a block of their own
+/// </summary>
+static const size_t BlockSize = 1 << 16;
+
+/// <summary>
+/// Last owner handed out by NewOwner
+/// </summary>
+static atomic<uint64_t> lastOwner(0);
+
+size_t VersionLog::hotWindow = 64 * ChunkVersions;
+
+void VersionLog::SetHotWindow(const size_t versions) {
+	hotWindow = versions;
+}
+
+VersionLog::VersionLog() : chunks(make_shared<const vector<ChunkSlot>>()), blocks(make_shared<const vector<shared_ptr<Block>>>()),
+	spill(), spilled(0), count(0), blockUsed(0), cursor(NoVersion), owner(NewOwner()) {
+}
+
+// A copy never owns anything, so it copies the last chunk and block before
+// appending to them, and the log it came from keeps appending in place
+VersionLog::VersionLog(const VersionLog& other) : chunks(other.chunks), blocks(other.blocks),
+	spill(other.spill), spilled(other.spilled), count(other.count), blockUsed(other.blockUsed), cursor(other.cursor), owner(NewOwner()) {
+}
+
+VersionLog::VersionLog(VersionLog&& other) : chunks(move(other.chunks)), blocks(move(other.blocks)),
+	spill(move(other.spill)), spilled(other.spilled), count(other.count), blockUsed(other.blockUsed), cursor(other.cursor), owner(other.owner) {
+	other = VersionLog();
+}
+
+VersionLog& VersionLog::operator= (const VersionLog& other) {
+	if (this != &other) {
+		chunks = other.chunks;
+		blocks = other.blocks;
+		spill = other.spill;
+		spilled = other.spilled;
+		count = other.count;
+		blockUsed = other.blockUsed;
+		cursor = other.cursor;
+		owner = NewOwner();
+	}
+	return *this;
+}
+
+VersionLog& VersionLog::operator= (VersionLog&& other) {
+	if (this != &other) {
+		chunks = move(other.chunks);
+		blocks = move(other.blocks);
+		spill = move(other.spill);
+		spilled = other.spilled;
+		count = other.count;
+		blockUsed = other.blockUsed;
+		cursor = other.cursor;
+		owner = other.owner;
+		other.chunks = make_shared<const vector<ChunkSlot>>();
+		other.blocks = make_shared<const vector<shared_ptr<Block>>>();
+		other.spill.reset();
+		other.spilled = 0;
+		other.count = 0;
+		other.blockUsed = 0;
+		other.cursor = NoVersion;
+		other.owner = NewOwner();
+	}
+	return *this;
+}
+
+uint64_t VersionLog::NewOwner() {
+	return ++lastOwner;
+}
+
+uint32_t VersionLog::Size() const {
+	return count;
+}
+
+VersionLog::Version VersionLog::Get(const uint32_t version) const {
+	const ChunkSlot& slot = (*chunks)[version / ChunkVersions];
+	if (slot.chunk)
+		return slot.chunk->versions[version % ChunkVersions];
+	return ReadSpilled(version, nullptr);
+}
+
+string VersionLog::GetContents(const uint32_t version) const {
+	if (version == NoVersion)
+		return "";
+	const ChunkSlot& slot = (*chunks)[version / ChunkVersions];
+	if (!slot.chunk) {
+		string contents;
+		ReadSpilled(version, &contents);
+		return contents;
+	}
+	const Version& found = slot.chunk->versions[version % ChunkVersions];
+	if (found.length == 0)
+		return "";
+	return string((*blocks)[found.block]->text.get() + found.offset, found.length);
+}
+
+// A spilled chunk is its versions as raw bytes, their offsets rewritten to
+// point into the text that follows them, then the text of every version
+VersionLog::Version VersionLog::ReadSpilled(const uint32_t version, string* contents) const {
+	shared_ptr<const string> record = spill->Read((*chunks)[version / ChunkVersions].spilledAt);
+	Version found;
+	memcpy(&found, record->data() + (version % ChunkVersions) * sizeof(Version), sizeof(Version));
+	if (contents != nullptr)
+		contents->assign(record->data() + ChunkVersions * sizeof(Version) + found.offset, found.length);
+	return found;
+}
+
+void VersionLog::StoreText(const char* text, const size_t size, Version& version) {
+	if (size > UINT32_MAX)
+		throw length_error("Cell contents are too long to store");
+
+	vector<shared_ptr<Block>> added;
+	const Block* last = blocks->empty() ? nullptr : blocks->back().get();
+	if (last == nullptr || blockUsed + size > last->capacity) {
+		// Start a new block; the old one keeps its unused tail
+		shared_ptr<Block> block = make_shared<Block>();
+		block->owner = owner;
+		block->capacity = max(BlockSize, size);
+		block->text.reset(new char[block->capacity]);
+		added = *blocks;
+		added.push_back(block);
+		blocks = make_shared<const vector<shared_ptr<Block>>>(move(added));
+		blockUsed = 0;
+	}
+	else if (last->owner != owner) {
+		// Shared with the log this was copied from, which may still append to it
+		shared_ptr<Block> block = make_shared<Block>();
+		block->owner = owner;
+		block->capacity = last->capacity;
+		block->text.reset(new char[block->capacity]);
+		memcpy(block->text.get(), last->text.get(), blockUsed);
+		added = *blocks;
+		added.back() = block;
+		blocks = make_shared<const vector<shared_ptr<Block>>>(move(added));
+	}
+
+	Block& block = *blocks->back();
+	if (size != 0)
+		memcpy(block.text.get() + blockUsed, text, size);
+	version.block = (uint32_t)(blocks->size() - 1);
+	version.offset = (uint32_t)blockUsed;
+	version.length = (uint32_t)size;
+	blockUsed += size;
+}
+
+uint32_t VersionLog::Append(const Version& version) {
+	if (count == NoVersion)
+		throw length_error("Version log is full");
+
+	const uint32_t slot = count % ChunkVersions;
+	if (slot == 0) {
+		shared_ptr<Chunk> chunk = make_shared<Chunk>();
+		chunk->owner = owner;
+		chunk->firstBlock = UINT32_MAX;
+		vector<ChunkSlot> added(*chunks);
+		added.push_back(ChunkSlot{ chunk, 0 });
+		chunks = make_shared<const vector<ChunkSlot>>(move(added));
+	}
+	else if (chunks->back().chunk->owner != owner) {
+		// Copy only the slots in use, the owner may be filling the rest
+		const Chunk& shared = *chunks->back().chunk;
+		shared_ptr<Chunk> chunk = make_shared<Chunk>();
+		chunk->owner = owner;
+		chunk->firstBlock = UINT32_MAX;
+		for (uint32_t i = 0; i < slot; i++) {
+			chunk->versions[i] = shared.versions[i];
+			if (shared.versions[i].length != 0)
+				chunk->firstBlock = min(chunk->firstBlock, shared.versions[i].block);
+		}
+		vector<ChunkSlot> added(*chunks);
+		added.back().chunk = chunk;
+		chunks = make_shared<const vector<ChunkSlot>>(move(added));
+	}
+
+	Chunk& chunk = *chunks->back().chunk;
+	chunk.versions[slot] = version;
+	if (version.length != 0)
+		chunk.firstBlock = min(chunk.firstBlock, version.block);
+	count++;
+
+	if (slot == ChunkVersions - 1 && spill)
+		Spill();
+	return count - 1;
+}
+
+void VersionLog::Spill() {
+	// Whole chunks within the window stay, as does the one being filled
+	const size_t hotChunks = hotWindow / ChunkVersions + (hotWindow % ChunkVersions != 0) + 1;
+	if (chunks->size() - spilled <= hotChunks)
+		return;
+
+	vector<ChunkSlot> slots(*chunks);
+	while (slots.size() - spilled > hotChunks) {
+		const Chunk& chunk = *slots[spilled].chunk;
+		string record(ChunkVersions * sizeof(Version), '\0');
+		string text;
+		for (uint32_t i = 0; i < ChunkVersions; i++) {
+			Version version = chunk.versions[i];
+			if (version.length != 0)
+				text.append((*blocks)[version.block]->text.get() + version.offset, version.length);
+			version.block = 0;
+			version.offset = (uint32_t)(text.size() - version.length);
+			memcpy(&record[i * sizeof(Version)], &version, sizeof(Version));
+		}
+		record += text;
+		slots[spilled] = ChunkSlot{ nullptr, spill->Append(record) };
+		spilled++;
+	}
+
+	// Blocks below the lowest one a chunk in memory uses hold text of spilled versions only.
+	// The block being filled always stays
+	uint32_t keep = (uint32_t)(blocks->size() - 1);
+	for (size_t i = spilled; i < slots.size(); i++)
+		keep = min(keep, slots[i].chunk->firstBlock);
+	chunks = make_shared<const vector<ChunkSlot>>(move(slots));
+
+	if (keep != 0 && (*blocks)[keep - 1]) {
+		vector<shared_ptr<Block>> kept(*blocks);
+		for (uint32_t i = 0; i < keep; i++)
+			kept[i].reset();
+		blocks = make_shared<const vector<shared_ptr<Block>>>(move(kept));
+	}
+}
+
+uint32_t VersionLog::RecordEdit(const CellId cell, const string& contents, const uint32_t current) {
+	Version version;
+	version.cell = cell;
+	StoreText(contents.data(), contents.size(), version);
+	version.previous = current;
+	version.replaced = current;
+	version.undoPrevious = cursor;
+	cursor = Append(version);
+	return cursor;
+}
+
+uint32_t VersionLog::RecordRevert(const CellId cell, const uint32_t current) {
+	// The change points at the contents reverted to, and the cell goes back to
+	// the version holding them, so its history below stays as it was
+	const uint32_t restored = Get(current).previous;
+	Version version;
+	version.cell = cell;
+	if (restored == NoVersion) {
+		version.block = 0;
+		version.offset = 0;
+		version.length = 0;
+	}
+	else if ((*chunks)[restored / ChunkVersions].chunk) {
+		// Share the text while it's in memory
+		const Version& source = (*chunks)[restored / ChunkVersions].chunk->versions[restored % ChunkVersions];
+		version.block = source.block;
+		version.offset = source.offset;
+		version.length = source.length;
+	}
+	else {
+		// Spilled, so the text comes back from the file and goes in memory again
+		const string contents = GetContents(restored);
+		StoreText(contents.data(), contents.size(), version);
+	}
+	version.previous = restored;
+	version.replaced = current;
+	version.undoPrevious = cursor;
+	cursor = Append(version);
+	return restored;
+}
+
+uint32_t VersionLog::RecordGroup(const uint32_t first) {
+	// The marker takes the place of the group's edits in the chain of changes
+	Version marker;
+	marker.cell = CellId();
+	marker.block = 0;
+	marker.offset = 0;
+	marker.length = 0;
+	marker.previous = first;
+	marker.replaced = NoVersion;
+	marker.undoPrevious = Get(first).undoPrevious;
+	cursor = Append(marker);
+	return cursor;
+}
+
+bool VersionLog::IsGroup(const uint32_t version) const {
+	return !Get(version).cell.IsValid();
+}
+
+uint32_t VersionLog::GetLastChange() const {
+	return cursor;
+}
+
+void VersionLog::Undo() {
+	cursor = Get(cursor).undoPrevious;
+}
+
+uint32_t VersionLog::Load(const CellId cell, const string& contents, const uint32_t previous, const uint32_t replaced, const uint32_t undoPrevious) {
+	return Load(cell, contents.data(), contents.size(), previous, replaced, undoPrevious);
+}
+
+uint32_t VersionLog::Load(const CellId cell, const char* contents, const size_t length, const uint32_t previous, const uint32_t replaced, const uint32_t undoPrevious) {
+	Version version;
+	version.cell = cell;
+	StoreText(contents, length, version);
+	version.previous = previous;
+	version.replaced = replaced;
+	version.undoPrevious = undoPrevious;
+	return Append(version);
+}
+
+void VersionLog::SetLastChange(const uint32_t change) {
+	cursor = change;
+}
+
+void VersionLog::ForEachChange(const function<void(uint32_t)>& visit) const {
+	for (uint32_t change = cursor; change != NoVersion; change = Get(change).undoPrevious)
+		visit(change);
+}
+
+void VersionLog::SpillTo(const shared_ptr<HistoryFile> file) {
+	spill = file;
+}
+
+const shared_ptr<HistoryFile>& VersionLog::GetHistoryFile() const {
+	return spill;
+}
+
+uint32_t VersionLog::SpilledChunks() const {
+	return spilled;
+}
+
+uint64_t VersionLog::GetSpilledOffset(const uint32_t chunk) const {
+	return (*chunks)[chunk].spilledAt;
+}
+
+size_t VersionLog::GetMemoryUsage() const {
+	size_t bytes = chunks->size() * sizeof(ChunkSlot) + blocks->size() * sizeof(shared_ptr<Block>);
+	for (const ChunkSlot& slot : *chunks)
+		if (slot.chunk)
+			bytes += sizeof(Chunk);
+	for (const shared_ptr<Block>& block : *blocks)
+		if (block)
+			bytes += sizeof(Block) + block->capacity;
+	return bytes;
+}
+
+void VersionLog::LoadSpilled(const uint64_t offset) {
+	if (!spill || count != spilled * ChunkVersions)
+		throw logic_error("Spilled chunks must be loaded first, into a log with a history file");
+	vector<ChunkSlot> added(*chunks);
+	added.push_back(ChunkSlot{ nullptr, offset });
+	chunks = make_shared<const vector<ChunkSlot>>(move(added));
+	spilled++;
+	count += ChunkVersions;
+}
@@ -0,0 +1,348 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include "CellId.h"
+#include "HistoryFile.h"
+
+#ifndef VersionLog_H
+#define VersionLog_H
+
+using namespace std;
+
+/// <summary>
+/// The whole history of one spreadsheet: an append-only log of versions, each
+/// the contents some cell was given. Versions are numbered in the order they
+/// were appended, and their contents are kept back to back in large text blocks
+/// rather than as a string each.
+///
+/// Each cell keeps the number of its current version (see Cell::GetVersion).
+/// A version links to the version below it in its cell's revert history, so
+/// reverting a cell only moves it to that version. Every edit and revert also
+/// links to the change made before it, and the log keeps a cursor on the most
+/// recent change, so undoing only moves the cursor back one change and puts its
+/// cell back on the version the change replaced. Nothing is ever copied or removed.
+///
+/// Edits made together, like pasting a block of cells, are appended one after another
+/// and followed by a group marker: a version with no cell, recorded as the change
+/// instead of them, so that undoing it puts back every cell of the group at once.
+///
+/// Versions live in fixed-size chunks. Copying a log shares its chunks, so it
+/// takes O(1) time, and a copy may be read on one thread while the log it was
+/// copied from keeps appending on another: appends only write slots past the end
+/// of every copy. Only the log that created a chunk appends to it in place;
+/// a copy that appends first copies the last chunk and text block for itself.
+///
+/// Given a HistoryFile, a log keeps only its most recent versions in memory, the
+/// hot window. Older chunks are spilled to the file, each with the text of its
+/// versions, and read back from it whenever reverting or undoing reaches them,
+/// so the memory a log takes doesn't grow with its age
+/// </summary>
+class VersionLog
+{
+public:
+	/// <summary>
+	/// Version number meaning no version: the empty contents every cell starts with
+	/// </summary>
+	static const uint32_t NoVersion = UINT32_MAX;
+
+	/// <summary>
+	/// Versions held by each chunk
+	/// </summary>
+	static const uint32_t ChunkVersions = 1024;
+
+	/// <summary>
+	/// One entry of the log
+	/// </summary>
+	struct Version
+	{
+		/// <summary>
+		/// Cell given these contents. Invalid for a group marker, whose previous is the
+		/// first version of its group; the group runs from there up to the marker
+		/// </summary>
+		CellId cell;
+
+		/// <summary>
+		/// Where the contents are: text block, offset into it and length
+		/// </summary>
+		uint32_t block;
+		uint32_t offset;
+		uint32_t length;
+
+		/// <summary>
+		/// Version the cell goes back to when reverted from this one
+		/// </summary>
+		uint32_t previous;
+
+		/// <summary>
+		/// Version of the cell before the change that appended this one, which undo puts back
+		/// </summary>
+		uint32_t replaced;
+
+		/// <summary>
+		/// Change made before the one that appended this version, the next to undo after it.
+		/// NoVersion if there is none, or if this version isn't a change that can be undone
+		/// </summary>
+		uint32_t undoPrevious;
+	};
+
+private:
+	struct Chunk
+	{
+		/// <summary>
+		/// Log allowed to append to this chunk in place
+		/// </summary>
+		uint64_t owner;
+
+		/// <summary>
+		/// Lowest text block holding text of a version in this chunk, UINT32_MAX if none.
+		/// Blocks below the lowest of every chunk in memory are no longer needed
+		/// </summary>
+		uint32_t firstBlock;
+
+		Version versions[ChunkVersions];
+	};
+
+	/// <summary>
+	/// A chunk in memory, or where it was spilled to if chunk is null
+	/// </summary>
+	struct ChunkSlot
+	{
+		shared_ptr<Chunk> chunk;
+		uint64_t spilledAt;
+	};
+
+	struct Block
+	{
+		/// <summary>
+		/// Log allowed to append to this block in place
+		/// </summary>
+		uint64_t owner;
+		size_t capacity;
+		unique_ptr<char[]> text;
+	};
+
+	/// <summary>
+	/// Chunks and text blocks in order. Never changed once shared, a new
+	/// vector is made whenever one is added or spilled. Blocks no longer
+	/// needed once their chunks are spilled are null
+	/// </summary>
+	shared_ptr<const vector<ChunkSlot>> chunks;
+	shared_ptr<const vector<shared_ptr<Block>>> blocks;
+
+	/// <summary>
+	/// File older chunks are spilled to, null to keep everything in memory
+	/// </summary>
+	shared_ptr<HistoryFile> spill;
+
+	/// <summary>
+	/// Number of chunks spilled to the file. Every chunk before this one is spilled,
+	/// every chunk from it on is in memory
+	/// </summary>
+	uint32_t spilled;
+
+	/// <summary>
+	/// Versions kept in memory when spilling, rounded up to whole chunks
+	/// </summary>
+	static size_t hotWindow;
+
+	/// <summary>
+	/// Number of versions in this log
+	/// </summary>
+	uint32_t count;
+
+	/// <summary>
+	/// Bytes used in the last text block
+	/// </summary>
+	size_t blockUsed;
+
+	/// <summary>
+	/// Most recent change that hasn't been undone, NoVersion if none
+	/// </summary>
+	uint32_t cursor;
+
+	/// <summary>
+	/// Chunks and blocks this log created, and may append to in place
+	/// </summary>
+	uint64_t owner;
+
+	/// <summary>
+	/// Returns an owner no log has had before
+	/// </summary>
+	static uint64_t NewOwner();
+
+	/// <summary>
+	/// Copies text to the end of the last text block, starting a new block if it doesn't fit
+	/// </summary>
+	/// <param name="text">Text to store</param>
+	/// <param name="size">Length of text</param>
+	/// <param name="version">Receives the block, offset and length of the copy</param>
+	void StoreText(const char* text, const size_t size, Version& version);
+
+	/// <summary>
+	/// Appends a version whose contents are already stored
+	/// </summary>
+	/// <returns>The new version's number</returns>
+	uint32_t Append(const Version& version);
+
+	/// <summary>
+	/// Spills the chunks older than the hot window to the history file,
+	/// and lets go of the text blocks only they used
+	/// </summary>
+	void Spill();
+
+	/// <summary>
+	/// Reads a version of a spilled chunk, and its contents if contents isn't null
+	/// </summary>
+	Version ReadSpilled(const uint32_t version, string* contents) const;
+
+public:
+	/// <summary>
+	/// Creates an empty log
+	/// </summary>
+	VersionLog();
+
+	VersionLog(const VersionLog& other);
+	VersionLog(VersionLog&& other);
+	VersionLog& operator= (const VersionLog& other);
+	VersionLog& operator= (VersionLog&& other);
+
+	/// <summary>
+	/// Number of versions in this log
+	/// </summary>
+	uint32_t Size() const;
+
+	/// <summary>
+	/// Gets a version, which must be in this log. Reads it from the history
+	/// file if it was spilled
+	/// </summary>
+	Version Get(const uint32_t version) const;
+
+	/// <summary>
+	/// Gets the contents of a version, empty for NoVersion. Reads them from
+	/// the history file if the version was spilled
+	/// </summary>
+	string GetContents(const uint32_t version) const;
+
+	/// <summary>
+	/// Starts spilling versions older than the hot window to a history file.
+	/// Meant to be called on an empty log, before loading it
+	/// </summary>
+	/// <param name="file">File to spill to</param>
+	void SpillTo(const shared_ptr<HistoryFile> file);
+
+	/// <summary>
+	/// Gets the file this log spills to, null if it keeps everything in memory
+	/// </summary>
+	const shared_ptr<HistoryFile>& GetHistoryFile() const;
+
+	/// <summary>
+	/// Number of chunks spilled to the history file, which hold the first
+	/// SpilledChunks() * ChunkVersions versions
+	/// </summary>
+	uint32_t SpilledChunks() const;
+
+	/// <summary>
+	/// Where a spilled chunk is in the history file, for saving the log
+	/// </summary>
+	/// <param name="chunk">Chunk number, below SpilledChunks()</param>
+	uint64_t GetSpilledOffset(const uint32_t chunk) const;
+
+	/// <summary>
+	/// Estimates the memory this log holds: its chunks in memory and its text blocks.
+	/// Chunks and blocks shared with copies of the log are counted in full
+	/// </summary>
+	/// <returns>Bytes used</returns>
+	size_t GetMemoryUsage() const;
+
+	/// <summary>
+	/// Appends a chunk that was spilled to this log's history file, for loading
+	/// a saved log. Must come before any other version is loaded, and
+	/// is only read from the file when needed
+	/// </summary>
+	/// <param name="offset">Offset returned by GetSpilledOffset when the log was saved</param>
+	void LoadSpilled(const uint64_t offset);
+
+	/// <summary>
+	/// Sets how many of the most recent versions logs keep in memory when
+	/// they have a history file. Rounded up to whole chunks
+	/// </summary>
+	/// <param name="versions">Versions to keep, SIZE_MAX to never spill</param>
+	static void SetHotWindow(const size_t versions);
+
+	/// <summary>
+	/// Records an edit of a cell as a new version, the most recent change
+	/// </summary>
+	/// <param name="cell">Cell edited</param>
+	/// <param name="contents">New contents</param>
+	/// <param name="current">Version of the cell before the edit</param>
+	/// <returns>The cell's new version</returns>
+	uint32_t RecordEdit(const CellId cell, const string& contents, const uint32_t current);
+
+	/// <summary>
+	/// Records a revert of a cell as the most recent change. The contents
+	/// reverted to are shared with the version they come from, not copied
+	/// </summary>
+	/// <param name="cell">Cell reverted</param>
+	/// <param name="current">Version of the cell before the revert, not NoVersion</param>
+	/// <returns>The cell's new version: the previous version of current</returns>
+	uint32_t RecordRevert(const CellId cell, const uint32_t current);
+
+	/// <summary>
+	/// Records the edits appended since first as one group, undone together, by appending
+	/// a group marker for them. The marker becomes the most recent change in their place
+	/// </summary>
+	/// <param name="first">Version appended by the group's first edit</param>
+	/// <returns>The group marker</returns>
+	uint32_t RecordGroup(const uint32_t first);
+
+	/// <summary>
+	/// Checks whether a version is a group marker rather than contents of a cell
+	/// </summary>
+	bool IsGroup(const uint32_t version) const;
+
+	/// <summary>
+	/// Most recent change that hasn't been undone. Undoing it puts its cell
+	/// back on the version it replaced
+	/// </summary>
+	/// <returns>The version appended by the change, NoVersion if there's nothing to undo</returns>
+	uint32_t GetLastChange() const;
+
+	/// <summary>
+	/// Marks the most recent change as undone, which must exist. Putting its
+	/// cell back on the version it replaced, or every cell of its group back
+	/// on the versions they replaced, is up to the caller
+	/// </summary>
+	void Undo();
+
+	/// <summary>
+	/// Appends a version exactly as given, for loading a saved log.
+	/// Does not touch the undo cursor
+	/// </summary>
+	/// <returns>The new version's number</returns>
+	uint32_t Load(const CellId cell, const string& contents, const uint32_t previous, const uint32_t replaced, const uint32_t undoPrevious);
+
+	/// <summary>
+	/// Appends a version exactly as given, copying its contents straight from
+	/// memory such as a mapped file. Does not touch the undo cursor
+	/// </summary>
+	/// <returns>The new version's number</returns>
+	uint32_t Load(const CellId cell, const char* contents, const size_t length, const uint32_t previous, const uint32_t replaced, const uint32_t undoPrevious);
+
+	/// <summary>
+	/// Sets the most recent change, for loading a saved log
+	/// </summary>
+	/// <param name="change">Version appended by the change, or NoVersion</param>
+	void SetLastChange(const uint32_t change);
+
+	/// <summary>
+	/// Calls visit on every change that can still be undone, most recent first
+	/// </summary>
+	/// <param name="visit">Called with the version each change appended</param>
+	void ForEachChange(const function<void(uint32_t)>& visit) const;
+};
+
+#endif